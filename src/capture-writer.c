@@ -0,0 +1,140 @@
+/*
+ * Stereoscopic cube example
+ *
+ * Written 2013 by Neil Roberts <neil@linux.intel.com>
+ * Dedicated to the Public Domain.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture-writer.h"
+#include "util.h"
+
+/* A job with a NULL filename tells the thread to stop */
+struct capture_job {
+        char *filename;
+        uint8_t *pixels;
+        int width, height;
+};
+
+struct capture_writer {
+        GThread *thread;
+        GAsyncQueue *queue;
+};
+
+/* Converts the image to 24-bit RGB after a PPM header and writes it */
+static void
+write_capture(const struct capture_job *job)
+{
+        char header[64];
+        size_t header_length, length;
+        const uint32_t *src;
+        uint8_t *data, *dst;
+        int i, ret;
+
+        header_length = snprintf(header, sizeof header,
+                                 "P6\n%i %i\n255\n",
+                                 job->width, job->height);
+        length = header_length + (size_t) job->width * job->height * 3;
+
+        data = xmalloc(length);
+        memcpy(data, header, header_length);
+
+        src = (const uint32_t *) job->pixels;
+        dst = data + header_length;
+
+        for (i = 0; i < job->width * job->height; i++) {
+                *(dst++) = src[i] >> 16;
+                *(dst++) = src[i] >> 8;
+                *(dst++) = src[i];
+        }
+
+        ret = write_file(job->filename, data, length);
+        if (ret) {
+                errno = -ret;
+                fprintf(stderr, "error writing %s: %m\n", job->filename);
+        }
+
+        free(data);
+}
+
+static gpointer
+writer_thread_func(gpointer data)
+{
+        struct capture_writer *writer = data;
+        struct capture_job *job;
+
+        while (1) {
+                job = g_async_queue_pop(writer->queue);
+
+                if (job->filename == NULL) {
+                        free(job);
+                        break;
+                }
+
+                write_capture(job);
+
+                free(job->filename);
+                free(job->pixels);
+                free(job);
+        }
+
+        return NULL;
+}
+
+struct capture_writer *
+capture_writer_new(void)
+{
+        struct capture_writer *writer = xmalloc(sizeof *writer);
+
+        writer->queue = g_async_queue_new();
+        writer->thread = g_thread_new("capture-writer",
+                                      writer_thread_func,
+                                      writer);
+
+        return writer;
+}
+
+void
+capture_writer_queue(struct capture_writer *writer,
+                     const char *filename,
+                     const void *pixels,
+                     int width, int height,
+                     int stride)
+{
+        struct capture_job *job = xmalloc(sizeof *job);
+        int y;
+
+        job->filename = xmalloc(strlen(filename) + 1);
+        strcpy(job->filename, filename);
+        job->width = width;
+        job->height = height;
+
+        /* The rows are packed so the thread doesn't need the stride */
+        job->pixels = xmalloc((size_t) width * height * sizeof (uint32_t));
+        for (y = 0; y < height; y++)
+                memcpy(job->pixels + (size_t) y * width * sizeof (uint32_t),
+                       (const uint8_t *) pixels + (size_t) y * stride,
+                       width * sizeof (uint32_t));
+
+        g_async_queue_push(writer->queue, job);
+}
+
+void
+capture_writer_free(struct capture_writer *writer)
+{
+        struct capture_job *job = xmalloc(sizeof *job);
+
+        memset(job, 0, sizeof *job);
+        g_async_queue_push(writer->queue, job);
+
+        g_thread_join(writer->thread);
+        g_async_queue_unref(writer->queue);
+        free(writer);
+}
@@ -0,0 +1,34 @@
+/*
+ * Stereoscopic cube example
+ *
+ * Written 2013 by Neil Roberts <neil@linux.intel.com>
+ * Dedicated to the Public Domain.
+ */
+
+#ifndef CAPTURE_WRITER_H
+#define CAPTURE_WRITER_H
+
+#include <stdint.h>
+
+/* Writes captured frames to disk from a thread so that the caller
+ * never waits for the file system */
+struct capture_writer;
+
+struct capture_writer *
+capture_writer_new(void);
+
+/* Queues an XRGB8888 image to be written as a binary PPM file.
+ * stride is in bytes. The pixels are copied so the caller can reuse
+ * the buffer straight away. */
+void
+capture_writer_queue(struct capture_writer *writer,
+                     const char *filename,
+                     const void *pixels,
+                     int width, int height,
+                     int stride);
+
+/* Waits for the queued images to be written and frees the writer */
+void
+capture_writer_free(struct capture_writer *writer);
+
+#endif /* CAPTURE_WRITER_H */
@@ -10,35 +10,138 @@
 #include <GLES2/gl2.h>
 #include <GLES2/gl2ext.h>
 #include <EGL/egl.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <time.h>
 
 #include "stereo-renderer.h"
 #include "util.h"
 
+#define VERTICES_PER_QUAD 6
+
+/* Number of frames each benchmark configuration is drawn for and how
+ * many of those are discarded at the start */
+#define BENCH_FRAMES_PER_CONFIG 120
+#define BENCH_WARMUP_FRAMES 20
+#define BENCH_DEFAULT_MAX_OVERDRAW 64
+/* Number of frames of timer queries that can be in flight */
+#define BENCH_QUERY_FRAMES 8
+
+/* A range of quads in the vertex buffer that is drawn with a single
+ * call */
+struct draw_range {
+        GLint first;
+        GLsizei count;
+};
+
+enum bench_order {
+        BENCH_ORDER_BACK_TO_FRONT,
+        BENCH_ORDER_FRONT_TO_BACK,
+        BENCH_N_ORDERS
+};
+
+enum bench_clear {
+        /* Colour and depth are cleared before each eye and the
+         * depth prepass is repeated for each eye */
+        BENCH_CLEAR_PER_EYE,
+        /* Depth is cleared once and the depth buffer from the first
+         * eye is reused for the second */
+        BENCH_CLEAR_SHARED_DEPTH,
+        BENCH_N_CLEARS
+};
+
+struct bench_config {
+        int overdraw;
+        enum bench_order order;
+        int prepass;
+        enum bench_clear clear;
+};
+
+struct bench_result {
+        uint64_t time_ns[2];
+        int n_samples[2];
+        /* Number of queries that have been issued and not yet
+         * collected */
+        int n_pending;
+};
+
+struct bench_query {
+        GLuint query;
+        int config;
+        int eye;
+        int pending;
+};
+
+struct bench {
+        int max_overdraw;
+        int n_overdraws;
+        int n_configs;
+        int frame;
+        int finished;
+
+        /* The same layers in both orders */
+        struct draw_range layers[BENCH_N_ORDERS];
+
+        struct bench_result *results;
+        int n_printed;
+
+        int has_timer_query;
+        struct bench_query queries[BENCH_QUERY_FRAMES * 2];
+        int next_query;
+
+        PFNGLGENQUERIESEXTPROC gen_queries;
+        PFNGLDELETEQUERIESEXTPROC delete_queries;
+        PFNGLBEGINQUERYEXTPROC begin_query;
+        PFNGLENDQUERYEXTPROC end_query;
+        PFNGLGETQUERYOBJECTUIVEXTPROC get_query_objectuiv;
+        PFNGLGETQUERYOBJECTUI64VEXTPROC get_query_objectui64v;
+};
+
+struct depth_vertex {
+        float x, y, z;
+        uint8_t r, g, b, a;
+};
+
 struct depth_renderer {
         PFNGLDRAWBUFFERSINDEXEDEXTPROC draw_buffers_indexed;
         int width, height;
 
+        /* Number of layered quads to draw per eye instead of the
+         * single square, or 0 */
+        int n_layers;
+
+        /* Sweep through the overdraw benchmark configurations */
+        int benchmark;
+        struct bench bench;
+
         GLuint program;
-        GLuint color_location;
+        GLuint vbo;
+
+        struct draw_range depth_pass;
+        struct draw_range color_passes[2];
 };
 
 static const char depth_vertex_source[] =
         "attribute highp vec3 pos;\n"
+        "attribute lowp vec4 color;\n"
+        "varying lowp vec4 v_color;\n"
         "\n"
         "void main()\n"
         "{\n"
         "        gl_Position = vec4(pos, 1.0);\n"
+        "        v_color = color;\n"
         "}\n";
 static const char depth_fragment_source[] =
-        "uniform highp vec4 color;\n"
+        "varying lowp vec4 v_color;\n"
         "\n"
         "void main()\n"
         "{\n"
-        "        gl_FragColor = color;\n"
+        "        gl_FragColor = v_color;\n"
         "}\n";
 
 static void *
@@ -51,11 +154,234 @@ depth_renderer_new(void)
         return renderer;
 }
 
+static struct depth_vertex *
+add_quad(struct depth_vertex *v,
+         float x1, float y1,
+         float x2, float y2,
+         float depth,
+         uint32_t color)
+{
+        static const int corners[VERTICES_PER_QUAD] = { 0, 1, 2, 2, 1, 3 };
+        int i;
+
+        for (i = 0; i < VERTICES_PER_QUAD; i++) {
+                v[i].x = (corners[i] & 1) ? x2 : x1;
+                v[i].y = (corners[i] & 2) ? y2 : y1;
+                v[i].z = depth;
+                v[i].r = color >> 24;
+                v[i].g = (color >> 16) & 0xff;
+                v[i].b = (color >> 8) & 0xff;
+                v[i].a = color & 0xff;
+        }
+
+        return v + VERTICES_PER_QUAD;
+}
+
+static struct depth_vertex *
+add_square(struct depth_vertex *v,
+           float x, float y,
+           uint32_t color,
+           float depth)
+{
+        return add_quad(v, x, y, x + 1.0f, y + 1.0f, depth, color);
+}
+
+static struct depth_vertex *
+add_layers(struct depth_vertex *v,
+           int n_layers,
+           uint32_t color)
+{
+        float depth;
+        uint32_t shade;
+        int i;
+
+        /* The layers cover the whole screen and are ordered back to
+         * front in front of the depth squares so that every layer
+         * passes the depth test */
+        for (i = 0; i < n_layers; i++) {
+                depth = 0.8f + 0.19f * i / n_layers;
+                shade = 0x40 + 0xbf * i / n_layers;
+                v = add_quad(v,
+                             -1.0f, -1.0f,
+                             1.0f, 1.0f,
+                             depth,
+                             (color & ((shade << 24) |
+                                       (shade << 16) |
+                                       (shade << 8))) |
+                             0xff);
+        }
+
+        return v;
+}
+
+static struct depth_vertex *
+add_bench_layers(struct depth_vertex *v,
+                 int n_layers,
+                 enum bench_order order)
+{
+        float depth;
+        uint32_t shade;
+        int i, layer;
+
+        /* Layer 0 is the farthest. The benchmark clears the depth to
+         * 0.0 and uses GL_GEQUAL so nearer layers have a greater
+         * depth. */
+        for (i = 0; i < n_layers; i++) {
+                if (order == BENCH_ORDER_BACK_TO_FRONT)
+                        layer = i;
+                else
+                        layer = n_layers - 1 - i;
+
+                depth = -0.9f + 1.8f * (layer + 1) / n_layers;
+                shade = 0x20 + 0xdf * layer / n_layers;
+                v = add_quad(v,
+                             -1.0f, -1.0f,
+                             1.0f, 1.0f,
+                             depth,
+                             (shade << 24) | (shade << 16) | (shade << 8) |
+                             0xff);
+        }
+
+        return v;
+}
+
+static void
+end_range(struct draw_range *range,
+          const struct depth_vertex *vertices,
+          const struct depth_vertex *v)
+{
+        range->count = (v - vertices) - range->first;
+}
+
+static void
+create_vertex_buffer(struct depth_renderer *renderer)
+{
+        static const uint32_t eye_colors[] = { 0xff0000ff, 0x0000ffff };
+        static const float eye_depths[] = { 0.3f, 0.6f };
+        struct depth_vertex *vertices, *v;
+        int n_quads, i;
+
+        n_quads = 4 + 2 * (renderer->n_layers > 0 ? renderer->n_layers : 1);
+        if (renderer->benchmark)
+                n_quads += BENCH_N_ORDERS * renderer->bench.max_overdraw;
+        vertices = xmalloc(n_quads * VERTICES_PER_QUAD * sizeof *vertices);
+        v = vertices;
+
+        /* Squares that are only drawn into the depth buffer */
+        renderer->depth_pass.first = v - vertices;
+        v = add_square(v, -1.0f, -1.0f, 0x000000ff, 0.0f);
+        v = add_square(v, 0.0f, -1.0f, 0x000000ff, 0.25f);
+        v = add_square(v, -1.0f, 0.0f, 0x000000ff, 0.5f);
+        v = add_square(v, 0.0f, 0.0f, 0x000000ff, 0.75f);
+        end_range(&renderer->depth_pass, vertices, v);
+
+        for (i = 0; i < 2; i++) {
+                renderer->color_passes[i].first = v - vertices;
+                if (renderer->n_layers > 0)
+                        v = add_layers(v, renderer->n_layers, eye_colors[i]);
+                else
+                        v = add_square(v, -0.5f, -0.5f,
+                                       eye_colors[i], eye_depths[i]);
+                end_range(renderer->color_passes + i, vertices, v);
+        }
+
+        if (renderer->benchmark) {
+                for (i = 0; i < BENCH_N_ORDERS; i++) {
+                        renderer->bench.layers[i].first = v - vertices;
+                        v = add_bench_layers(v,
+                                             renderer->bench.max_overdraw,
+                                             i);
+                        end_range(renderer->bench.layers + i, vertices, v);
+                }
+        }
+
+        glGenBuffers(1, &renderer->vbo);
+        gl_state_bind_buffer(GL_ARRAY_BUFFER, renderer->vbo);
+        glBufferData(GL_ARRAY_BUFFER,
+                     (v - vertices) * sizeof *vertices,
+                     vertices,
+                     GL_STATIC_DRAW);
+        GL_DEBUG_LABEL(GL_BUFFER_KHR, renderer->vbo, "depth layers");
+
+        free(vertices);
+}
+
+static void
+get_bench_config(const struct bench *bench,
+                 int index,
+                 struct bench_config *config)
+{
+        config->clear = index % BENCH_N_CLEARS;
+        index /= BENCH_N_CLEARS;
+        config->prepass = index % 2;
+        index /= 2;
+        config->order = index % BENCH_N_ORDERS;
+        index /= BENCH_N_ORDERS;
+        config->overdraw = 1 << index;
+}
+
+static void
+init_bench(struct bench *bench, int max_overdraw)
+{
+        const char *exts = (const char *) glGetString(GL_EXTENSIONS);
+        int i;
+
+        /* Overdraw is swept in powers of two up to the maximum */
+        bench->n_overdraws = 0;
+        while ((1 << bench->n_overdraws) <= max_overdraw)
+                bench->n_overdraws++;
+        bench->max_overdraw = 1 << (bench->n_overdraws - 1);
+
+        bench->n_configs = (bench->n_overdraws *
+                            BENCH_N_ORDERS *
+                            2 *
+                            BENCH_N_CLEARS);
+        bench->results = xmalloc(bench->n_configs * sizeof *bench->results);
+        memset(bench->results, 0, bench->n_configs * sizeof *bench->results);
+
+        if (extension_in_list("GL_EXT_disjoint_timer_query", exts)) {
+                bench->gen_queries =
+                        (void *) eglGetProcAddress("glGenQueriesEXT");
+                bench->delete_queries =
+                        (void *) eglGetProcAddress("glDeleteQueriesEXT");
+                bench->begin_query =
+                        (void *) eglGetProcAddress("glBeginQueryEXT");
+                bench->end_query =
+                        (void *) eglGetProcAddress("glEndQueryEXT");
+                bench->get_query_objectuiv =
+                        (void *) eglGetProcAddress("glGetQueryObjectuivEXT");
+                bench->get_query_objectui64v =
+                        (void *) eglGetProcAddress("glGetQueryObjectui64vEXT");
+
+                for (i = 0; i < BENCH_QUERY_FRAMES * 2; i++)
+                        bench->gen_queries(1, &bench->queries[i].query);
+
+                bench->has_timer_query = 1;
+        } else {
+                printf("GL_EXT_disjoint_timer_query is not available, "
+                       "benchmark will use CPU time with glFinish\n");
+        }
+}
+
+static void
+destroy_bench(struct bench *bench)
+{
+        int i;
+
+        if (bench->has_timer_query) {
+                for (i = 0; i < BENCH_QUERY_FRAMES * 2; i++)
+                        bench->delete_queries(1, &bench->queries[i].query);
+        }
+
+        free(bench->results);
+}
+
 static int
 depth_renderer_connect(void *data)
 {
         struct depth_renderer *renderer = data;
         const char *exts = (const char *) glGetString(GL_EXTENSIONS);
+        struct pending_program *pending_program;
 
         if (!extension_in_list("GL_EXT_multiview_draw_buffers", exts)) {
                 fprintf(stderr,
@@ -66,13 +392,28 @@ depth_renderer_connect(void *data)
         renderer->draw_buffers_indexed =
                 (void *) eglGetProcAddress("glDrawBuffersIndexedEXT");
 
-        renderer->program = create_program(depth_vertex_source,
-                                           depth_fragment_source,
-                                           "pos",
-                                           NULL);
+        /* The program is only waited for once the geometry has been
+         * generated so that the driver can compile it meanwhile */
+        pending_program = submit_program(NULL, /* defines */
+                                         depth_vertex_source,
+                                         depth_fragment_source,
+                                         "pos",
+                                         "color",
+                                         NULL);
+
+        if (renderer->benchmark)
+                init_bench(&renderer->bench,
+                           renderer->n_layers > 0 ?
+                           renderer->n_layers :
+                           BENCH_DEFAULT_MAX_OVERDRAW);
+
+        create_vertex_buffer(renderer);
+
+        renderer->program = finish_program(pending_program);
+        if (renderer->program == 0)
+                return -ENOENT;
 
-        renderer->color_location =
-                glGetUniformLocation(renderer->program, "color");
+        GL_DEBUG_LABEL(GL_PROGRAM_KHR, renderer->program, "depth");
 
         return 0;
 }
@@ -87,71 +428,347 @@ set_eye(struct depth_renderer *renderer, int eye)
 }
 
 static void
-draw_square(struct depth_renderer *renderer,
-            float x, float y,
-            uint32_t color,
-            float depth)
+draw_range(const struct draw_range *range)
 {
-        float color_array[] = {
-                (color >> 24) / 255.0f,
-                ((color >> 16) & 0xff) / 255.0f,
-                ((color >> 8) & 0xff) / 255.0f,
-                (color & 0xff) / 255.0f,
-        };
-        float vertices[] = {
-                x, y, depth,
-                x + 1.0f, y, depth,
-                x, y + 1.0f, depth,
-                x + 1.0f, y + 1.0f, depth
-        };
+        glDrawArrays(GL_TRIANGLES, range->first, range->count);
+}
 
-        glUniform4fv(renderer->color_location, 1, color_array);
-        glVertexAttribPointer(0, /* index */
-                              3, /* size */
-                              GL_FLOAT,
-                              GL_FALSE, /* not normalized */
-                              sizeof(float) * 3,
-                              vertices);
-        glEnableVertexAttribArray(0);
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-        glDisableVertexAttribArray(0);
+static void
+add_bench_sample(struct bench *bench,
+                 int config,
+                 int eye,
+                 uint64_t time_ns)
+{
+        struct bench_result *result = bench->results + config;
+
+        result->time_ns[eye] += time_ns;
+        result->n_samples[eye]++;
+}
+
+static void
+collect_queries(struct bench *bench, int wait)
+{
+        struct bench_query *query;
+        struct bench_query *done[BENCH_QUERY_FRAMES * 2];
+        GLuint64 times[BENCH_QUERY_FRAMES * 2];
+        GLuint available;
+        GLint disjoint = 0;
+        int n_done = 0;
+        int i;
+
+        for (i = 0; i < BENCH_QUERY_FRAMES * 2; i++) {
+                query = bench->queries + i;
+
+                if (!query->pending)
+                        continue;
+
+                if (!wait) {
+                        bench->get_query_objectuiv(query->query,
+                                                   GL_QUERY_RESULT_AVAILABLE_EXT,
+                                                   &available);
+                        if (!available)
+                                continue;
+                }
+
+                bench->get_query_objectui64v(query->query,
+                                             GL_QUERY_RESULT_EXT,
+                                             times + n_done);
+                query->pending = 0;
+                bench->results[query->config].n_pending--;
+                done[n_done++] = query;
+        }
+
+        /* If the GPU had a disjoint event while the results were
+         * being measured they are meaningless so they are just
+         * dropped. This has to be checked after reading them. */
+        if (n_done == 0)
+                return;
+
+        glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+        if (disjoint)
+                return;
+
+        for (i = 0; i < n_done; i++)
+                add_bench_sample(bench,
+                                 done[i]->config,
+                                 done[i]->eye,
+                                 times[i]);
+}
+
+static void
+print_bench_result(const struct depth_renderer *renderer, int index)
+{
+        const struct bench *bench = &renderer->bench;
+        const struct bench_result *result = bench->results + index;
+        struct bench_config config;
+        double eye_ms[2], pixels, total_ms;
+        int eye;
+
+        get_bench_config(bench, index, &config);
+
+        if (index == 0)
+                printf("overdraw order prepass clear       "
+                       "left ms  right ms  Mpix/s\n");
+
+        for (eye = 0; eye < 2; eye++) {
+                if (result->n_samples[eye] > 0)
+                        eye_ms[eye] = (result->time_ns[eye] / 1e6 /
+                                       result->n_samples[eye]);
+                else
+                        eye_ms[eye] = 0.0;
+        }
+
+        /* The effective fill rate is the number of pixels the
+         * content covers divided by the time it took, so early depth
+         * rejection makes it go up */
+        pixels = (double) renderer->width * renderer->height *
+                config.overdraw * 2;
+        total_ms = eye_ms[0] + eye_ms[1];
+
+        printf("%8i %5s %7s %-10s %8.3f %9.3f %7.0f\n",
+               config.overdraw,
+               config.order == BENCH_ORDER_BACK_TO_FRONT ? "b2f" : "f2b",
+               config.prepass ? "yes" : "no",
+               config.clear == BENCH_CLEAR_PER_EYE ? "per-eye" : "shared",
+               eye_ms[0],
+               eye_ms[1],
+               total_ms > 0.0 ? pixels / total_ms / 1000.0 : 0.0);
+}
+
+static void
+print_bench_results(struct depth_renderer *renderer, int current_config)
+{
+        struct bench *bench = &renderer->bench;
+
+        /* Results are printed in order as soon as all of their
+         * queries have been collected */
+        while (bench->n_printed < current_config &&
+               bench->results[bench->n_printed].n_pending == 0)
+                print_bench_result(renderer, bench->n_printed++);
+}
+
+static void
+begin_bench_eye(struct bench *bench, int config, int eye)
+{
+        struct bench_query *query;
+
+        if (!bench->has_timer_query)
+                return;
+
+        query = bench->queries + bench->next_query;
+
+        /* If the query is still in use then wait for its result */
+        if (query->pending)
+                collect_queries(bench, 1 /* wait */);
+
+        query->config = config;
+        query->eye = eye;
+        query->pending = 1;
+        bench->results[config].n_pending++;
+
+        bench->begin_query(GL_TIME_ELAPSED_EXT, query->query);
+}
+
+static void
+end_bench_eye(struct bench *bench)
+{
+        if (!bench->has_timer_query)
+                return;
+
+        bench->end_query(GL_TIME_ELAPSED_EXT);
+        bench->next_query = (bench->next_query + 1) % (BENCH_QUERY_FRAMES * 2);
+}
+
+static uint64_t
+get_cpu_time_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void
+draw_bench_layers(const struct depth_renderer *renderer,
+                  const struct bench_config *config)
+{
+        const struct draw_range *layers =
+                renderer->bench.layers + config->order;
+        int offset;
+
+        /* The nearest layers are always used so that both orders
+         * draw the same set of layers */
+        if (config->order == BENCH_ORDER_BACK_TO_FRONT)
+                offset = (renderer->bench.max_overdraw - config->overdraw) *
+                        VERTICES_PER_QUAD;
+        else
+                offset = 0;
+
+        glDrawArrays(GL_TRIANGLES,
+                     layers->first + offset,
+                     config->overdraw * VERTICES_PER_QUAD);
+}
+
+static void
+draw_bench_eye(struct depth_renderer *renderer,
+               const struct bench_config *config,
+               int eye)
+{
+        GLbitfield clear_bits = GL_COLOR_BUFFER_BIT;
+
+        set_eye(renderer, eye);
+
+        if (config->clear == BENCH_CLEAR_PER_EYE || eye == 0)
+                clear_bits |= GL_DEPTH_BUFFER_BIT;
+
+        /* glClear obeys the write masks, which the prepass leaves
+         * turned off for depth */
+        gl_state_depth_mask(GL_TRUE);
+        gl_state_color_mask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        glClear(clear_bits);
+
+        if (config->prepass) {
+                if (config->clear == BENCH_CLEAR_PER_EYE || eye == 0) {
+                        gl_state_depth_func(GL_GEQUAL);
+                        gl_state_depth_mask(GL_TRUE);
+                        gl_state_color_mask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                        draw_bench_layers(renderer, config);
+                }
+
+                gl_state_depth_func(GL_EQUAL);
+                gl_state_depth_mask(GL_FALSE);
+                gl_state_color_mask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        } else {
+                gl_state_depth_func(GL_GEQUAL);
+                gl_state_depth_mask(GL_TRUE);
+                gl_state_color_mask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        }
+
+        draw_bench_layers(renderer, config);
+}
+
+static void
+draw_bench_frame(struct depth_renderer *renderer)
+{
+        struct bench *bench = &renderer->bench;
+        int config_index = bench->frame / BENCH_FRAMES_PER_CONFIG;
+        int timed = bench->frame % BENCH_FRAMES_PER_CONFIG >=
+                BENCH_WARMUP_FRAMES;
+        struct bench_config config;
+        uint64_t start_time = 0;
+        int eye;
+
+        if (bench->has_timer_query)
+                collect_queries(bench, 0 /* wait */);
+
+        get_bench_config(bench, config_index, &config);
+
+        gl_state_clear_color(0.0, 0.0, 0.0, 1.0);
+        gl_state_clear_depth(0.0f);
+        gl_state_set_enabled(GL_DEPTH_TEST, 1);
+
+        for (eye = 0; eye < 2; eye++) {
+                if (timed) {
+                        if (bench->has_timer_query) {
+                                begin_bench_eye(bench, config_index, eye);
+                        } else {
+                                glFinish();
+                                start_time = get_cpu_time_ns();
+                        }
+                }
+
+                GL_DEBUG_PUSH_GROUP(eye ? "right eye" : "left eye");
+                draw_bench_eye(renderer, &config, eye);
+                GL_DEBUG_POP_GROUP();
+
+                if (timed) {
+                        if (bench->has_timer_query) {
+                                end_bench_eye(bench);
+                        } else {
+                                glFinish();
+                                add_bench_sample(bench,
+                                                 config_index,
+                                                 eye,
+                                                 get_cpu_time_ns() -
+                                                 start_time);
+                        }
+                }
+        }
+
+        gl_state_clear_depth(1.0f);
+
+        print_bench_results(renderer, config_index);
+
+        if (++bench->frame >= bench->n_configs * BENCH_FRAMES_PER_CONFIG) {
+                if (bench->has_timer_query)
+                        collect_queries(bench, 1 /* wait */);
+                print_bench_results(renderer, bench->n_configs);
+                bench->finished = 1;
+        }
 }
 
 static void
 depth_renderer_draw_frame(void *data,
-                          int frame_num)
+                          int frame_num,
+                          uint64_t present_time)
 {
         struct depth_renderer *renderer = data;
-        glUseProgram(renderer->program);
+        gl_state_use_program(renderer->program);
+
+        gl_state_bind_buffer(GL_ARRAY_BUFFER, renderer->vbo);
+        gl_state_vertex_attrib_pointer(0, /* index */
+                                       3, /* size */
+                                       GL_FLOAT,
+                                       GL_FALSE, /* not normalized */
+                                       sizeof(struct depth_vertex),
+                                       (void *) offsetof(struct depth_vertex,
+                                                         x));
+        gl_state_vertex_attrib_pointer(1, /* index */
+                                       4, /* size */
+                                       GL_UNSIGNED_BYTE,
+                                       GL_TRUE, /* normalized */
+                                       sizeof(struct depth_vertex),
+                                       (void *) offsetof(struct depth_vertex,
+                                                         r));
+        gl_state_enable_attribs((1 << 0) | (1 << 1));
+
+        if (renderer->benchmark && !renderer->bench.finished) {
+                draw_bench_frame(renderer);
+                return;
+        }
 
         glClear(GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 
+        GL_DEBUG_PUSH_GROUP("left eye");
         set_eye(renderer, 0);
 
-        glClearColor(0.0, 0.0, 0.0, 1.0);
+        gl_state_clear_color(0.0, 0.0, 0.0, 1.0);
         glClear(GL_COLOR_BUFFER_BIT);
 
-        glEnable(GL_DEPTH_TEST);
-        glDepthFunc(GL_ALWAYS);
-        glDepthMask(GL_TRUE);
-        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        gl_state_set_enabled(GL_DEPTH_TEST, 1);
+        gl_state_depth_func(GL_ALWAYS);
+        gl_state_depth_mask(GL_TRUE);
+        gl_state_color_mask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
 
-        draw_square(renderer, -1.0f, -1.0f, 0x000000ff, 0.0f);
-        draw_square(renderer, 0.0f, -1.0f, 0x000000ff, 0.25f);
-        draw_square(renderer, -1.0f, 0.0f, 0x000000ff, 0.5f);
-        draw_square(renderer, 0.0f, 0.0f, 0x000000ff, 0.75f);
+        GL_DEBUG_PUSH_GROUP("depth pass");
+        draw_range(&renderer->depth_pass);
+        GL_DEBUG_POP_GROUP();
 
-        glDepthFunc(GL_GREATER);
-        glDepthMask(GL_FALSE);
-        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        gl_state_depth_func(GL_GREATER);
+        gl_state_depth_mask(GL_FALSE);
+        gl_state_color_mask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
 
-        draw_square(renderer, -0.5f, -0.5f, 0xff0000ff, 0.3f);
+        draw_range(renderer->color_passes + 0);
+        GL_DEBUG_POP_GROUP();
 
+        GL_DEBUG_PUSH_GROUP("right eye");
         set_eye(renderer, 1);
 
         glClear(GL_COLOR_BUFFER_BIT);
 
-        draw_square(renderer, -0.5f, -0.5f, 0x0000ffff, 0.6f);
+        draw_range(renderer->color_passes + 1);
+        GL_DEBUG_POP_GROUP();
 }
 
 static void
@@ -163,11 +780,32 @@ depth_renderer_resize(void *data,
         renderer->height = height;
 }
 
+static int
+depth_renderer_handle_option(void *data, int opt)
+{
+        struct depth_renderer *renderer = data;
+
+        switch (opt) {
+        case 'n':
+                renderer->n_layers = atoi(optarg);
+                return 1;
+        case 'b':
+                renderer->benchmark = 1;
+                return 1;
+        }
+
+        return 0;
+}
+
 static void
 depth_renderer_free(void *data)
 {
         struct depth_renderer *renderer = data;
 
+        if (renderer->benchmark && renderer->bench.results)
+                destroy_bench(&renderer->bench);
+        if (renderer->vbo)
+                glDeleteBuffers(1, &renderer->vbo);
         if (renderer->program)
                 glDeleteProgram(renderer->program);
         free(renderer);
@@ -175,7 +813,13 @@ depth_renderer_free(void *data)
 
 const struct stereo_renderer depth_renderer = {
         .name = "depth",
+        .options = "n:b",
+        .options_desc =
+        "  -n <LAYERS>     Draw this many full screen layers per eye\n"
+        "  -b              Run the overdraw benchmark. -n sets the "
+        "maximum overdraw\n",
         .new = depth_renderer_new,
+        .handle_option = depth_renderer_handle_option,
         .connect = depth_renderer_connect,
         .draw_frame = depth_renderer_draw_frame,
         .resize = depth_renderer_resize,
@@ -0,0 +1,99 @@
+/*
+ * Stereoscopic cube example
+ *
+ * Written 2013 by Neil Roberts <neil@linux.intel.com>
+ * Dedicated to the Public Domain.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "frame-socket.h"
+
+int
+frame_socket_send(int sock,
+                  const struct frame_socket_header *header,
+                  int fd)
+{
+        char control[CMSG_SPACE(sizeof fd)];
+        struct iovec iov = {
+                .iov_base = (void *) header,
+                .iov_len = sizeof *header,
+        };
+        struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = control,
+                .msg_controllen = sizeof control,
+        };
+        struct cmsghdr *cmsg;
+
+        memset(control, 0, sizeof control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof fd);
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+
+        if (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1)
+                return -errno;
+
+        return 0;
+}
+
+int
+frame_socket_receive(int sock,
+                     struct frame_socket_header *header,
+                     int *fd)
+{
+        char control[CMSG_SPACE(sizeof *fd)];
+        struct iovec iov = {
+                .iov_base = header,
+                .iov_len = sizeof *header,
+        };
+        struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = control,
+                .msg_controllen = sizeof control,
+        };
+        struct cmsghdr *cmsg;
+        ssize_t got;
+
+        got = recvmsg(sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+
+        if (got == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        return 0;
+                return -errno;
+        }
+
+        if (got == 0)
+                return -EPIPE;
+
+        *fd = -1;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg);
+             cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET &&
+                    cmsg->cmsg_type == SCM_RIGHTS &&
+                    cmsg->cmsg_len == CMSG_LEN(sizeof *fd))
+                        memcpy(fd, CMSG_DATA(cmsg), sizeof *fd);
+        }
+
+        if (got != sizeof *header ||
+            (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+            *fd == -1) {
+                if (*fd != -1)
+                        close(*fd);
+                return -EPROTO;
+        }
+
+        return 1;
+}
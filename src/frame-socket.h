@@ -0,0 +1,56 @@
+/*
+ * Stereoscopic cube example
+ *
+ * Written 2013 by Neil Roberts <neil@linux.intel.com>
+ * Dedicated to the Public Domain.
+ */
+
+#ifndef FRAME_SOCKET_H
+#define FRAME_SOCKET_H
+
+#include <stdint.h>
+
+/* Protocol used to pass live stereo frames between a producer and
+ * the image renderer. The producer listens on a SOCK_SEQPACKET Unix
+ * domain socket. Each message contains one frame_socket_header and a
+ * single file descriptor for the pixel data of one eye. A stereo
+ * pair is two messages with the same sequence number. */
+
+#define FRAME_SOCKET_DEFAULT_PATH "/tmp/stereo-cube-frames"
+
+enum frame_socket_buffer_type {
+        /* A memfd containing tightly packed RGBA bytes starting at
+         * the offset */
+        FRAME_SOCKET_BUFFER_MEMFD,
+        /* A single plane dma-buf described by the format, offset,
+         * stride and modifier */
+        FRAME_SOCKET_BUFFER_DMA_BUF,
+};
+
+struct frame_socket_header {
+        uint32_t sequence;
+        uint8_t eye;
+        uint8_t buffer_type;
+        uint16_t padding;
+        uint32_t width, height;
+        uint32_t stride;
+        uint32_t offset;
+        /* DRM fourcc of the dma-buf. Ignored for memfds. */
+        uint32_t format;
+        uint64_t modifier;
+};
+
+int
+frame_socket_send(int sock,
+                  const struct frame_socket_header *header,
+                  int fd);
+
+/* Receives one message without blocking. Returns 1 if a message was
+ * received, 0 if there are no more messages or a negative errno
+ * value on error. A closed connection is reported as -EPIPE. */
+int
+frame_socket_receive(int sock,
+                     struct frame_socket_header *header,
+                     int *fd);
+
+#endif /* FRAME_SOCKET_H */
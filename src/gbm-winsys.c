@@ -11,24 +11,98 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
+#include <drm_fourcc.h>
 #include <gbm.h>
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
+#include <GLES2/gl2.h>
 #include <signal.h>
 
+#include "capture-writer.h"
 #include "gbm-winsys.h"
+#include "hud.h"
+#include "stereo-renderer.h"
 #include "util.h"
 
+/* The KMS properties used by the atomic path */
+enum conn_prop {
+        CONN_PROP_CRTC_ID,
+        N_CONN_PROPS
+};
+
+enum writeback_prop {
+        WRITEBACK_PROP_CRTC_ID,
+        WRITEBACK_PROP_FB_ID,
+        WRITEBACK_PROP_OUT_FENCE_PTR,
+        N_WRITEBACK_PROPS
+};
+
+enum crtc_prop {
+        CRTC_PROP_MODE_ID,
+        CRTC_PROP_ACTIVE,
+        N_CRTC_PROPS
+};
+
+enum plane_prop {
+        PLANE_PROP_FB_ID,
+        PLANE_PROP_CRTC_ID,
+        PLANE_PROP_SRC_X,
+        PLANE_PROP_SRC_Y,
+        PLANE_PROP_SRC_W,
+        PLANE_PROP_SRC_H,
+        PLANE_PROP_CRTC_X,
+        PLANE_PROP_CRTC_Y,
+        PLANE_PROP_CRTC_W,
+        PLANE_PROP_CRTC_H,
+        PLANE_PROP_TYPE,
+        N_PLANE_PROPS
+};
+
+static const char *const conn_prop_names[] = {
+        "CRTC_ID",
+};
+
+static const char *const writeback_prop_names[] = {
+        "CRTC_ID",
+        "WRITEBACK_FB_ID",
+        "WRITEBACK_OUT_FENCE_PTR",
+};
+
+static const char *const crtc_prop_names[] = {
+        "MODE_ID",
+        "ACTIVE",
+};
+
+static const char *const plane_prop_names[] = {
+        "FB_ID",
+        "CRTC_ID",
+        "SRC_X",
+        "SRC_Y",
+        "SRC_W",
+        "SRC_H",
+        "CRTC_X",
+        "CRTC_Y",
+        "CRTC_W",
+        "CRTC_H",
+        "type",
+};
+
+static const char *const in_fence_prop_name = "IN_FENCE_FD";
+static const char *const out_fence_prop_name = "OUT_FENCE_PTR";
+
 struct gbm_dev {
         int fd;
         uint32_t width;
@@ -40,57 +114,394 @@ struct gbm_dev {
         uint32_t crtc;
         drmModeCrtc *saved_crtc;
 
-        int pending_swap;
+        /* Set if the atomic API is used instead of the legacy
+         * drmModeSetCrtc and drmModePageFlip */
+        int atomic;
+        uint32_t plane;
+        uint32_t mode_blob_id;
+        uint32_t conn_props[N_CONN_PROPS];
+        uint32_t crtc_props[N_CRTC_PROPS];
+        uint32_t plane_props[N_PLANE_PROPS];
+        /* These are 0 if the driver doesn't support explicit fencing */
+        uint32_t in_fence_prop;
+        uint32_t out_fence_prop;
+
+        /* The modifiers that buffers can be scanned out with. This
+         * is empty if the driver doesn't report them. */
+        uint64_t *modifiers;
+        int n_modifiers;
+        /* Set if framebuffers can be created with a modifier */
+        int addfb_modifiers;
+        int reported_modifier;
+
+        /* The cost of sharing buffers from a separate render
+         * device, in nanoseconds */
+        uint64_t import_time;
+        int n_imports;
+        uint64_t copy_time;
+        int n_copies;
+
+        /* The modes that passed the atomic test, best first. These
+         * are only kept if the modes will be probed. */
+        drmModeModeInfo *candidate_modes;
+        int n_candidate_modes;
+};
+
+/* Older libdrm headers don't have the cap for async atomic commits */
+#ifndef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+#define DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP 0x15
+#endif
+
+/* Time in microseconds to leave between submitting a slice and the
+ * beam reaching it when no render margin is given */
+#define DEFAULT_BEAM_MARGIN 500
+
+/* Maximum number of frames that can be waiting to be shown */
+#define MAX_QUEUE_DEPTH 3
+#define DEFAULT_QUEUE_DEPTH 2
+
+/* A dumb buffer with a framebuffer for it */
+struct dumb_fb {
+        uint32_t handle;
+        uint32_t fb_id;
+        uint32_t width;
+        uint32_t height;
+        uint32_t pitch;
+        uint64_t size;
+        /* The CPU mapping, or NULL if it isn't mapped */
+        void *map;
+};
+
+/* The HUD text is up to this many lines and columns */
+#define HUD_COLUMNS 24
+#define HUD_LINES 4
+#define HUD_PADDING 4
+/* Distance in pixels from the top left corner of each eye */
+#define HUD_MARGIN 16
+#define HUD_BACKGROUND_COLOR 0xc0000000
+#define HUD_TEXT_COLOR 0xffffffff
+/* How often the statistics are refreshed in nanoseconds */
+#define HUD_UPDATE_INTERVAL UINT64_C(1000000000)
+
+/* A status overlay on its own KMS plane. The buffer holds a copy of
+ * the HUD for each eye, arranged for the stereo layout, so the scene
+ * buffers are never touched. */
+struct gbm_hud {
+        uint32_t plane;
+        uint32_t plane_props[N_PLANE_PROPS];
+        /* Two buffers so that the one being scanned out is never
+         * drawn to */
+        struct dumb_fb buffers[2];
+        /* The buffer being scanned out, the one committed but not
+         * yet shown and the one drawn but not yet committed. Each is
+         * -1 if there isn't one. */
+        int front, in_flight, pending;
+        /* The position and size of the plane on the CRTC */
+        int32_t x, y;
+        uint32_t width, height;
+        /* The size of each eye's copy */
+        int eye_width, eye_height;
+        /* Where the right eye's copy starts in the buffer */
+        int right_x, right_y;
+        /* 2 if the rows of the two eyes are interleaved */
+        int row_step;
+        uint32_t *eye_pixels;
+        char text[HUD_LINES * (HUD_COLUMNS + 1) + 1];
+        uint64_t last_update;
+        int n_flips;
+};
+
+/* Static images shown directly on planes so that nothing is
+ * rendered. The left eye is on the primary plane and the right eye on
+ * an overlay. */
+struct gbm_direct {
+        uint32_t overlay;
+        uint32_t overlay_props[N_PLANE_PROPS];
+        struct dumb_fb buffers[2];
+};
+
+/* Captures of the composed scanout through a writeback connector.
+ * The connector stays attached to the CRTC and a buffer is only
+ * added to the flips that should be captured. */
+struct gbm_capture {
+        uint32_t conn;
+        uint32_t props[N_WRITEBACK_PROPS];
+        struct dumb_fb buffer;
+        /* Frames between captures, or 0 to only capture on request */
+        int interval;
+        /* Set to capture with the next flip */
+        int requested;
+        int n_flips;
+        /* Signals when the writeback has finished, or -1 if no
+         * capture is in progress */
+        int32_t fence_fd;
+        /* The flip number and commit time of the capture in
+         * progress */
+        int frame;
+        uint64_t start_time;
+        uint64_t total_time;
+        int n_captures;
+};
+
+/* Frame-slice beam racing. Each refresh is flipped to several times
+ * while it is being scanned out. Every flip redraws the rows that the
+ * beam hasn't reached when drawing starts and doesn't wait for the
+ * vblank, so it tears somewhere between there and the slice that it
+ * is racing. */
+struct gbm_beam {
+        /* The framebuffer row that each slice starts at, in scanout
+         * order */
+        uint32_t *rows;
+        int n_slices;
+        /* Scanlines in each refresh, including the blanking */
+        uint32_t frame_lines;
+        /* Selects the output's CRTC for drmWaitVBlank() */
+        uint32_t vblank_type;
+        /* When the beam leaves the top of the scanout being raced */
+        uint64_t scanout_time;
+        int n_drawn;
+        int n_late;
+        int n_skipped;
+};
+
+/* Maximum number of connectors that can be driven at once */
+#define MAX_OUTPUTS 8
+
+/* The primary plane, the HUD and the direct scanout overlay */
+#define MAX_PLANES_PER_OUTPUT 3
+
+/* Number of frames whose render times are used to predict the next */
+#define RENDER_COST_HISTORY 16
+
+/* A rendered buffer and the fence for its rendering, or -1 */
+struct gbm_frame {
+        struct gbm_bo *bo;
+        int fence_fd;
+        /* The vblank the frame was rendered for, or 0 */
+        uint64_t present_time;
+        /* When drawing the frame started */
+        uint64_t draw_time;
 };
 
+/* The GBM device and EGL state shared by all of the outputs. There is
+ * a single GL context so the renderer's meshes, textures and programs
+ * are shared between the outputs. */
 struct gbm_context {
-        struct gbm_dev *dev;
         struct gbm_device *gbm;
-        struct gbm_surface *gbm_surface;
         EGLDisplay edpy;
         EGLConfig egl_config;
-        EGLSurface egl_surface;
         EGLContext egl_context;
+        /* Set if the GBM device isn't the display device, so the
+         * buffers have to be shared with it through PRIME */
+        int prime;
+
+        /* The entry points for explicit fencing, or NULL if EGL
+         * doesn't support it */
+        PFNEGLCREATESYNCKHRPROC create_sync;
+        PFNEGLDESTROYSYNCKHRPROC destroy_sync;
+        PFNEGLDUPNATIVEFENCEFDANDROIDPROC dup_native_fence_fd;
+};
+
+/* A connector and CRTC with its own surface and flip timing */
+struct gbm_output {
+        struct gbm_dev *dev;
+        struct gbm_context *context;
+        struct gbm_surface *gbm_surface;
+        EGLSurface egl_surface;
 
-        uint32_t current_fb_id;
+        /* The buffer being scanned out */
         struct gbm_bo *current_bo;
+        /* The buffer that a page flip has been requested for */
+        struct gbm_bo *flip_bo;
+        /* Rendered frames waiting for the pending flip to finish */
+        struct gbm_frame queued_frames[MAX_QUEUE_DEPTH];
+        int n_queued_frames;
+
+        /* Explicit fencing. The rendering of each frame is exported
+         * as a fence that KMS waits on before scanning it out. KMS
+         * returns a fence that signals when the flip has completed
+         * and the previous buffer can be reused. */
+        int use_fences;
+        int32_t out_fence_fd;
+
+        /* Frame scheduling. The times are CLOCK_MONOTONIC in
+         * nanoseconds and are 0 until the first flip completes. */
+        uint64_t refresh_ns;
+        uint64_t last_vblank;
+        /* The predicted vblank of the next frame to be drawn */
+        uint64_t present_time;
+        /* When to start drawing the next frame to finish it just
+         * before its vblank */
+        uint64_t start_time;
+        uint64_t flip_present_time;
+        uint64_t render_costs[RENDER_COST_HISTORY];
+        int n_render_costs;
+        int n_frames;
+        int n_missed_frames;
+
+        /* Set to flip without waiting for the vblank. Frames are
+         * then shown as soon as they are drawn and may tear. */
+        int async_flips;
+        /* When drawing of the next frame and the frame being
+         * flipped to started */
+        uint64_t draw_time;
+        uint64_t flip_draw_time;
+        /* Latency from the start of drawing to the flip */
+        uint64_t first_flip_time;
+        uint64_t total_latency;
+        int n_flips;
+
+        /* The overlay, or NULL if it is disabled */
+        struct gbm_hud *hud;
+        /* The images being scanned out, or NULL if the output is
+         * rendered */
+        struct gbm_direct *direct;
+        /* The writeback connector, or NULL if capturing is disabled */
+        struct gbm_capture *capture;
+        /* Beam racing state, or NULL if frames are flipped whole */
+        struct gbm_beam *beam;
+};
+
+/* A DRM framebuffer for a buffer of the GBM surface. This is attached
+ * to the buffer as user data so that the framebuffer is only created
+ * the first time the buffer is used and is removed when GBM destroys
+ * the buffer. */
+struct gbm_fb {
+        int fd;
+        uint32_t fb_id;
+        /* The handle on the display device if the buffer was
+         * imported from the render device, or 0 */
+        uint32_t handle;
+        /* A buffer on the display device that the contents are
+         * copied to before each flip if the import failed, or NULL */
+        struct dumb_fb *copy;
+};
+
+/* What to favour when choosing between modes with the same layout */
+enum mode_policy {
+        /* The most pixels, then the highest refresh rate */
+        MODE_POLICY_QUALITY,
+        /* The highest refresh rate, then the most pixels */
+        MODE_POLICY_LATENCY,
+        /* The fewest pixels, then the highest refresh rate */
+        MODE_POLICY_GPU,
 };
 
 struct gbm_options {
         const struct stereo_renderer *renderer;
         const char *card;
         const char *stereo_layout;
-        int connector;
+        /* Comma-separated list of connector ids, "all", or NULL to
+         * use the first connector */
+        const char *connectors;
+        int queue_depth;
+        int disable_atomic;
+        /* Time in microseconds to leave between the predicted end
+         * of rendering and the vblank, or -1 to draw as soon as
+         * there is a free buffer */
+        int render_margin;
+        int ignore_display_cache;
+        int hud;
+        int direct_scanout;
+        /* Frames between writeback captures, 0 to only capture on
+         * SIGUSR1 or -1 to disable capturing */
+        int capture_interval;
+        /* The device to render on if it isn't the display device */
+        const char *render_device;
+        /* Refresh rate in Hz to prefer, or 0 */
+        int target_refresh;
+        /* Modes that need more megapixels per second to be drawn
+         * are skipped. 0 for no limit. */
+        int max_pixel_rate;
+        /* quality, latency or gpu. This is parsed into mode_policy
+         * when connecting. */
+        const char *mode_policy_name;
+        enum mode_policy mode_policy;
+        /* Set to measure the renderer at each mode before choosing */
+        int probe_modes;
+        /* Set to flip as soon as each frame is drawn */
+        int immediate;
+        /* Slices per eye to race the beam with, or 0 */
+        int beam_slices;
+        /* A DRM fd leased from another process to use instead of
+         * opening the card, or -1 */
+        int lease_fd;
 };
 
 struct gbm_winsys {
         int fd;
+        /* The render device, or -1 if fd is used for rendering */
+        int render_fd;
         struct gbm_options options;
-        struct gbm_dev *dev;
+        /* Wakes the main loop for render-late scheduling */
+        int timer_fd;
         struct gbm_context *context;
+        struct gbm_output *outputs[MAX_OUTPUTS];
+        int n_outputs;
+        /* The output whose surface is bound to the context */
+        struct gbm_output *current_output;
+        /* The size last reported to the renderer */
+        EGLint width, height;
         const struct stereo_winsys_callbacks *callbacks;
         void *cb_data;
+        /* Saves the captures, or NULL if nothing is captured */
+        struct capture_writer *capture_writer;
+        /* The device that the leased fd belongs to. This names the
+         * display cache when no card is given. */
+        char *lease_card;
 };
 
 static int quit = 0;
+static int capture_requested = 0;
+
+static uint64_t
+get_time_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
 
 #define MULTIVIEW_WINDOW_EXTENSION "EGL_EXT_multiview_window"
+#define NATIVE_FENCE_EXTENSION "EGL_ANDROID_native_fence_sync"
+#define MODIFIERS_EXTENSION "EGL_EXT_image_dma_buf_import_modifiers"
+
+static int
+get_crtc_index(drmModeRes *res, uint32_t crtc_id)
+{
+        int i;
+
+        for (i = 0; i < res->count_crtcs; i++)
+                if (res->crtcs[i] == crtc_id)
+                        return i;
+
+        return -1;
+}
 
+/* Picks a CRTC for the connector that isn't in the used_crtcs mask
+ * of CRTC indices already taken by other outputs */
 static int
 stereo_find_crtc(drmModeRes *res, drmModeConnector *conn,
+                 uint32_t used_crtcs,
                  struct gbm_dev *dev)
 {
         drmModeEncoder *enc;
         unsigned int i, j;
-        int32_t crtc;
+        int crtc_index;
 
         /* first try the currently conected encoder+crtc */
         if (conn->encoder_id) {
                 enc = drmModeGetEncoder(dev->fd, conn->encoder_id);
-                if (enc->crtc_id >= 0) {
+                if (enc) {
+                        crtc_index = get_crtc_index(res, enc->crtc_id);
                         drmModeFreeEncoder(enc);
-                        dev->crtc = enc->crtc_id;
-                        return 0;
+                        if (crtc_index != -1 &&
+                            !(used_crtcs & (1 << crtc_index))) {
+                                dev->crtc = res->crtcs[crtc_index];
+                                return 0;
+                        }
                 }
         }
 
@@ -112,15 +523,14 @@ stereo_find_crtc(drmModeRes *res, drmModeConnector *conn,
                         if (!(enc->possible_crtcs & (1 << j)))
                                 continue;
 
-                        /* check that no other device already uses this CRTC */
-                        crtc = res->crtcs[j];
+                        /* check that no other output already uses this CRTC */
+                        if (used_crtcs & (1 << j))
+                                continue;
 
                         /* we have found a CRTC, so save it and return */
-                        if (crtc >= 0) {
-                                drmModeFreeEncoder(enc);
-                                dev->crtc = crtc;
-                                return 0;
-                        }
+                        drmModeFreeEncoder(enc);
+                        dev->crtc = res->crtcs[j];
+                        return 0;
                 }
 
                 drmModeFreeEncoder(enc);
@@ -131,756 +541,4353 @@ stereo_find_crtc(drmModeRes *res, drmModeConnector *conn,
         return -ENOENT;
 }
 
+static const char *
+get_stereo_mode_name(int stereo_flags);
+
+/* Looks up the ids of the named properties of a KMS object. Returns
+ * -ENOENT if any of them are missing, in which case the missing ids
+ * are left as 0. The values are optionally returned too. */
 static int
-get_mode_rank(const drmModeModeInfo *mode)
+get_prop_ids(int fd,
+             uint32_t object_id,
+             uint32_t object_type,
+             const char *const *names,
+             int n_names,
+             uint32_t *ids,
+             uint64_t *values)
 {
-        int layout;
-        int i;
+        drmModeObjectProperties *props;
+        drmModePropertyRes *prop;
+        int i, j, ret = 0;
 
-        if (mode == NULL)
-                return -1;
+        props = drmModeObjectGetProperties(fd, object_id, object_type);
+        if (props == NULL)
+                return -ENOENT;
 
-        layout = mode->flags & DRM_MODE_FLAG_3D_MASK;
+        for (i = 0; i < n_names; i++) {
+                ids[i] = 0;
 
-        static const int ranks[] = {
-                DRM_MODE_FLAG_3D_NONE,
-                DRM_MODE_FLAG_3D_LINE_ALTERNATIVE,
-                DRM_MODE_FLAG_3D_TOP_AND_BOTTOM,
-                DRM_MODE_FLAG_3D_SIDE_BY_SIDE_HALF,
-                DRM_MODE_FLAG_3D_SIDE_BY_SIDE_FULL,
-                DRM_MODE_FLAG_3D_FRAME_PACKING,
-        };
+                for (j = 0; j < props->count_props; j++) {
+                        prop = drmModeGetProperty(fd, props->props[j]);
+                        if (prop == NULL)
+                                continue;
+                        if (!strcmp(prop->name, names[i])) {
+                                ids[i] = prop->prop_id;
+                                if (values)
+                                        values[i] = props->prop_values[j];
+                        }
+                        drmModeFreeProperty(prop);
+                        if (ids[i])
+                                break;
+                }
 
-        for (i = 0; i < sizeof(ranks) / sizeof(ranks[0]); i++)
-                if (ranks[i] == layout)
-                        return i;
+                if (ids[i] == 0)
+                        ret = -ENOENT;
+        }
 
-        return -1;
+        drmModeFreeObjectProperties(props);
+
+        return ret;
 }
 
 static int
-is_chosen_mode(const drmModeModeInfo *mode,
-               const struct gbm_options *options,
-               const drmModeModeInfo *old_mode)
+plane_supports_format(const drmModePlane *plane, uint32_t format)
 {
-        switch ((mode->flags & DRM_MODE_FLAG_3D_MASK)) {
-        case DRM_MODE_FLAG_3D_NONE:
-                return ((options->stereo_layout == NULL ||
-                         !strcmp(options->stereo_layout, "none")) &&
-                        get_mode_rank(mode) > get_mode_rank(old_mode));
-        case DRM_MODE_FLAG_3D_TOP_AND_BOTTOM:
-                return ((options->stereo_layout == NULL ||
-                         !strcmp(options->stereo_layout, "tb")) &&
-                        get_mode_rank(mode) > get_mode_rank(old_mode));
-        case DRM_MODE_FLAG_3D_SIDE_BY_SIDE_HALF:
-                return ((options->stereo_layout == NULL ||
-                         !strcmp(options->stereo_layout, "sbsh")) &&
-                        get_mode_rank(mode) > get_mode_rank(old_mode));
-        case DRM_MODE_FLAG_3D_SIDE_BY_SIDE_FULL:
-                return ((options->stereo_layout == NULL ||
-                         !strcmp(options->stereo_layout, "sbsf")) &&
-                        get_mode_rank(mode) > get_mode_rank(old_mode));
-        case DRM_MODE_FLAG_3D_FRAME_PACKING:
-                return ((options->stereo_layout == NULL ||
-                         !strcmp(options->stereo_layout, "fp")) &&
-                        get_mode_rank(mode) > get_mode_rank(old_mode));
-        case DRM_MODE_FLAG_3D_LINE_ALTERNATIVE:
-                return ((options->stereo_layout == NULL ||
-                         !strcmp(options->stereo_layout, "la")) &&
-                        get_mode_rank(mode) > get_mode_rank(old_mode));
-        default:
+        uint32_t i;
+
+        for (i = 0; i < plane->count_formats; i++)
+                if (plane->formats[i] == format)
+                        return 1;
+
+        return 0;
+}
+
+/* Finds a plane of the given type that can be used with the CRTC and
+ * fills in its property ids. If format isn't 0 the plane must support
+ * it. The planes in the used list are skipped. Returns 0 if no plane
+ * is found. */
+static uint32_t
+find_plane(int fd,
+           int crtc_index,
+           uint64_t type,
+           uint32_t format,
+           const uint32_t *used_planes,
+           int n_used_planes,
+           uint32_t *props)
+{
+        drmModePlaneRes *plane_res;
+        drmModePlane *plane;
+        uint64_t values[N_PLANE_PROPS];
+        uint32_t plane_id = 0;
+        unsigned int i;
+        int j;
+
+        plane_res = drmModeGetPlaneResources(fd);
+        if (plane_res == NULL)
                 return 0;
+
+        for (i = 0; i < plane_res->count_planes && plane_id == 0; i++) {
+                for (j = 0; j < n_used_planes; j++)
+                        if (used_planes[j] == plane_res->planes[i])
+                                break;
+                if (j < n_used_planes)
+                        continue;
+
+                plane = drmModeGetPlane(fd, plane_res->planes[i]);
+                if (plane == NULL)
+                        continue;
+
+                if ((plane->possible_crtcs & (1 << crtc_index)) &&
+                    (format == 0 || plane_supports_format(plane, format)) &&
+                    get_prop_ids(fd,
+                                 plane->plane_id,
+                                 DRM_MODE_OBJECT_PLANE,
+                                 plane_prop_names,
+                                 N_PLANE_PROPS,
+                                 props,
+                                 values) == 0 &&
+                    values[PLANE_PROP_TYPE] == type)
+                        plane_id = plane->plane_id;
+
+                drmModeFreePlane(plane);
         }
+
+        drmModeFreePlaneResources(plane_res);
+
+        return plane_id;
 }
 
+/* Finds a primary plane for the CRTC. Some hardware lets a primary
+ * plane be used with several CRTCs so the ones that other outputs
+ * have taken are skipped. */
 static int
-find_mode(struct gbm_dev *dev, drmModeConnector *conn,
-          const struct gbm_options *options)
+find_primary_plane(struct gbm_dev *dev,
+                   int crtc_index,
+                   const uint32_t *used_planes,
+                   int n_used_planes)
 {
-        const drmModeModeInfo *old_mode = NULL;
-        int i;
+        dev->plane = find_plane(dev->fd,
+                                crtc_index,
+                                DRM_PLANE_TYPE_PRIMARY,
+                                0, /* format */
+                                used_planes, n_used_planes,
+                                dev->plane_props);
+
+        return dev->plane ? 0 : -ENOENT;
+}
 
-        for (i = 0; i < conn->count_modes; i++) {
-                if (is_chosen_mode(conn->modes + i, options, old_mode)) {
-                        dev->mode = conn->modes[i];
-                        old_mode = &conn->modes[i];
+/* Reads the modifiers that the plane can scan out the format with
+ * from its IN_FORMATS blob */
+static void
+get_plane_modifiers(struct gbm_dev *dev, uint32_t format)
+{
+        static const char *const in_formats_prop_name = "IN_FORMATS";
+        const struct drm_format_modifier_blob *header;
+        const struct drm_format_modifier *mods;
+        drmModePropertyBlobRes *blob;
+        const uint32_t *formats;
+        uint32_t prop_id, i, index;
+        uint64_t blob_id;
+
+        if (get_prop_ids(dev->fd,
+                         dev->plane,
+                         DRM_MODE_OBJECT_PLANE,
+                         &in_formats_prop_name,
+                         1,
+                         &prop_id,
+                         &blob_id) ||
+            blob_id == 0)
+                return;
+
+        blob = drmModeGetPropertyBlob(dev->fd, blob_id);
+        if (blob == NULL)
+                return;
+
+        header = blob->data;
+        formats = (const uint32_t *) ((const char *) header +
+                                      header->formats_offset);
+        mods = (const struct drm_format_modifier *)
+                ((const char *) header + header->modifiers_offset);
+
+        for (index = 0; index < header->count_formats; index++)
+                if (formats[index] == format)
+                        break;
+
+        if (index < header->count_formats) {
+                dev->modifiers = xmalloc(header->count_modifiers *
+                                         sizeof *dev->modifiers);
+
+                /* Each modifier has a mask of the 64 formats
+                 * starting from its offset that it applies to */
+                for (i = 0; i < header->count_modifiers; i++) {
+                        if (index < mods[i].offset ||
+                            index >= mods[i].offset + 64 ||
+                            !(mods[i].formats &
+                              (UINT64_C(1) << (index - mods[i].offset))))
+                                continue;
+                        dev->modifiers[dev->n_modifiers++] =
+                                mods[i].modifier;
                 }
         }
 
-        return old_mode ? 0 : -ENOENT;
+        drmModeFreePropertyBlob(blob);
 }
 
-static const char *
-get_stereo_mode_name(int stereo_flags)
+/* Finds the primary plane and all of the properties needed for
+ * atomic commits on the chosen CRTC */
+static int
+init_atomic(drmModeRes *res,
+            const uint32_t *used_planes,
+            int n_used_planes,
+            struct gbm_dev *dev)
 {
-        switch (stereo_flags) {
-        case DRM_MODE_FLAG_3D_NONE:
-                return "none";
-        case DRM_MODE_FLAG_3D_FRAME_PACKING:
-                return "frame packing";
-        case DRM_MODE_FLAG_3D_FIELD_ALTERNATIVE:
-                return "field alternative";
-        case DRM_MODE_FLAG_3D_LINE_ALTERNATIVE:
-                return "line alternative";
-        case DRM_MODE_FLAG_3D_SIDE_BY_SIDE_FULL:
-                return "side by side full";
-        case DRM_MODE_FLAG_3D_L_DEPTH:
-                return "l depth";
-        case DRM_MODE_FLAG_3D_L_DEPTH_GFX_GFX_DEPTH:
-                return "l depth gfx gfx depth";
-        case DRM_MODE_FLAG_3D_TOP_AND_BOTTOM:
-                return "top and bottom";
-        case DRM_MODE_FLAG_3D_SIDE_BY_SIDE_HALF:
-                return "side by side half";
-        default:
-                return "unknown";
+        int crtc_index = get_crtc_index(res, dev->crtc);
+
+        if (crtc_index == -1)
+                return -ENOENT;
+
+        if (get_prop_ids(dev->fd,
+                         dev->conn,
+                         DRM_MODE_OBJECT_CONNECTOR,
+                         conn_prop_names,
+                         N_CONN_PROPS,
+                         dev->conn_props,
+                         NULL) ||
+            get_prop_ids(dev->fd,
+                         dev->crtc,
+                         DRM_MODE_OBJECT_CRTC,
+                         crtc_prop_names,
+                         N_CRTC_PROPS,
+                         dev->crtc_props,
+                         NULL)) {
+                fprintf(stderr,
+                        "missing atomic KMS properties for connector %u "
+                        "or CRTC %u\n",
+                        dev->conn, dev->crtc);
+                return -ENOENT;
+        }
+
+        if (find_primary_plane(dev,
+                               crtc_index,
+                               used_planes,
+                               n_used_planes)) {
+                fprintf(stderr,
+                        "no primary plane found for CRTC %u\n",
+                        dev->crtc);
+                return -ENOENT;
         }
+
+        /* The fence properties are optional. Explicit fencing is
+         * only used if both are present. */
+        get_prop_ids(dev->fd,
+                     dev->plane,
+                     DRM_MODE_OBJECT_PLANE,
+                     &in_fence_prop_name,
+                     1,
+                     &dev->in_fence_prop,
+                     NULL);
+        get_prop_ids(dev->fd,
+                     dev->crtc,
+                     DRM_MODE_OBJECT_CRTC,
+                     &out_fence_prop_name,
+                     1,
+                     &dev->out_fence_prop,
+                     NULL);
+
+        get_plane_modifiers(dev, GBM_FORMAT_XRGB8888);
+
+        return 0;
+}
+
+/* Shows the whole of a framebuffer on a plane, scaled to the given
+ * rectangle of the CRTC */
+static void
+add_scaled_plane_state(drmModeAtomicReq *req,
+                       uint32_t plane,
+                       const uint32_t *props,
+                       uint32_t crtc,
+                       uint32_t fb_id,
+                       uint32_t fb_width,
+                       uint32_t fb_height,
+                       int32_t x, int32_t y,
+                       uint32_t width,
+                       uint32_t height)
+{
+        drmModeAtomicAddProperty(req, plane,
+                                 props[PLANE_PROP_FB_ID], fb_id);
+        drmModeAtomicAddProperty(req, plane,
+                                 props[PLANE_PROP_CRTC_ID], crtc);
+        /* The source rectangle is in 16.16 fixed point */
+        drmModeAtomicAddProperty(req, plane,
+                                 props[PLANE_PROP_SRC_X], 0);
+        drmModeAtomicAddProperty(req, plane,
+                                 props[PLANE_PROP_SRC_Y], 0);
+        drmModeAtomicAddProperty(req, plane,
+                                 props[PLANE_PROP_SRC_W],
+                                 (uint64_t) fb_width << 16);
+        drmModeAtomicAddProperty(req, plane,
+                                 props[PLANE_PROP_SRC_H],
+                                 (uint64_t) fb_height << 16);
+        drmModeAtomicAddProperty(req, plane,
+                                 props[PLANE_PROP_CRTC_X], x);
+        drmModeAtomicAddProperty(req, plane,
+                                 props[PLANE_PROP_CRTC_Y], y);
+        drmModeAtomicAddProperty(req, plane,
+                                 props[PLANE_PROP_CRTC_W], width);
+        drmModeAtomicAddProperty(req, plane,
+                                 props[PLANE_PROP_CRTC_H], height);
+}
+
+/* Shows the whole of a framebuffer unscaled on a plane at the given
+ * position on the CRTC */
+static void
+add_plane_state(drmModeAtomicReq *req,
+                uint32_t plane,
+                const uint32_t *props,
+                uint32_t crtc,
+                uint32_t fb_id,
+                int32_t x, int32_t y,
+                uint32_t width,
+                uint32_t height)
+{
+        add_scaled_plane_state(req,
+                               plane,
+                               props,
+                               crtc,
+                               fb_id,
+                               width, height,
+                               x, y,
+                               width, height);
+}
+
+static void
+add_plane_props(drmModeAtomicReq *req,
+                const struct gbm_dev *dev,
+                uint32_t fb_id,
+                uint32_t width,
+                uint32_t height)
+{
+        add_plane_state(req,
+                        dev->plane,
+                        dev->plane_props,
+                        dev->crtc,
+                        fb_id,
+                        0, 0, /* x/y */
+                        width, height);
 }
 
+/* Commits a full modeset of the connector, CRTC and primary plane.
+ * With DRM_MODE_ATOMIC_TEST_ONLY in flags this only checks whether
+ * the configuration would work. */
 static int
-stereo_setup_dev(drmModeRes *res, drmModeConnector *conn,
-                 const struct gbm_options *options,
-                 struct gbm_dev *dev)
+atomic_modeset(const struct gbm_dev *dev,
+               uint32_t mode_blob_id,
+               uint32_t fb_id,
+               uint32_t width,
+               uint32_t height,
+               uint32_t flags)
 {
+        drmModeAtomicReq *req = drmModeAtomicAlloc();
         int ret;
 
-        /* check if a monitor is connected */
-        if (conn->connection != DRM_MODE_CONNECTED) {
-                fprintf(stderr, "ignoring unused connector %u\n",
-                        conn->connector_id);
-                return -ENOENT;
-        }
+        drmModeAtomicAddProperty(req, dev->conn,
+                                 dev->conn_props[CONN_PROP_CRTC_ID],
+                                 dev->crtc);
+        drmModeAtomicAddProperty(req, dev->crtc,
+                                 dev->crtc_props[CRTC_PROP_MODE_ID],
+                                 mode_blob_id);
+        drmModeAtomicAddProperty(req, dev->crtc,
+                                 dev->crtc_props[CRTC_PROP_ACTIVE],
+                                 1);
+        add_plane_props(req, dev, fb_id, width, height);
+
+        ret = drmModeAtomicCommit(dev->fd,
+                                  req,
+                                  flags | DRM_MODE_ATOMIC_ALLOW_MODESET,
+                                  NULL);
+
+        drmModeAtomicFree(req);
+
+        return ret ? -errno : 0;
+}
 
-        ret = find_mode(dev, conn, options);
-        if (ret) {
-                fprintf(stderr, "no valid mode for connector %u\n",
-                        conn->connector_id);
-                return ret;
-        }
+/* Gets the size of the framebuffer needed to scan out a mode. Frame
+ * packing stacks both eyes with the vertical blank in between. */
+static void
+get_mode_fb_size(const drmModeModeInfo *mode,
+                 uint32_t *width,
+                 uint32_t *height)
+{
+        *width = mode->hdisplay;
 
-        /* copy the mode information into our device structure */
-        dev->width = dev->mode.hdisplay;
-        dev->height = dev->mode.vdisplay;
-        fprintf(stderr, "mode for connector %u is %ux%u (%s)\n",
-                conn->connector_id,
-                dev->width, dev->height,
-                get_stereo_mode_name(dev->mode.flags & DRM_MODE_FLAG_3D_MASK));
+        if ((mode->flags & DRM_MODE_FLAG_3D_MASK) ==
+            DRM_MODE_FLAG_3D_FRAME_PACKING)
+                *height = mode->vtotal + mode->vdisplay;
+        else
+                *height = mode->vdisplay;
+}
 
-        /* find a crtc for this connector */
-        ret = stereo_find_crtc(res, conn, dev);
-        if (ret) {
-                fprintf(stderr, "no valid crtc for connector %u\n",
-                        conn->connector_id);
-                return ret;
+/* Gets the part of the scanout that an eye occupies in the stereo
+ * layout of the mode. Returns -ENOTSUP for line alternative because
+ * the eyes are interleaved. */
+static int
+get_eye_rect(const drmModeModeInfo *mode,
+             int eye,
+             int *x, int *y,
+             uint32_t *width,
+             uint32_t *height)
+{
+        uint32_t fb_width, fb_height;
+
+        get_mode_fb_size(mode, &fb_width, &fb_height);
+
+        *x = 0;
+        *y = 0;
+        *width = fb_width;
+        *height = fb_height;
+
+        switch (mode->flags & DRM_MODE_FLAG_3D_MASK) {
+        case DRM_MODE_FLAG_3D_FRAME_PACKING:
+                /* The right eye starts after the vblank gap */
+                *height = mode->vdisplay;
+                *y = eye ? mode->vtotal : 0;
+                break;
+        case DRM_MODE_FLAG_3D_TOP_AND_BOTTOM:
+                *height = fb_height / 2;
+                *y = eye * *height;
+                break;
+        case DRM_MODE_FLAG_3D_LINE_ALTERNATIVE:
+                return -ENOTSUP;
+        default:
+                /* Side by side. This includes the 2D mode because
+                 * the GBM surface is still allocated side by side. */
+                *width = fb_width / 2;
+                *x = eye * *width;
+                break;
         }
 
         return 0;
 }
 
+/* Creates a dumb buffer. depth is 24 for XRGB8888 or 32 for
+ * ARGB8888. */
 static int
-stereo_open(int *out, const struct gbm_options *options)
+create_dumb_fb(int fd,
+               uint32_t width,
+               uint32_t height,
+               uint32_t depth,
+               struct dumb_fb *fb)
 {
-        const char *card = options->card;
-        int fd, ret;
+        struct drm_mode_create_dumb create;
+        struct drm_mode_destroy_dumb destroy;
 
-        if (card == NULL)
-                card = "/dev/dri/card0";
+        memset(&create, 0, sizeof create);
+        create.width = width;
+        create.height = height;
+        create.bpp = 32;
 
-        fd = open(card, O_RDWR | O_CLOEXEC);
-        if (fd < 0) {
-                ret = -errno;
-                fprintf(stderr, "cannot open '%s': %m\n", card);
-                return ret;
-        }
+        if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create))
+                return -errno;
 
-        if (drmSetClientCap(fd, DRM_CLIENT_CAP_STEREO_3D, 1)) {
-                fprintf(stderr, "error setting stereo client cap: %m\n");
-                close(fd);
+        if (drmModeAddFB(fd,
+                         width, height,
+                         depth,
+                         32, /* bpp */
+                         create.pitch,
+                         create.handle,
+                         &fb->fb_id)) {
+                memset(&destroy, 0, sizeof destroy);
+                destroy.handle = create.handle;
+                drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
                 return -errno;
         }
 
-        *out = fd;
+        fb->handle = create.handle;
+        fb->width = width;
+        fb->height = height;
+        fb->pitch = create.pitch;
+        fb->size = create.size;
+        fb->map = NULL;
+
         return 0;
 }
 
-static drmModeConnector *
-get_connector(int fd, drmModeRes *res,
-              const struct gbm_options *options)
+static int
+map_dumb_fb(int fd, struct dumb_fb *fb)
 {
-        drmModeConnector *conn;
-        int i;
+        struct drm_mode_map_dumb map;
+        void *ptr;
 
-        for (i = 0; i < res->count_connectors; i++) {
-                conn = drmModeGetConnector(fd, res->connectors[i]);
+        memset(&map, 0, sizeof map);
+        map.handle = fb->handle;
 
-                if (conn == NULL) {
-                        fprintf(stderr,
-                                "cannot retrieve DRM connector "
-                                "%u:%u (%d): %m\n",
-                                i, res->connectors[i], errno);
-                        return NULL;
-                }
+        if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &map))
+                return -errno;
 
-                if (options->connector == -1 ||
-                    conn->connector_id == options->connector)
-                        return conn;
-                drmModeFreeConnector(conn);
-        }
+        ptr = mmap(NULL, fb->size,
+                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, map.offset);
+        if (ptr == MAP_FAILED)
+                return -errno;
 
-        fprintf(stderr,
-                "couldn't find connector with id %i\n",
-                options->connector);
+        fb->map = ptr;
 
-        return NULL;
+        return 0;
 }
 
-static struct gbm_dev *
-stereo_prepare_dev(int fd, const struct gbm_options *options)
+static void
+destroy_dumb_fb(int fd, struct dumb_fb *fb)
 {
-        drmModeRes *res;
-        drmModeConnector *conn;
-        struct gbm_dev *dev;
-        int ret;
+        struct drm_mode_destroy_dumb destroy;
 
-        /* retrieve resources */
-        res = drmModeGetResources(fd);
-        if (!res) {
-                fprintf(stderr, "cannot retrieve DRM resources (%d): %m\n",
-                        errno);
-                goto error;
-        }
+        if (fb->map)
+                munmap(fb->map, fb->size);
 
-        conn = get_connector(fd, res, options);
-        if (!conn)
-                goto error_resources;
+        drmModeRmFB(fd, fb->fb_id);
 
-        /* create a device structure */
-        dev = xmalloc(sizeof(*dev));
-        memset(dev, 0, sizeof(*dev));
-        dev->conn = conn->connector_id;
-        dev->fd = fd;
+        memset(&destroy, 0, sizeof destroy);
+        destroy.handle = fb->handle;
+        drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+}
 
-        /* call helper function to prepare this connector */
-        ret = stereo_setup_dev(res, conn, options, dev);
-        if (ret) {
-                if (ret != -ENOENT) {
-                        errno = -ret;
-                        fprintf(stderr,
-                                "cannot setup device for connector "
-                                "%u:%u (%d): %m\n",
-                                0, res->connectors[0], errno);
-                }
-                goto error_dev;
+/* Checks with a test-only commit that the mode can be set on the
+ * CRTC with a full screen primary plane */
+static int
+test_mode(const struct gbm_dev *dev, const drmModeModeInfo *mode)
+{
+        uint32_t width, height, blob_id;
+        struct dumb_fb fb;
+        int ret;
+
+        get_mode_fb_size(mode, &width, &height);
+
+        ret = create_dumb_fb(dev->fd, width, height, 24 /* depth */, &fb);
+        if (ret)
+                return ret;
+
+        if (drmModeCreatePropertyBlob(dev->fd,
+                                      mode,
+                                      sizeof *mode,
+                                      &blob_id)) {
+                ret = -errno;
+        } else {
+                ret = atomic_modeset(dev,
+                                     blob_id,
+                                     fb.fb_id,
+                                     width, height,
+                                     DRM_MODE_ATOMIC_TEST_ONLY);
+                drmModeDestroyPropertyBlob(dev->fd, blob_id);
         }
 
-        drmModeFreeConnector(conn);
-        drmModeFreeResources(res);
+        destroy_dumb_fb(dev->fd, &fb);
 
-        return dev;
+        if (ret)
+                fprintf(stderr,
+                        "mode %s (%s) rejected by atomic test\n",
+                        mode->name,
+                        get_stereo_mode_name(mode->flags &
+                                             DRM_MODE_FLAG_3D_MASK));
 
-error_dev:
-        free(dev);
-        drmModeFreeConnector(conn);
-error_resources:
-        drmModeFreeResources(res);
-error:
-        return NULL;
+        return ret;
 }
 
-static void
-restore_saved_crtc(struct gbm_dev *dev)
+static int
+get_mode_rank(const drmModeModeInfo *mode)
 {
-        /* restore saved CRTC configuration */
-        if (dev->saved_crtc) {
-                drmModeSetCrtc(dev->fd,
-                               dev->saved_crtc->crtc_id,
-                               dev->saved_crtc->buffer_id,
-                               dev->saved_crtc->x,
-                               dev->saved_crtc->y,
-                               &dev->conn,
-                               1,
-                               &dev->saved_crtc->mode);
-                drmModeFreeCrtc(dev->saved_crtc);
+        int layout;
+        int i;
 
-                dev->saved_crtc = NULL;
-        }
-}
+        if (mode == NULL)
+                return -1;
 
-static void
-stereo_cleanup_dev(struct gbm_dev *dev)
-{
-        restore_saved_crtc(dev);
+        layout = mode->flags & DRM_MODE_FLAG_3D_MASK;
 
-        /* free allocated memory */
-        free(dev);
-}
+        static const int ranks[] = {
+                DRM_MODE_FLAG_3D_NONE,
+                DRM_MODE_FLAG_3D_LINE_ALTERNATIVE,
+                DRM_MODE_FLAG_3D_TOP_AND_BOTTOM,
+                DRM_MODE_FLAG_3D_SIDE_BY_SIDE_HALF,
+                DRM_MODE_FLAG_3D_SIDE_BY_SIDE_FULL,
+                DRM_MODE_FLAG_3D_FRAME_PACKING,
+        };
 
-static void
-free_current_bo(struct gbm_context *context)
-{
-        if (context->current_fb_id) {
-                drmModeRmFB(context->dev->fd, context->current_fb_id);
-                context->current_fb_id = 0;
-        }
-        if (context->current_bo) {
-                gbm_surface_release_buffer(context->gbm_surface,
-                                           context->current_bo);
-                context->current_bo = NULL;
-        }
+        for (i = 0; i < sizeof(ranks) / sizeof(ranks[0]); i++)
+                if (ranks[i] == layout)
+                        return i;
+
+        return -1;
 }
 
 static int
-create_gbm_surface(struct gbm_context *context)
+is_allowed_layout(const drmModeModeInfo *mode,
+                  const struct gbm_options *options)
 {
-        const uint32_t flags = GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING;
-        const drmModeModeInfo *drm_mode = &context->dev->mode;
-        struct gbm_bo_mode mode;
-
-        switch ((drm_mode->flags & DRM_MODE_FLAG_3D_MASK)) {
+        switch ((mode->flags & DRM_MODE_FLAG_3D_MASK)) {
         case DRM_MODE_FLAG_3D_NONE:
-                mode.layout = GBM_BO_STEREO_LAYOUT_SIDE_BY_SIDE_HALF;
-                break;
-        case DRM_MODE_FLAG_3D_FRAME_PACKING:
-                mode.layout = GBM_BO_STEREO_LAYOUT_FRAME_PACKING;
-                break;
-        case DRM_MODE_FLAG_3D_LINE_ALTERNATIVE:
-                mode.layout = GBM_BO_STEREO_LAYOUT_LINE_ALTERNATIVE;
-                break;
-        case DRM_MODE_FLAG_3D_SIDE_BY_SIDE_FULL:
-                mode.layout = GBM_BO_STEREO_LAYOUT_SIDE_BY_SIDE_FULL;
-                break;
+                return (options->stereo_layout == NULL ||
+                        !strcmp(options->stereo_layout, "none"));
         case DRM_MODE_FLAG_3D_TOP_AND_BOTTOM:
-                mode.layout = GBM_BO_STEREO_LAYOUT_TOP_AND_BOTTOM;
-                break;
+                return (options->stereo_layout == NULL ||
+                        !strcmp(options->stereo_layout, "tb"));
         case DRM_MODE_FLAG_3D_SIDE_BY_SIDE_HALF:
-                mode.layout = GBM_BO_STEREO_LAYOUT_SIDE_BY_SIDE_HALF;
-                break;
+                return (options->stereo_layout == NULL ||
+                        !strcmp(options->stereo_layout, "sbsh"));
+        case DRM_MODE_FLAG_3D_SIDE_BY_SIDE_FULL:
+                return (options->stereo_layout == NULL ||
+                        !strcmp(options->stereo_layout, "sbsf"));
+        case DRM_MODE_FLAG_3D_FRAME_PACKING:
+                return (options->stereo_layout == NULL ||
+                        !strcmp(options->stereo_layout, "fp"));
+        case DRM_MODE_FLAG_3D_LINE_ALTERNATIVE:
+                return (options->stereo_layout == NULL ||
+                        !strcmp(options->stereo_layout, "la"));
         default:
-                fprintf(stderr,
-                        "unknown DRM mode layout 0x%x\n",
-                        (drm_mode->flags & DRM_MODE_FLAG_3D_MASK));
-                return -ENOENT;
+                return 0;
         }
+}
 
-        mode.hdisplay = drm_mode->hdisplay;
-        mode.hsync_start = drm_mode->hsync_start;
-        mode.hsync_end = drm_mode->hsync_end;
-        mode.htotal = drm_mode->htotal;
-        mode.vdisplay = drm_mode->vdisplay;
-        mode.vsync_start = drm_mode->vsync_start;
-        mode.vsync_end = drm_mode->vsync_end;
-        mode.vtotal = drm_mode->vtotal;
-        mode.format = GBM_BO_FORMAT_XRGB8888;
+/* Gets the time between vblanks of a mode in nanoseconds, or 0 if
+ * the mode has no pixel clock */
+static uint64_t
+get_mode_refresh_ns(const drmModeModeInfo *mode)
+{
+        if (mode->clock == 0)
+                return 0;
 
-        context->gbm_surface =
-                gbm_surface_create_with_mode(context->gbm, &mode, flags);
+        return ((uint64_t) mode->htotal *
+                mode->vtotal *
+                1000000 /
+                mode->clock);
+}
 
-        if (context->gbm_surface == NULL) {
-                fprintf(stderr, "error creating GBM surface\n");
-                return -ENOENT;
-        }
+/* Gets the number of pixels drawn for each frame of a mode */
+static uint64_t
+get_mode_pixels(const drmModeModeInfo *mode)
+{
+        uint32_t width, height;
 
-        return 0;
+        get_mode_fb_size(mode, &width, &height);
+
+        return (uint64_t) width * height;
 }
 
 static int
-choose_egl_config(struct gbm_context *context)
+compare_values(uint64_t a, uint64_t b)
 {
-        static const EGLint attribs[] = {
-                EGL_RED_SIZE, 1,
-                EGL_GREEN_SIZE, 1,
-                EGL_BLUE_SIZE, 1,
-                EGL_ALPHA_SIZE, EGL_DONT_CARE,
-                EGL_DEPTH_SIZE, 1,
-                EGL_BUFFER_SIZE, EGL_DONT_CARE,
-                EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
-                EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
-                EGL_NONE
-        };
-        EGLBoolean status;
-        EGLint config_count;
+        return a > b ? 1 : a < b ? -1 : 0;
+}
 
-        status = eglChooseConfig(context->edpy,
-                                 attribs,
-                                 &context->egl_config, 1,
-                                 &config_count);
-        if (status != EGL_TRUE || config_count < 1) {
-                fprintf(stderr, "Unable to find a usable EGL configuration\n");
-                return -ENOENT;
+/* Compares two modes. Returns a positive number if a is better than
+ * b. The stereo layout always comes first, then the target refresh
+ * rate and then the policy. */
+static int
+compare_modes(const drmModeModeInfo *a,
+              const drmModeModeInfo *b,
+              const struct gbm_options *options)
+{
+        uint64_t refresh_a = get_mode_refresh_ns(a);
+        uint64_t refresh_b = get_mode_refresh_ns(b);
+        uint64_t target, distance_a, distance_b;
+        int pixels, refresh;
+
+        if (get_mode_rank(a) != get_mode_rank(b))
+                return get_mode_rank(a) - get_mode_rank(b);
+
+        if (options->target_refresh > 0) {
+                target = UINT64_C(1000000000) / options->target_refresh;
+                distance_a = (refresh_a > target ?
+                              refresh_a - target :
+                              target - refresh_a);
+                distance_b = (refresh_b > target ?
+                              refresh_b - target :
+                              target - refresh_b);
+                if (distance_a != distance_b)
+                        return compare_values(distance_b, distance_a);
         }
 
-        return 0;
+        pixels = compare_values(get_mode_pixels(a), get_mode_pixels(b));
+        /* A shorter refresh interval is a higher refresh rate */
+        refresh = compare_values(refresh_b, refresh_a);
+
+        switch (options->mode_policy) {
+        case MODE_POLICY_LATENCY:
+                return refresh ? refresh : pixels;
+        case MODE_POLICY_GPU:
+                return pixels ? -pixels : refresh;
+        case MODE_POLICY_QUALITY:
+                break;
+        }
+
+        return pixels ? pixels : refresh;
 }
 
+/* Checks whether drawing every frame of the mode stays within the
+ * maximum pixel rate */
 static int
-create_egl_surface(struct gbm_context *context,
-                   const struct gbm_options *options)
+is_within_pixel_rate(const drmModeModeInfo *mode,
+                     const struct gbm_options *options)
 {
-        static const EGLint attribs_3d[] = {
-                EGL_MULTIVIEW_VIEW_COUNT_EXT, 2,
-                EGL_NONE
-        };
-        context->egl_surface =
-                eglCreateWindowSurface(context->edpy,
-                                       context->egl_config,
-                                       (NativeWindowType) context->gbm_surface,
-                                       attribs_3d);
-        if (context->egl_surface == EGL_NO_SURFACE) {
-                fprintf(stderr, "Failed to create EGL surface\n");
-                return -ENOENT;
-        }
+        uint64_t refresh_ns = get_mode_refresh_ns(mode);
 
-        return 0;
+        if (options->max_pixel_rate <= 0 || refresh_ns == 0)
+                return 1;
+
+        return (get_mode_pixels(mode) * 1000 / refresh_ns <=
+                (uint64_t) options->max_pixel_rate);
 }
 
 static int
-create_egl_context(struct gbm_context *context)
+is_chosen_mode(const drmModeModeInfo *mode,
+               const struct gbm_options *options,
+               const drmModeModeInfo *old_mode)
 {
-        static const EGLint attribs[] = {
-                EGL_CONTEXT_CLIENT_VERSION, 2,
-                EGL_NONE
-        };
+        return (is_allowed_layout(mode, options) &&
+                get_mode_rank(mode) >= 0 &&
+                is_within_pixel_rate(mode, options) &&
+                (old_mode == NULL ||
+                 compare_modes(mode, old_mode, options) > 0));
+}
 
-        context->egl_context = eglCreateContext(context->edpy,
-                                                context->egl_config,
-                                                EGL_NO_CONTEXT,
-                                                attribs);
-        if (context->egl_context == EGL_NO_CONTEXT) {
-                fprintf(stderr, "Error creating EGL context\n");
-                return -ENOENT;
+/* Inserts a mode into the list of candidates, keeping it sorted best
+ * first */
+static void
+add_candidate_mode(struct gbm_dev *dev,
+                   const drmModeModeInfo *mode,
+                   const struct gbm_options *options)
+{
+        int i;
+
+        for (i = dev->n_candidate_modes; i > 0; i--) {
+                if (compare_modes(mode,
+                                  dev->candidate_modes + i - 1,
+                                  options) <= 0)
+                        break;
+                dev->candidate_modes[i] = dev->candidate_modes[i - 1];
         }
 
-        return 0;
+        dev->candidate_modes[i] = *mode;
+        dev->n_candidate_modes++;
 }
 
 static int
-extension_supported(EGLDisplay edpy, const char *ext)
+find_mode(struct gbm_dev *dev, drmModeConnector *conn,
+          const struct gbm_options *options)
 {
-        const char *exts = eglQueryString(edpy, EGL_EXTENSIONS);
+        const drmModeModeInfo *old_mode = NULL;
+        int i;
 
-        return extension_in_list(ext, exts);
-}
+        if (options->probe_modes)
+                dev->candidate_modes =
+                        xmalloc(conn->count_modes *
+                                sizeof *dev->candidate_modes);
 
-static struct gbm_context *
-stereo_prepare_context(struct gbm_dev *dev,
-                       const struct gbm_options *options)
-{
-        struct gbm_context *context;
-        EGLint multiview_view_count = 0;
+        for (i = 0; i < conn->count_modes; i++) {
+                /* Every usable mode is a candidate for probing, not
+                 * just the ones better than the best so far */
+                if (!is_chosen_mode(conn->modes + i,
+                                    options,
+                                    options->probe_modes ? NULL : old_mode) ||
+                    (dev->atomic && test_mode(dev, conn->modes + i)))
+                        continue;
 
-        context = xmalloc(sizeof(*context));
-        context->dev = dev;
+                if (options->probe_modes)
+                        add_candidate_mode(dev, conn->modes + i, options);
 
-        context->gbm = gbm_create_device(dev->fd);
-        if (context->gbm == NULL) {
-                fprintf(stderr, "error creating GBM device\n");
-                goto error;
+                if (old_mode == NULL ||
+                    compare_modes(conn->modes + i, old_mode, options) > 0) {
+                        dev->mode = conn->modes[i];
+                        old_mode = &conn->modes[i];
+                }
         }
 
-        context->edpy = eglGetDisplay((EGLNativeDisplayType) context->gbm);
-        if (context->edpy == EGL_NO_DISPLAY) {
-                fprintf(stderr, "error getting EGL display\n");
-                goto error_gbm_device;
+        return old_mode ? 0 : -ENOENT;
+}
+
+static const char *
+get_stereo_mode_name(int stereo_flags)
+{
+        switch (stereo_flags) {
+        case DRM_MODE_FLAG_3D_NONE:
+                return "none";
+        case DRM_MODE_FLAG_3D_FRAME_PACKING:
+                return "frame packing";
+        case DRM_MODE_FLAG_3D_FIELD_ALTERNATIVE:
+                return "field alternative";
+        case DRM_MODE_FLAG_3D_LINE_ALTERNATIVE:
+                return "line alternative";
+        case DRM_MODE_FLAG_3D_SIDE_BY_SIDE_FULL:
+                return "side by side full";
+        case DRM_MODE_FLAG_3D_L_DEPTH:
+                return "l depth";
+        case DRM_MODE_FLAG_3D_L_DEPTH_GFX_GFX_DEPTH:
+                return "l depth gfx gfx depth";
+        case DRM_MODE_FLAG_3D_TOP_AND_BOTTOM:
+                return "top and bottom";
+        case DRM_MODE_FLAG_3D_SIDE_BY_SIDE_HALF:
+                return "side by side half";
+        default:
+                return "unknown";
+        }
+}
+
+/* The display configuration chosen on a previous run. It is reused
+ * without testing the modes again if the connector still has the same
+ * EDID and the options that affect the choice are the same. */
+#define DISPLAY_CACHE_VERSION 2
+
+struct display_cache {
+        uint32_t version;
+        uint32_t connector;
+        uint32_t crtc;
+        uint32_t padding;
+        uint64_t edid_hash;
+        char stereo_layout[16];
+        int32_t target_refresh;
+        int32_t max_pixel_rate;
+        int32_t mode_policy;
+        int32_t padding2;
+        drmModeModeInfo mode;
+};
+
+static char *
+get_display_cache_path(const struct gbm_options *options,
+                       uint32_t connector_id)
+{
+        const char *card = options->card ? options->card : "card0";
+        const char *base = strrchr(card, '/');
+        char *name, *path;
+
+        base = base ? base + 1 : card;
+        name = xmalloc(strlen(base) + 32);
+        sprintf(name, "display-%s-%u", base, connector_id);
+
+        path = get_cache_path(name);
+
+        free(name);
+
+        return path;
+}
+
+/* Returns a hash of the EDID the connector reported when it was last
+ * probed, or 0 if it doesn't have one */
+static uint64_t
+get_edid_hash(int fd, uint32_t connector_id)
+{
+        static const char *const edid_prop_name = "EDID";
+        drmModePropertyBlobRes *blob;
+        uint64_t hash = UINT64_C(0xcbf29ce484222325);
+        const uint8_t *data;
+        uint32_t prop_id;
+        uint64_t blob_id;
+        uint32_t i;
+
+        if (get_prop_ids(fd,
+                         connector_id,
+                         DRM_MODE_OBJECT_CONNECTOR,
+                         &edid_prop_name,
+                         1,
+                         &prop_id,
+                         &blob_id) ||
+            blob_id == 0)
+                return 0;
+
+        blob = drmModeGetPropertyBlob(fd, blob_id);
+        if (blob == NULL)
+                return 0;
+
+        /* 64-bit FNV-1a */
+        data = blob->data;
+        for (i = 0; i < blob->length; i++) {
+                hash ^= data[i];
+                hash *= UINT64_C(0x100000001b3);
+        }
+
+        drmModeFreePropertyBlob(blob);
+
+        return hash;
+}
+
+static void
+init_display_cache(struct display_cache *cache,
+                   drmModeConnector *conn,
+                   const struct gbm_options *options,
+                   uint64_t edid_hash)
+{
+        memset(cache, 0, sizeof *cache);
+        cache->version = DISPLAY_CACHE_VERSION;
+        cache->connector = conn->connector_id;
+        cache->edid_hash = edid_hash;
+        if (options->stereo_layout)
+                strncpy(cache->stereo_layout,
+                        options->stereo_layout,
+                        sizeof cache->stereo_layout - 1);
+        cache->target_refresh = options->target_refresh;
+        cache->max_pixel_rate = options->max_pixel_rate;
+        cache->mode_policy = options->mode_policy;
+}
+
+/* Checks whether the CRTC is free and can drive the connector. This
+ * only uses the state the kernel already has so it never probes. */
+static int
+crtc_is_usable(drmModeRes *res, drmModeConnector *conn,
+               uint32_t used_crtcs,
+               int fd, uint32_t crtc_id)
+{
+        int crtc_index = get_crtc_index(res, crtc_id);
+        drmModeEncoder *enc;
+        int usable = 0;
+        int i;
+
+        if (crtc_index == -1 || (used_crtcs & (1 << crtc_index)))
+                return 0;
+
+        for (i = 0; i < conn->count_encoders && !usable; i++) {
+                enc = drmModeGetEncoder(fd, conn->encoders[i]);
+                if (enc == NULL)
+                        continue;
+                usable = (enc->possible_crtcs & (1 << crtc_index)) != 0;
+                drmModeFreeEncoder(enc);
+        }
+
+        return usable;
+}
+
+/* Fills in the CRTC and mode from the cache if it is still valid */
+static int
+load_display_cache(drmModeRes *res, drmModeConnector *conn,
+                   const struct gbm_options *options,
+                   uint32_t used_crtcs,
+                   struct gbm_dev *dev)
+{
+        struct display_cache cache, expected;
+        uint64_t edid_hash;
+        char *path;
+        FILE *file;
+        size_t got;
+        int i;
+
+        path = get_display_cache_path(options, conn->connector_id);
+        if (path == NULL)
+                return -ENOENT;
+
+        file = fopen(path, "rb");
+        free(path);
+        if (file == NULL)
+                return -ENOENT;
+
+        got = fread(&cache, 1, sizeof cache, file);
+        fclose(file);
+        if (got != sizeof cache)
+                return -ENOENT;
+
+        /* Without an EDID there is no cheap way to tell whether the
+         * same display is still plugged in */
+        edid_hash = get_edid_hash(dev->fd, conn->connector_id);
+        if (edid_hash == 0)
+                return -ENOENT;
+
+        init_display_cache(&expected, conn, options, edid_hash);
+
+        if (cache.version != expected.version ||
+            cache.connector != expected.connector ||
+            cache.edid_hash != expected.edid_hash ||
+            memcmp(cache.stereo_layout,
+                   expected.stereo_layout,
+                   sizeof cache.stereo_layout) ||
+            cache.target_refresh != expected.target_refresh ||
+            cache.max_pixel_rate != expected.max_pixel_rate ||
+            cache.mode_policy != expected.mode_policy ||
+            !crtc_is_usable(res, conn, used_crtcs, dev->fd, cache.crtc))
+                return -ENOENT;
+
+        for (i = 0; i < conn->count_modes; i++) {
+                if (!memcmp(conn->modes + i, &cache.mode, sizeof cache.mode)) {
+                        dev->crtc = cache.crtc;
+                        dev->mode = cache.mode;
+                        return 0;
+                }
+        }
+
+        return -ENOENT;
+}
+
+static void
+save_display_cache(drmModeConnector *conn,
+                   const struct gbm_options *options,
+                   const struct gbm_dev *dev)
+{
+        struct display_cache cache;
+        uint64_t edid_hash;
+        char *path;
+
+        edid_hash = get_edid_hash(dev->fd, conn->connector_id);
+        if (edid_hash == 0)
+                return;
+
+        path = get_display_cache_path(options, conn->connector_id);
+        if (path == NULL)
+                return;
+
+        init_display_cache(&cache, conn, options, edid_hash);
+        cache.crtc = dev->crtc;
+        cache.mode = dev->mode;
+
+        write_file(path, &cache, sizeof cache);
+
+        free(path);
+}
+
+static int
+stereo_setup_dev(drmModeRes *res, drmModeConnector *conn,
+                 const struct gbm_options *options,
+                 uint32_t used_crtcs,
+                 const uint32_t *used_planes,
+                 int n_used_planes,
+                 struct gbm_dev *dev)
+{
+        int cached;
+        int ret;
+
+        /* check if a monitor is connected */
+        if (conn->connection != DRM_MODE_CONNECTED) {
+                fprintf(stderr, "ignoring unused connector %u\n",
+                        conn->connector_id);
+                return -ENOENT;
+        }
+
+        /* The cached configuration skips searching for a CRTC and
+         * testing each of the modes. Probing needs all of the
+         * modes that pass the test. */
+        cached = (!options->ignore_display_cache &&
+                  !options->probe_modes &&
+                  load_display_cache(res, conn, options, used_crtcs, dev) == 0);
+
+        /* find a crtc for this connector */
+        if (!cached) {
+                ret = stereo_find_crtc(res, conn, used_crtcs, dev);
+                if (ret) {
+                        fprintf(stderr, "no valid crtc for connector %u\n",
+                                conn->connector_id);
+                        return ret;
+                }
+        }
+
+        if (dev->atomic &&
+            init_atomic(res, used_planes, n_used_planes, dev)) {
+                fprintf(stderr,
+                        "falling back to legacy modesetting\n");
+                dev->atomic = 0;
+        }
+
+        if (cached) {
+                fprintf(stderr, "using cached configuration for connector %u\n",
+                        conn->connector_id);
+        } else {
+                ret = find_mode(dev, conn, options);
+                if (ret) {
+                        fprintf(stderr, "no valid mode for connector %u\n",
+                                conn->connector_id);
+                        return ret;
+                }
+
+                /* The probe can change the mode later on */
+                if (!options->probe_modes)
+                        save_display_cache(conn, options, dev);
+        }
+
+        /* copy the mode information into our device structure */
+        dev->width = dev->mode.hdisplay;
+        dev->height = dev->mode.vdisplay;
+        fprintf(stderr, "mode for connector %u is %ux%u (%s)\n",
+                conn->connector_id,
+                dev->width, dev->height,
+                get_stereo_mode_name(dev->mode.flags & DRM_MODE_FLAG_3D_MASK));
+
+        if (dev->atomic &&
+            drmModeCreatePropertyBlob(dev->fd,
+                                      &dev->mode,
+                                      sizeof dev->mode,
+                                      &dev->mode_blob_id)) {
+                fprintf(stderr,
+                        "error creating mode blob, falling back to legacy "
+                        "modesetting: %m\n");
+                dev->atomic = 0;
+        }
+
+        return 0;
+}
+
+static int
+stereo_open(int *out, const struct gbm_options *options)
+{
+        const char *card = options->card;
+        int fd, ret;
+
+        if (card == NULL)
+                card = "/dev/dri/card0";
+
+        if (options->lease_fd >= 0) {
+                /* A lessee only sees the objects in its lease so
+                 * the rest of the setup works the same as with a
+                 * whole card */
+                fd = options->lease_fd;
+                if (drmGetNodeTypeFromFd(fd) != DRM_NODE_PRIMARY) {
+                        fprintf(stderr,
+                                "fd %i is not a leased DRM device\n",
+                                fd);
+                        close(fd);
+                        return -EINVAL;
+                }
+        } else {
+                fd = open(card, O_RDWR | O_CLOEXEC);
+                if (fd < 0) {
+                        ret = -errno;
+                        fprintf(stderr, "cannot open '%s': %m\n", card);
+                        return ret;
+                }
+        }
+
+        if (drmSetClientCap(fd, DRM_CLIENT_CAP_STEREO_3D, 1)) {
+                fprintf(stderr, "error setting stereo client cap: %m\n");
+                close(fd);
+                return -errno;
+        }
+
+        *out = fd;
+        return 0;
+}
+
+static drmModeConnector *
+get_connector(int fd,
+              drmModeRes *res,
+              uint32_t connector_id,
+              const struct gbm_options *options)
+{
+        int all = options->connectors && !strcmp(options->connectors, "all");
+        drmModeConnector *conn;
+        int i;
+
+        for (i = 0; i < res->count_connectors; i++) {
+                if (res->connectors[i] != connector_id)
+                        continue;
+
+                /* Getting the connector normally probes it, which can
+                 * mean reading the EDID over DDC. The state from the
+                 * last probe is used instead if it is known. A
+                 * connector that was asked for by id is probed again
+                 * if it has no modes, but with "all" the empty ports
+                 * are just skipped. */
+                conn = drmModeGetConnectorCurrent(fd, res->connectors[i]);
+                if (conn &&
+                    (conn->connection == DRM_MODE_UNKNOWNCONNECTION ||
+                     (!all && conn->count_modes == 0))) {
+                        drmModeFreeConnector(conn);
+                        conn = NULL;
+                }
+
+                if (conn == NULL)
+                        conn = drmModeGetConnector(fd, res->connectors[i]);
+
+                if (conn == NULL)
+                        fprintf(stderr,
+                                "cannot retrieve DRM connector "
+                                "%u:%u (%d): %m\n",
+                                i, res->connectors[i], errno);
+
+                return conn;
+        }
+
+        fprintf(stderr,
+                "couldn't find connector with id %u\n",
+                connector_id);
+
+        return NULL;
+}
+
+/* Fills in the ids of the connectors to use from the -c option.
+ * Returns the number of connectors or -EINVAL. */
+static int
+get_connector_ids(drmModeRes *res,
+                  const struct gbm_options *options,
+                  uint32_t *ids)
+{
+        const char *p = options->connectors;
+        char *end;
+        int n_ids = 0;
+        int i;
+
+        if (p == NULL) {
+                if (res->count_connectors < 1)
+                        return -EINVAL;
+                ids[0] = res->connectors[0];
+                return 1;
+        }
+
+        if (!strcmp(p, "all")) {
+                for (i = 0; i < res->count_connectors && i < MAX_OUTPUTS; i++)
+                        ids[i] = res->connectors[i];
+                return i;
+        }
+
+        while (*p) {
+                if (n_ids >= MAX_OUTPUTS) {
+                        fprintf(stderr,
+                                "at most %i connectors can be used\n",
+                                MAX_OUTPUTS);
+                        return -EINVAL;
+                }
+
+                ids[n_ids++] = strtoul(p, &end, 10);
+                if (end == p || (*end != ',' && *end != '\0')) {
+                        fprintf(stderr,
+                                "invalid connector list \"%s\"\n",
+                                options->connectors);
+                        return -EINVAL;
+                }
+
+                p = *end ? end + 1 : end;
+        }
+
+        return n_ids;
+}
+
+static struct gbm_dev *
+stereo_prepare_dev(int fd, drmModeRes *res,
+                   uint32_t connector_id,
+                   const struct gbm_options *options,
+                   uint32_t used_crtcs,
+                   const uint32_t *used_planes,
+                   int n_used_planes)
+{
+        drmModeConnector *conn;
+        struct gbm_dev *dev;
+        uint64_t cap;
+        int ret;
+
+        conn = get_connector(fd, res, connector_id, options);
+        if (!conn)
+                goto error;
+
+        /* create a device structure */
+        dev = xmalloc(sizeof(*dev));
+        memset(dev, 0, sizeof(*dev));
+        dev->conn = conn->connector_id;
+        dev->fd = fd;
+
+        if (drmGetCap(fd, DRM_CAP_ADDFB2_MODIFIERS, &cap) == 0 && cap)
+                dev->addfb_modifiers = 1;
+
+        /* The atomic API is used whenever the driver supports it.
+         * Setting the cap also enables universal planes. */
+        if (!options->disable_atomic &&
+            drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0)
+                dev->atomic = 1;
+
+        /* call helper function to prepare this connector */
+        ret = stereo_setup_dev(res,
+                               conn,
+                               options,
+                               used_crtcs,
+                               used_planes,
+                               n_used_planes,
+                               dev);
+        if (ret) {
+                if (ret != -ENOENT) {
+                        errno = -ret;
+                        fprintf(stderr,
+                                "cannot setup device for connector "
+                                "%u (%d): %m\n",
+                                connector_id, errno);
+                }
+                goto error_dev;
+        }
+
+        drmModeFreeConnector(conn);
+
+        return dev;
+
+error_dev:
+        free(dev);
+        drmModeFreeConnector(conn);
+error:
+        return NULL;
+}
+
+static void
+restore_saved_crtc(struct gbm_dev *dev)
+{
+        /* restore saved CRTC configuration */
+        if (dev->saved_crtc) {
+                drmModeSetCrtc(dev->fd,
+                               dev->saved_crtc->crtc_id,
+                               dev->saved_crtc->buffer_id,
+                               dev->saved_crtc->x,
+                               dev->saved_crtc->y,
+                               &dev->conn,
+                               1,
+                               &dev->saved_crtc->mode);
+                drmModeFreeCrtc(dev->saved_crtc);
+
+                dev->saved_crtc = NULL;
+        }
+}
+
+static void
+stereo_cleanup_dev(struct gbm_dev *dev)
+{
+        restore_saved_crtc(dev);
+
+        if (dev->mode_blob_id)
+                drmModeDestroyPropertyBlob(dev->fd, dev->mode_blob_id);
+
+        /* free allocated memory */
+        free(dev->candidate_modes);
+        free(dev->modifiers);
+        free(dev);
+}
+
+static void
+release_bo(struct gbm_output *output, struct gbm_bo **bo)
+{
+        if (*bo) {
+                gbm_surface_release_buffer(output->gbm_surface, *bo);
+                *bo = NULL;
+        }
+}
+
+static int
+create_gbm_surface(struct gbm_output *output)
+{
+        uint32_t flags = GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING;
+        const drmModeModeInfo *drm_mode = &output->dev->mode;
+        struct gbm_bo_mode mode;
+
+        /* The render device can't know which tiling the display
+         * understands so shared buffers are always linear */
+        if (output->context->prime)
+                flags = GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR;
+
+        switch ((drm_mode->flags & DRM_MODE_FLAG_3D_MASK)) {
+        case DRM_MODE_FLAG_3D_NONE:
+                mode.layout = GBM_BO_STEREO_LAYOUT_SIDE_BY_SIDE_HALF;
+                break;
+        case DRM_MODE_FLAG_3D_FRAME_PACKING:
+                mode.layout = GBM_BO_STEREO_LAYOUT_FRAME_PACKING;
+                break;
+        case DRM_MODE_FLAG_3D_LINE_ALTERNATIVE:
+                mode.layout = GBM_BO_STEREO_LAYOUT_LINE_ALTERNATIVE;
+                break;
+        case DRM_MODE_FLAG_3D_SIDE_BY_SIDE_FULL:
+                mode.layout = GBM_BO_STEREO_LAYOUT_SIDE_BY_SIDE_FULL;
+                break;
+        case DRM_MODE_FLAG_3D_TOP_AND_BOTTOM:
+                mode.layout = GBM_BO_STEREO_LAYOUT_TOP_AND_BOTTOM;
+                break;
+        case DRM_MODE_FLAG_3D_SIDE_BY_SIDE_HALF:
+                mode.layout = GBM_BO_STEREO_LAYOUT_SIDE_BY_SIDE_HALF;
+                break;
+        default:
+                fprintf(stderr,
+                        "unknown DRM mode layout 0x%x\n",
+                        (drm_mode->flags & DRM_MODE_FLAG_3D_MASK));
+                return -ENOENT;
+        }
+
+        mode.hdisplay = drm_mode->hdisplay;
+        mode.hsync_start = drm_mode->hsync_start;
+        mode.hsync_end = drm_mode->hsync_end;
+        mode.htotal = drm_mode->htotal;
+        mode.vdisplay = drm_mode->vdisplay;
+        mode.vsync_start = drm_mode->vsync_start;
+        mode.vsync_end = drm_mode->vsync_end;
+        mode.vtotal = drm_mode->vtotal;
+        mode.format = GBM_BO_FORMAT_XRGB8888;
+
+        output->gbm_surface =
+                gbm_surface_create_with_mode(output->context->gbm,
+                                             &mode,
+                                             flags);
+
+        if (output->gbm_surface == NULL) {
+                fprintf(stderr, "error creating GBM surface\n");
+                return -ENOENT;
+        }
+
+        return 0;
+}
+
+static int
+choose_egl_config(struct gbm_context *context)
+{
+        static const EGLint attribs[] = {
+                EGL_RED_SIZE, 1,
+                EGL_GREEN_SIZE, 1,
+                EGL_BLUE_SIZE, 1,
+                EGL_ALPHA_SIZE, EGL_DONT_CARE,
+                EGL_DEPTH_SIZE, 1,
+                EGL_BUFFER_SIZE, EGL_DONT_CARE,
+                EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+                EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+                EGL_NONE
+        };
+        EGLBoolean status;
+        EGLint config_count;
+
+        status = eglChooseConfig(context->edpy,
+                                 attribs,
+                                 &context->egl_config, 1,
+                                 &config_count);
+        if (status != EGL_TRUE || config_count < 1) {
+                fprintf(stderr, "Unable to find a usable EGL configuration\n");
+                return -ENOENT;
+        }
+
+        return 0;
+}
+
+static int
+create_egl_surface(struct gbm_output *output,
+                   const struct gbm_options *options)
+{
+        static const EGLint attribs_3d[] = {
+                EGL_MULTIVIEW_VIEW_COUNT_EXT, 2,
+                EGL_NONE
+        };
+        struct gbm_context *context = output->context;
+
+        output->egl_surface =
+                eglCreateWindowSurface(context->edpy,
+                                       context->egl_config,
+                                       (NativeWindowType) output->gbm_surface,
+                                       attribs_3d);
+        if (output->egl_surface == EGL_NO_SURFACE) {
+                fprintf(stderr, "Failed to create EGL surface\n");
+                return -ENOENT;
+        }
+
+        return 0;
+}
+
+static int
+create_egl_context(struct gbm_context *context)
+{
+        static const EGLint attribs[] = {
+                EGL_CONTEXT_CLIENT_VERSION, 2,
+                EGL_NONE
+        };
+
+        context->egl_context = eglCreateContext(context->edpy,
+                                                context->egl_config,
+                                                EGL_NO_CONTEXT,
+                                                attribs);
+        if (context->egl_context == EGL_NO_CONTEXT) {
+                fprintf(stderr, "Error creating EGL context\n");
+                return -ENOENT;
+        }
+
+        return 0;
+}
+
+static int
+extension_supported(EGLDisplay edpy, const char *ext)
+{
+        const char *exts = eglQueryString(edpy, EGL_EXTENSIONS);
+
+        return extension_in_list(ext, exts);
+}
+
+static void
+init_fence_procs(struct gbm_context *context)
+{
+        if (!extension_supported(context->edpy, NATIVE_FENCE_EXTENSION))
+                return;
+
+        context->create_sync =
+                (void *) eglGetProcAddress("eglCreateSyncKHR");
+        context->destroy_sync =
+                (void *) eglGetProcAddress("eglDestroySyncKHR");
+        context->dup_native_fence_fd =
+                (void *) eglGetProcAddress("eglDupNativeFenceFDANDROID");
+
+        if (!context->create_sync ||
+            !context->destroy_sync ||
+            !context->dup_native_fence_fd)
+                context->dup_native_fence_fd = NULL;
+}
+
+static struct gbm_context *
+stereo_prepare_context(int fd, int prime)
+{
+        struct gbm_context *context;
+
+        context = xmalloc(sizeof(*context));
+        memset(context, 0, sizeof(*context));
+        context->prime = prime;
+
+        context->gbm = gbm_create_device(fd);
+        if (context->gbm == NULL) {
+                fprintf(stderr, "error creating GBM device\n");
+                goto error;
+        }
+
+        context->edpy = eglGetDisplay((EGLNativeDisplayType) context->gbm);
+        if (context->edpy == EGL_NO_DISPLAY) {
+                fprintf(stderr, "error getting EGL display\n");
+                goto error_gbm_device;
+        }
+
+        if (!eglInitialize(context->edpy, NULL, NULL)) {
+                fprintf(stderr, "error intializing EGL display\n");
+                goto error_gbm_device;
+        }
+
+        if (!extension_supported(context->edpy, MULTIVIEW_WINDOW_EXTENSION)) {
+                fprintf(stderr, MULTIVIEW_WINDOW_EXTENSION " not supported\n");
+                goto error_egl_display;
+        }
+
+        if (choose_egl_config(context))
+                goto error_egl_display;
+
+        if (create_egl_context(context))
+                goto error_egl_display;
+
+        init_fence_procs(context);
+
+        return context;
+
+error_egl_display:
+        eglTerminate(context->edpy);
+error_gbm_device:
+        gbm_device_destroy(context->gbm);
+error:
+        free(context);
+        return NULL;
+}
+
+static void
+stereo_cleanup_context(struct gbm_context *context)
+{
+        eglMakeCurrent(context->edpy,
+                       EGL_NO_SURFACE,
+                       EGL_NO_SURFACE,
+                       EGL_NO_CONTEXT);
+        eglDestroyContext(context->edpy, context->egl_context);
+        eglTerminate(context->edpy);
+        gbm_device_destroy(context->gbm);
+        free(context);
+}
+
+/* Drops the plane's modifiers that EGL can't render to. The rest
+ * are the ones that buffers can be scanned out with directly. */
+static void
+filter_modifiers(struct gbm_context *context, struct gbm_dev *dev)
+{
+        PFNEGLQUERYDMABUFMODIFIERSEXTPROC query_modifiers;
+        EGLuint64KHR *egl_modifiers;
+        EGLBoolean *external_only;
+        EGLint n_egl_modifiers = 0;
+        int n_modifiers = 0;
+        int i, j;
+
+        if (dev->n_modifiers == 0)
+                return;
+
+        if (!extension_supported(context->edpy, MODIFIERS_EXTENSION))
+                goto out;
+
+        query_modifiers = (void *)
+                eglGetProcAddress("eglQueryDmaBufModifiersEXT");
+        if (query_modifiers == NULL ||
+            !query_modifiers(context->edpy,
+                             GBM_FORMAT_XRGB8888,
+                             0, NULL, NULL,
+                             &n_egl_modifiers) ||
+            n_egl_modifiers < 1)
+                goto out;
+
+        egl_modifiers = xmalloc(n_egl_modifiers * sizeof *egl_modifiers);
+        external_only = xmalloc(n_egl_modifiers * sizeof *external_only);
+
+        if (query_modifiers(context->edpy,
+                            GBM_FORMAT_XRGB8888,
+                            n_egl_modifiers,
+                            egl_modifiers,
+                            external_only,
+                            &n_egl_modifiers)) {
+                for (i = 0; i < dev->n_modifiers; i++) {
+                        for (j = 0; j < n_egl_modifiers; j++) {
+                                if (egl_modifiers[j] == dev->modifiers[i] &&
+                                    !external_only[j]) {
+                                        dev->modifiers[n_modifiers++] =
+                                                dev->modifiers[i];
+                                        break;
+                                }
+                        }
+                }
+        }
+
+        free(external_only);
+        free(egl_modifiers);
+
+out:
+        dev->n_modifiers = n_modifiers;
+
+        fprintf(stderr,
+                "connector %u: %i modifiers usable for scanout\n",
+                dev->conn,
+                n_modifiers);
+}
+
+/* Enables async flips if the driver can do them for the way the
+ * output is flipped */
+static void
+init_async_flips(struct gbm_output *output)
+{
+        struct gbm_dev *dev = output->dev;
+        uint64_t cap;
+
+        if (drmGetCap(dev->fd,
+                      (dev->atomic ?
+                       DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP :
+                       DRM_CAP_ASYNC_PAGE_FLIP),
+                      &cap) ||
+            !cap) {
+                fprintf(stderr,
+                        "connector %u: the driver can't flip without "
+                        "waiting for vblank\n",
+                        dev->conn);
+                return;
+        }
+
+        output->async_flips = 1;
+        /* Async commits can only change the framebuffer so the
+         * fence properties can't be used */
+        output->use_fences = 0;
+}
+
+static struct gbm_output *
+stereo_prepare_output(struct gbm_context *context,
+                      struct gbm_dev *dev,
+                      const struct gbm_options *options)
+{
+        struct gbm_output *output;
+
+        output = xmalloc(sizeof(*output));
+        memset(output, 0, sizeof(*output));
+        output->dev = dev;
+        output->context = context;
+        output->out_fence_fd = -1;
+
+        output->refresh_ns = get_mode_refresh_ns(&dev->mode);
+
+        if (create_gbm_surface(output))
+                goto error;
+
+        if (create_egl_surface(output, options))
+                goto error_gbm_surface;
+
+        filter_modifiers(context, dev);
+
+        output->use_fences = (dev->atomic &&
+                              dev->in_fence_prop != 0 &&
+                              dev->out_fence_prop != 0 &&
+                              context->dup_native_fence_fd != NULL);
+
+        if (options->immediate || options->beam_slices > 0)
+                init_async_flips(output);
+
+        return output;
+
+error_gbm_surface:
+        gbm_surface_destroy(output->gbm_surface);
+error:
+        free(output);
+        return NULL;
+}
+
+/* Binds the output's surface to the shared context */
+static int
+make_output_current(struct gbm_output *output)
+{
+        struct gbm_context *context = output->context;
+
+        if (!eglMakeCurrent(context->edpy,
+                            output->egl_surface,
+                            output->egl_surface,
+                            context->egl_context)) {
+                fprintf(stderr, "failed to make EGL context current\n");
+                return -ENOENT;
+        }
+
+        return 0;
+}
+
+static int
+check_multiview(struct gbm_context *context)
+{
+        EGLint multiview_view_count = 0;
+
+        if ((!eglQueryContext(context->edpy,
+                              context->egl_context,
+                              EGL_MULTIVIEW_VIEW_COUNT_EXT,
+                              &multiview_view_count) ||
+             multiview_view_count < 2)) {
+                fprintf(stderr,
+                        "EGL created a multiview surface with only %i %s\n",
+                        multiview_view_count,
+                        multiview_view_count == 1 ? "view" : "views");
+                return -ENOENT;
+        }
+
+        return 0;
+}
+
+static void
+destroy_hud(struct gbm_output *output)
+{
+        struct gbm_hud *hud = output->hud;
+        int i;
+
+        if (hud == NULL)
+                return;
+
+        /* Removing the framebuffers also disables the plane */
+        for (i = 0; i < 2; i++)
+                if (hud->buffers[i].fb_id)
+                        destroy_dumb_fb(output->dev->fd, hud->buffers + i);
+
+        free(hud->eye_pixels);
+        free(hud);
+        output->hud = NULL;
+}
+
+/* Works out where the two copies of the HUD go in the scanout for
+ * the stereo layout of the mode. Returns -ENOSPC if the mode is too
+ * small. */
+static int
+layout_hud(struct gbm_hud *hud, const drmModeModeInfo *mode)
+{
+        uint32_t fb_width, fb_height, eye_width, eye_height;
+
+        get_mode_fb_size(mode, &fb_width, &fb_height);
+
+        hud->eye_width = HUD_COLUMNS * HUD_CHAR_WIDTH + HUD_PADDING * 2;
+        hud->eye_height = HUD_LINES * HUD_CHAR_HEIGHT + HUD_PADDING * 2;
+        hud->row_step = 1;
+
+        if (get_eye_rect(mode,
+                         1, /* eye */
+                         &hud->right_x, &hud->right_y,
+                         &eye_width, &eye_height)) {
+                /* Line alternative interleaves the rows */
+                hud->right_x = 0;
+                hud->right_y = 1;
+                hud->row_step = 2;
+        }
+
+        hud->x = HUD_MARGIN;
+        hud->y = HUD_MARGIN * hud->row_step;
+        hud->width = hud->right_x + hud->eye_width;
+        hud->height = (hud->right_y +
+                       (hud->eye_height - 1) * hud->row_step +
+                       1);
+
+        if (hud->x + hud->width > fb_width ||
+            hud->y + hud->height > fb_height)
+                return -ENOSPC;
+
+        return 0;
+}
+
+/* Gets the planes that are already taken by the outputs. There are
+ * at most MAX_PLANES_PER_OUTPUT for each output. */
+static int
+get_used_planes(struct gbm_winsys *winsys, uint32_t *used_planes)
+{
+        struct gbm_output *output;
+        int n_used_planes = 0;
+        int i;
+
+        for (i = 0; i < winsys->n_outputs; i++) {
+                output = winsys->outputs[i];
+                if (output->dev->plane)
+                        used_planes[n_used_planes++] = output->dev->plane;
+                if (output->hud)
+                        used_planes[n_used_planes++] = output->hud->plane;
+                if (output->direct)
+                        used_planes[n_used_planes++] =
+                                output->direct->overlay;
+        }
+
+        return n_used_planes;
+}
+
+/* Puts a HUD on an overlay plane of the output. The HUD is left out
+ * with a message if there is no suitable plane. */
+static void
+init_hud(struct gbm_winsys *winsys,
+         struct gbm_output *output,
+         drmModeRes *res)
+{
+        struct gbm_dev *dev = output->dev;
+        uint32_t used_planes[MAX_OUTPUTS * MAX_PLANES_PER_OUTPUT];
+        int n_used_planes;
+        struct gbm_hud *hud;
+        int i;
+
+        if (!dev->atomic) {
+                fprintf(stderr, "the HUD needs atomic modesetting\n");
+                return;
+        }
+
+        n_used_planes = get_used_planes(winsys, used_planes);
+
+        hud = xmalloc(sizeof *hud);
+        memset(hud, 0, sizeof *hud);
+        hud->front = -1;
+        hud->in_flight = -1;
+        hud->pending = -1;
+        output->hud = hud;
+
+        hud->plane = find_plane(dev->fd,
+                                get_crtc_index(res, dev->crtc),
+                                DRM_PLANE_TYPE_OVERLAY,
+                                GBM_FORMAT_ARGB8888,
+                                used_planes,
+                                n_used_planes,
+                                hud->plane_props);
+        if (hud->plane == 0) {
+                fprintf(stderr,
+                        "no overlay plane for CRTC %u, disabling the HUD\n",
+                        dev->crtc);
+                goto error;
+        }
+
+        if (layout_hud(hud, &dev->mode)) {
+                fprintf(stderr, "mode is too small for the HUD\n");
+                goto error;
+        }
+
+        for (i = 0; i < 2; i++) {
+                if (create_dumb_fb(dev->fd,
+                                   hud->width,
+                                   hud->height,
+                                   32, /* depth */
+                                   hud->buffers + i) ||
+                    map_dumb_fb(dev->fd, hud->buffers + i)) {
+                        fprintf(stderr, "error creating HUD buffer: %m\n");
+                        goto error;
+                }
+
+                /* Everything outside of the two copies stays
+                 * transparent */
+                memset(hud->buffers[i].map, 0, hud->buffers[i].size);
+        }
+
+        hud->eye_pixels = xmalloc(hud->eye_width *
+                                  hud->eye_height *
+                                  sizeof (uint32_t));
+
+        return;
+
+error:
+        destroy_hud(output);
+}
+
+/* Adds the plane state to show the pending HUD buffer if there is one.
+ * Returns whether anything was added. */
+static int
+add_hud_props(drmModeAtomicReq *req, struct gbm_output *output)
+{
+        struct gbm_hud *hud = output->hud;
+
+        if (hud == NULL || hud->pending == -1)
+                return 0;
+
+        add_plane_state(req,
+                        hud->plane,
+                        hud->plane_props,
+                        output->dev->crtc,
+                        hud->buffers[hud->pending].fb_id,
+                        hud->x, hud->y,
+                        hud->width, hud->height);
+
+        return 1;
+}
+
+static void
+destroy_direct(struct gbm_output *output)
+{
+        struct gbm_direct *direct = output->direct;
+        int i;
+
+        if (direct == NULL)
+                return;
+
+        for (i = 0; i < 2; i++)
+                if (direct->buffers[i].fb_id)
+                        destroy_dumb_fb(output->dev->fd, direct->buffers + i);
+
+        free(direct);
+        output->direct = NULL;
+}
+
+/* Copies an image into a new XRGB8888 buffer of the given size. The
+ * image is scaled with nearest-neighbour sampling if the sizes
+ * differ. */
+static int
+create_image_fb(int fd,
+                const struct stereo_image *image,
+                uint32_t width,
+                uint32_t height,
+                struct dumb_fb *fb)
+{
+        const uint8_t *src_row, *src;
+        uint32_t *dst;
+        uint32_t x, y;
+        int ret;
+
+        ret = create_dumb_fb(fd, width, height, 24 /* depth */, fb);
+        if (ret)
+                return ret;
+
+        ret = map_dumb_fb(fd, fb);
+        if (ret) {
+                destroy_dumb_fb(fd, fb);
+                memset(fb, 0, sizeof *fb);
+                return ret;
+        }
+
+        for (y = 0; y < height; y++) {
+                src_row = (image->pixels +
+                           (uint64_t) y * image->height / height *
+                           image->rowstride);
+                dst = (uint32_t *) ((uint8_t *) fb->map + y * fb->pitch);
+
+                for (x = 0; x < width; x++) {
+                        src = (src_row +
+                               (uint64_t) x * image->width / width *
+                               image->n_channels);
+                        dst[x] = ((uint32_t) src[0] << 16 |
+                                  (uint32_t) src[1] << 8 |
+                                  src[2]);
+                }
+        }
+
+        return 0;
+}
+
+/* Creates the buffers for the two eyes. They are the size of the
+ * images unless prescale is set, in which case the images are scaled
+ * to the eye rectangles so that the planes don't have to scale. */
+static int
+create_direct_buffers(struct gbm_output *output,
+                      const struct stereo_image *images,
+                      int prescale)
+{
+        struct gbm_dev *dev = output->dev;
+        struct gbm_direct *direct = output->direct;
+        uint32_t width, height;
+        int x, y;
+        int ret, i;
+
+        for (i = 0; i < 2; i++) {
+                if (direct->buffers[i].fb_id) {
+                        destroy_dumb_fb(dev->fd, direct->buffers + i);
+                        memset(direct->buffers + i, 0, sizeof (struct dumb_fb));
+                }
+
+                if (prescale) {
+                        get_eye_rect(&dev->mode, i, &x, &y, &width, &height);
+                } else {
+                        width = images[i].width;
+                        height = images[i].height;
+                }
+
+                ret = create_image_fb(dev->fd,
+                                      images + i,
+                                      width, height,
+                                      direct->buffers + i);
+                if (ret)
+                        return ret;
+        }
+
+        return 0;
+}
+
+/* Commits a modeset that shows the left eye's buffer on the primary
+ * plane and the right eye's on the overlay, each scaled to its eye
+ * rectangle */
+static int
+commit_direct(struct gbm_output *output, uint32_t flags)
+{
+        struct gbm_dev *dev = output->dev;
+        struct gbm_direct *direct = output->direct;
+        drmModeAtomicReq *req = drmModeAtomicAlloc();
+        uint32_t width, height;
+        int x, y;
+        int ret, i;
+
+        drmModeAtomicAddProperty(req, dev->conn,
+                                 dev->conn_props[CONN_PROP_CRTC_ID],
+                                 dev->crtc);
+        drmModeAtomicAddProperty(req, dev->crtc,
+                                 dev->crtc_props[CRTC_PROP_MODE_ID],
+                                 dev->mode_blob_id);
+        drmModeAtomicAddProperty(req, dev->crtc,
+                                 dev->crtc_props[CRTC_PROP_ACTIVE],
+                                 1);
+
+        for (i = 0; i < 2; i++) {
+                get_eye_rect(&dev->mode, i, &x, &y, &width, &height);
+                add_scaled_plane_state(req,
+                                       i ? direct->overlay : dev->plane,
+                                       (i ?
+                                        direct->overlay_props :
+                                        dev->plane_props),
+                                       dev->crtc,
+                                       direct->buffers[i].fb_id,
+                                       direct->buffers[i].width,
+                                       direct->buffers[i].height,
+                                       x, y,
+                                       width, height);
+        }
+
+        ret = drmModeAtomicCommit(dev->fd,
+                                  req,
+                                  flags | DRM_MODE_ATOMIC_ALLOW_MODESET,
+                                  NULL);
+
+        drmModeAtomicFree(req);
+
+        return ret ? -errno : 0;
+}
+
+/* Sets up the output to show the images on planes and checks with a
+ * test-only commit that the driver accepts it. Scaling on the planes
+ * is tried first, then images that were scaled on the CPU. */
+static int
+prepare_direct(struct gbm_winsys *winsys,
+               struct gbm_output *output,
+               const struct stereo_image *images,
+               drmModeRes *res)
+{
+        struct gbm_dev *dev = output->dev;
+        uint32_t used_planes[MAX_OUTPUTS * MAX_PLANES_PER_OUTPUT];
+        struct gbm_direct *direct;
+        uint32_t width, height;
+        int n_used_planes;
+        int x, y;
+        int prescale;
+        int ret;
+
+        if (!dev->atomic) {
+                fprintf(stderr, "direct scanout needs atomic modesetting\n");
+                return -ENOTSUP;
+        }
+
+        if (get_eye_rect(&dev->mode, 0, &x, &y, &width, &height)) {
+                fprintf(stderr,
+                        "direct scanout can't be used with the %s layout\n",
+                        get_stereo_mode_name(dev->mode.flags &
+                                             DRM_MODE_FLAG_3D_MASK));
+                return -ENOTSUP;
+        }
+
+        n_used_planes = get_used_planes(winsys, used_planes);
+
+        direct = xmalloc(sizeof *direct);
+        memset(direct, 0, sizeof *direct);
+        output->direct = direct;
+
+        direct->overlay = find_plane(dev->fd,
+                                     get_crtc_index(res, dev->crtc),
+                                     DRM_PLANE_TYPE_OVERLAY,
+                                     GBM_FORMAT_XRGB8888,
+                                     used_planes,
+                                     n_used_planes,
+                                     direct->overlay_props);
+        if (direct->overlay == 0) {
+                fprintf(stderr,
+                        "no overlay plane for the right eye on CRTC %u\n",
+                        dev->crtc);
+                ret = -ENOENT;
+                goto error;
+        }
+
+        for (prescale = 0; prescale < 2; prescale++) {
+                ret = create_direct_buffers(output, images, prescale);
+                if (ret) {
+                        errno = -ret;
+                        fprintf(stderr, "error creating scanout buffer: %m\n");
+                        goto error;
+                }
+
+                ret = commit_direct(output, DRM_MODE_ATOMIC_TEST_ONLY);
+                if (ret == 0)
+                        return 0;
+        }
+
+        fprintf(stderr,
+                "direct scanout rejected by atomic test on CRTC %u\n",
+                dev->crtc);
+
+error:
+        destroy_direct(output);
+        return ret;
+}
+
+/* Shows the renderer's static images on planes instead of drawing
+ * them, if every output can do it. Returns 0 if nothing needs to be
+ * drawn. */
+static int
+start_direct_scanout(struct gbm_winsys *winsys)
+{
+        struct stereo_image images[2];
+        struct gbm_dev *dev;
+        drmModeRes *res;
+        int ret = 0, i;
+
+        if (winsys->callbacks->get_static_images == NULL ||
+            winsys->callbacks->get_static_images(winsys->cb_data, images)) {
+                fprintf(stderr,
+                        "the renderer has no static images to scan out\n");
+                return -ENOENT;
+        }
+
+        res = drmModeGetResources(winsys->fd);
+        if (!res) {
+                fprintf(stderr, "cannot retrieve DRM resources (%d): %m\n",
+                        errno);
+                return -ENOENT;
+        }
+
+        /* Everything is tested before anything is committed so that
+         * an output can't be left half way between the two paths */
+        for (i = 0; i < winsys->n_outputs && ret == 0; i++)
+                ret = prepare_direct(winsys, winsys->outputs[i], images, res);
+
+        drmModeFreeResources(res);
+
+        for (i = 0; i < winsys->n_outputs && ret == 0; i++) {
+                dev = winsys->outputs[i]->dev;
+                dev->saved_crtc = drmModeGetCrtc(dev->fd, dev->crtc);
+
+                ret = commit_direct(winsys->outputs[i], 0 /* flags */);
+                if (ret) {
+                        errno = -ret;
+                        fprintf(stderr,
+                                "error committing direct scanout: %m\n");
+                }
+        }
+
+        if (ret) {
+                /* The rendering path does its own modeset when it
+                 * finds no saved CRTC */
+                for (i = 0; i < winsys->n_outputs; i++) {
+                        restore_saved_crtc(winsys->outputs[i]->dev);
+                        destroy_direct(winsys->outputs[i]);
+                }
+        }
+
+        return ret;
+}
+
+static void
+destroy_capture(struct gbm_output *output)
+{
+        struct gbm_capture *capture = output->capture;
+
+        if (capture == NULL)
+                return;
+
+        if (capture->n_captures > 0)
+                printf("connector %u: %i writeback captures, "
+                       "%" PRIu64 " us on average\n",
+                       output->dev->conn,
+                       capture->n_captures,
+                       capture->total_time / capture->n_captures / 1000);
+
+        if (capture->fence_fd != -1)
+                close(capture->fence_fd);
+        if (capture->buffer.fb_id)
+                destroy_dumb_fb(output->dev->fd, &capture->buffer);
+
+        free(capture);
+        output->capture = NULL;
+}
+
+/* Finds a writeback connector that can be used with the CRTC and
+ * fills in its property ids. The connectors in the used list are
+ * skipped. Returns 0 if there isn't one. */
+static uint32_t
+find_writeback_connector(int fd,
+                         drmModeRes *res,
+                         int crtc_index,
+                         const uint32_t *used_connectors,
+                         int n_used_connectors,
+                         uint32_t *props)
+{
+        drmModeConnector *conn;
+        drmModeEncoder *encoder;
+        uint32_t conn_id = 0;
+        int i, j;
+
+        for (i = 0; i < res->count_connectors && conn_id == 0; i++) {
+                for (j = 0; j < n_used_connectors; j++)
+                        if (used_connectors[j] == res->connectors[i])
+                                break;
+                if (j < n_used_connectors)
+                        continue;
+
+                conn = drmModeGetConnectorCurrent(fd, res->connectors[i]);
+                if (conn == NULL)
+                        continue;
+
+                if (conn->connector_type == DRM_MODE_CONNECTOR_WRITEBACK &&
+                    conn->count_encoders > 0) {
+                        encoder = drmModeGetEncoder(fd, conn->encoders[0]);
+                        if (encoder &&
+                            (encoder->possible_crtcs & (1 << crtc_index)) &&
+                            get_prop_ids(fd,
+                                         conn->connector_id,
+                                         DRM_MODE_OBJECT_CONNECTOR,
+                                         writeback_prop_names,
+                                         N_WRITEBACK_PROPS,
+                                         props,
+                                         NULL) == 0)
+                                conn_id = conn->connector_id;
+                        drmModeFreeEncoder(encoder);
+                }
+
+                drmModeFreeConnector(conn);
+        }
+
+        return conn_id;
+}
+
+/* Creates the buffer that the writeback connector writes to. It
+ * covers the whole CRTC. */
+static int
+create_capture_buffer(struct gbm_output *output)
+{
+        struct gbm_capture *capture = output->capture;
+        struct gbm_dev *dev = output->dev;
+        uint32_t width, height;
+
+        get_mode_fb_size(&dev->mode, &width, &height);
+
+        if (create_dumb_fb(dev->fd,
+                           width, height,
+                           24, /* depth */
+                           &capture->buffer) ||
+            map_dumb_fb(dev->fd, &capture->buffer)) {
+                fprintf(stderr, "error creating writeback buffer: %m\n");
+                return -ENOENT;
+        }
+
+        return 0;
+}
+
+/* Sets up a writeback connector and buffer for each output. Outputs
+ * without a usable connector are left out with a message. */
+static void
+init_captures(struct gbm_winsys *winsys)
+{
+        uint32_t used_connectors[MAX_OUTPUTS];
+        int n_used_connectors = 0;
+        struct gbm_capture *capture;
+        struct gbm_output *output;
+        struct gbm_dev *dev;
+        drmModeRes *res;
+        int i;
+
+        /* The writeback connectors are hidden unless the cap is set.
+         * This is done after the outputs are chosen so that they
+         * are never picked as displays. */
+        if (drmSetClientCap(winsys->fd,
+                            DRM_CLIENT_CAP_WRITEBACK_CONNECTORS,
+                            1)) {
+                fprintf(stderr, "the driver doesn't support writeback\n");
+                return;
+        }
+
+        res = drmModeGetResources(winsys->fd);
+        if (!res) {
+                fprintf(stderr, "cannot retrieve DRM resources (%d): %m\n",
+                        errno);
+                return;
+        }
+
+        for (i = 0; i < winsys->n_outputs; i++) {
+                output = winsys->outputs[i];
+                dev = output->dev;
+
+                if (!dev->atomic) {
+                        fprintf(stderr,
+                                "writeback needs atomic modesetting\n");
+                        continue;
+                }
+
+                capture = xmalloc(sizeof *capture);
+                memset(capture, 0, sizeof *capture);
+                capture->interval = winsys->options.capture_interval;
+                capture->fence_fd = -1;
+                output->capture = capture;
+
+                capture->conn =
+                        find_writeback_connector(dev->fd,
+                                                 res,
+                                                 get_crtc_index(res,
+                                                                dev->crtc),
+                                                 used_connectors,
+                                                 n_used_connectors,
+                                                 capture->props);
+                if (capture->conn == 0) {
+                        fprintf(stderr,
+                                "no writeback connector for CRTC %u\n",
+                                dev->crtc);
+                        destroy_capture(output);
+                        continue;
+                }
+
+                if (create_capture_buffer(output)) {
+                        destroy_capture(output);
+                        continue;
+                }
+
+                used_connectors[n_used_connectors++] = capture->conn;
+        }
+
+        drmModeFreeResources(res);
+
+        if (n_used_connectors > 0)
+                winsys->capture_writer = capture_writer_new();
+}
+
+/* Connects the writeback connector to the output's CRTC. This needs
+ * a modeset of its own so it is done once after the first one. The
+ * capture is disabled if the driver rejects it. */
+static void
+attach_capture(struct gbm_output *output)
+{
+        struct gbm_capture *capture = output->capture;
+        struct gbm_dev *dev = output->dev;
+        drmModeAtomicReq *req;
+        int ret;
+
+        if (capture == NULL)
+                return;
+
+        req = drmModeAtomicAlloc();
+        drmModeAtomicAddProperty(req, capture->conn,
+                                 capture->props[WRITEBACK_PROP_CRTC_ID],
+                                 dev->crtc);
+        ret = drmModeAtomicCommit(dev->fd,
+                                  req,
+                                  DRM_MODE_ATOMIC_ALLOW_MODESET,
+                                  NULL);
+        if (ret)
+                ret = -errno;
+        drmModeAtomicFree(req);
+
+        if (ret) {
+                errno = -ret;
+                fprintf(stderr,
+                        "error attaching writeback connector: %m\n");
+                destroy_capture(output);
+        }
+}
+
+/* Adds the writeback buffer to a flip if this one should be
+ * captured. Returns whether anything was added. */
+static int
+add_capture_props(drmModeAtomicReq *req, struct gbm_output *output)
+{
+        struct gbm_capture *capture = output->capture;
+
+        if (capture == NULL)
+                return 0;
+
+        capture->n_flips++;
+
+        if (capture->interval > 0 &&
+            capture->n_flips % capture->interval == 0)
+                capture->requested = 1;
+
+        /* The buffer can't be reused until the last capture is
+         * saved */
+        if (!capture->requested || capture->fence_fd != -1)
+                return 0;
+
+        drmModeAtomicAddProperty(req, capture->conn,
+                                 capture->props[WRITEBACK_PROP_FB_ID],
+                                 capture->buffer.fb_id);
+        drmModeAtomicAddProperty(req, capture->conn,
+                                 capture->props[WRITEBACK_PROP_OUT_FENCE_PTR],
+                                 (uintptr_t) &capture->fence_fd);
+
+        capture->frame = capture->n_flips;
+        capture->start_time = get_time_ns();
+
+        return 1;
+}
+
+/* Hands the finished writeback to the writer thread. The copy is
+ * cheap compared to encoding and writing the file. */
+static void
+capture_done(struct gbm_winsys *winsys, struct gbm_output *output)
+{
+        struct gbm_capture *capture = output->capture;
+        char filename[64];
+
+        close(capture->fence_fd);
+        capture->fence_fd = -1;
+
+        capture->total_time += get_time_ns() - capture->start_time;
+        capture->n_captures++;
+
+        snprintf(filename, sizeof filename,
+                 "capture-%u-%06i.ppm",
+                 output->dev->conn,
+                 capture->frame);
+
+        capture_writer_queue(winsys->capture_writer,
+                             filename,
+                             capture->buffer.map,
+                             capture->buffer.width,
+                             capture->buffer.height,
+                             capture->buffer.pitch);
+}
+
+static int
+get_n_pending_captures(struct gbm_winsys *winsys)
+{
+        int n = 0, i;
+
+        for (i = 0; i < winsys->n_outputs; i++)
+                n += (winsys->outputs[i]->capture &&
+                      winsys->outputs[i]->capture->fence_fd != -1);
+
+        return n;
+}
+
+static void
+destroy_beam(struct gbm_output *output)
+{
+        if (output->beam == NULL)
+                return;
+
+        free(output->beam->rows);
+        free(output->beam);
+        output->beam = NULL;
+}
+
+/* Sets up beam racing with n_slices slices for each eye. When the
+ * eyes are stacked they are sliced separately so that no slice spans
+ * both of them. */
+static int
+init_beam(struct gbm_output *output, drmModeRes *res, int n_slices)
+{
+        struct gbm_dev *dev = output->dev;
+        const drmModeModeInfo *mode = &dev->mode;
+        struct gbm_beam *beam;
+        uint32_t fb_width, fb_height, eye_width, eye_height;
+        int eye_x, eye_y;
+        int n_eyes = 1;
+        int crtc_index;
+        int eye, i;
+
+        if (!output->async_flips) {
+                fprintf(stderr,
+                        "connector %u: beam racing needs async flips\n",
+                        dev->conn);
+                return -ENOTSUP;
+        }
+
+        if (output->refresh_ns == 0 || mode->vtotal == 0) {
+                fprintf(stderr,
+                        "connector %u: the mode has no timings to race "
+                        "the beam with\n",
+                        dev->conn);
+                return -EINVAL;
+        }
+
+        get_mode_fb_size(mode, &fb_width, &fb_height);
+
+        if (get_eye_rect(mode,
+                         1, /* eye */
+                         &eye_x, &eye_y,
+                         &eye_width, &eye_height) == 0 &&
+            eye_y > 0) {
+                n_eyes = 2;
+        } else {
+                eye_y = 0;
+                eye_height = fb_height;
+        }
+
+        beam = xmalloc(sizeof *beam);
+        memset(beam, 0, sizeof *beam);
+
+        beam->n_slices = n_slices * n_eyes;
+        beam->rows = xmalloc(beam->n_slices * sizeof *beam->rows);
+
+        for (eye = 0; eye < n_eyes; eye++) {
+                for (i = 0; i < n_slices; i++) {
+                        beam->rows[eye * n_slices + i] =
+                                eye * eye_y + i * eye_height / n_slices;
+                }
+        }
+
+        /* Frame packing sends both eyes in one refresh at twice the
+         * pixel clock */
+        beam->frame_lines = mode->vtotal;
+        if ((mode->flags & DRM_MODE_FLAG_3D_MASK) ==
+            DRM_MODE_FLAG_3D_FRAME_PACKING)
+                beam->frame_lines *= 2;
+
+        crtc_index = get_crtc_index(res, dev->crtc);
+        if (crtc_index > 1)
+                beam->vblank_type = ((crtc_index <<
+                                      DRM_VBLANK_HIGH_CRTC_SHIFT) &
+                                     DRM_VBLANK_HIGH_CRTC_MASK);
+        else if (crtc_index == 1)
+                beam->vblank_type = DRM_VBLANK_SECONDARY;
+
+        output->beam = beam;
+
+        return 0;
+}
+
+/* Gets the first row of the rendered views that is still to be
+ * scanned out when the beam is at the given framebuffer row. The
+ * rows above it can be left alone. */
+static uint32_t
+get_beam_view_row(const drmModeModeInfo *mode, uint32_t row)
+{
+        uint32_t eye_width, eye_height;
+        int eye_x, eye_y;
+
+        /* Line alternative interleaves the rows of the eyes */
+        if (get_eye_rect(mode,
+                         1, /* eye */
+                         &eye_x, &eye_y,
+                         &eye_width, &eye_height))
+                return row / 2;
+
+        /* Side by side scans out both eyes on the same rows */
+        if (eye_y == 0)
+                return row;
+
+        /* While the beam is in the left eye all of the right eye is
+         * still to come */
+        if (row < (uint32_t) eye_y)
+                return 0;
+        if (row - eye_y > eye_height)
+                return eye_height;
+
+        return row - eye_y;
+}
+
+/* Gets the framebuffer row that the beam is at during the scanout
+ * being raced. This is 0 before the scanout starts. */
+static uint32_t
+get_beam_row(const struct gbm_beam *beam, uint64_t refresh, uint64_t time)
+{
+        if (time <= beam->scanout_time)
+                return 0;
+
+        return (time - beam->scanout_time) * beam->frame_lines / refresh;
+}
+
+/* Gets when the CRTC last left the vertical blank, in the same clock
+ * as get_time_ns(). This doesn't wait for a vblank. */
+static int
+get_last_scanout_time(struct gbm_output *output, uint64_t *time)
+{
+        drmVBlank vbl;
+
+        memset(&vbl, 0, sizeof vbl);
+        vbl.request.type = (drmVBlankSeqType) (DRM_VBLANK_RELATIVE |
+                                               output->beam->vblank_type);
+        vbl.request.sequence = 0;
+
+        if (drmWaitVBlank(output->dev->fd, &vbl))
+                return -errno;
+
+        *time = (vbl.reply.tval_sec * UINT64_C(1000000000) +
+                 vbl.reply.tval_usec * UINT64_C(1000));
+
+        return 0;
+}
+
+static int
+queue_flip(struct gbm_output *output, struct gbm_frame *frame);
+
+static void
+flip_done(struct gbm_output *output, uint64_t vblank_time)
+{
+        struct gbm_frame next_frame;
+
+        /* A frame is late if it was shown at least one refresh after
+         * the vblank it was rendered for */
+        if (output->flip_present_time) {
+                output->n_frames++;
+                if (vblank_time >= (output->flip_present_time +
+                                    output->refresh_ns / 2))
+                        output->n_missed_frames++;
+        }
+        output->last_vblank = vblank_time;
+
+        if (output->flip_draw_time && vblank_time > output->flip_draw_time) {
+                if (output->n_flips == 0)
+                        output->first_flip_time = vblank_time;
+                output->total_latency += vblank_time - output->flip_draw_time;
+                output->n_flips++;
+        }
+
+        if (output->hud) {
+                output->hud->n_flips++;
+                if (output->hud->in_flight != -1) {
+                        output->hud->front = output->hud->in_flight;
+                        output->hud->in_flight = -1;
+                }
+        }
+
+        /* The previous buffer is no longer being scanned out */
+        release_bo(output, &output->current_bo);
+        output->current_bo = output->flip_bo;
+        output->flip_bo = NULL;
+
+        /* Submit the oldest queued frame. If its flip fails it is
+         * dropped and the next one is tried. */
+        while (output->flip_bo == NULL && output->n_queued_frames > 0) {
+                next_frame = output->queued_frames[0];
+                output->n_queued_frames--;
+                memmove(output->queued_frames,
+                        output->queued_frames + 1,
+                        output->n_queued_frames * sizeof (struct gbm_frame));
+                if (queue_flip(output, &next_frame))
+                        gbm_surface_release_buffer(output->gbm_surface,
+                                                   next_frame.bo);
+        }
+}
+
+static void
+page_flip_handler(int fd,
+                  unsigned int frame,
+                  unsigned int sec,
+                  unsigned int usec,
+                  void *data)
+{
+        struct gbm_output *output = data;
+
+        /* The timestamp of an async flip is the last vblank, which
+         * can be before the flip was even requested */
+        if (output->async_flips)
+                flip_done(output, get_time_ns());
+        else
+                flip_done(output,
+                          sec * UINT64_C(1000000000) + usec * UINT64_C(1000));
+}
+
+/* Handles any DRM events and flip completion fences for all of the
+ * outputs. If timeout is -1 this waits for at least one event unless
+ * it is interrupted by a signal. Returns the result of poll(). */
+static int
+dispatch_events(struct gbm_winsys *winsys, int timeout)
+{
+        struct gbm_output *fence_outputs[MAX_OUTPUTS];
+        struct gbm_output *capture_outputs[MAX_OUTPUTS];
+        struct pollfd pfds[MAX_OUTPUTS * 2 + 2];
+        struct pollfd *timer_pfd = NULL;
+        uint64_t expirations;
+        struct gbm_output *output;
+        drmEventContext evctx;
+        int n_pfds = 1, n_fence_pfds, n_capture_pfds;
+        int ret, i;
+
+        pfds[0].fd = winsys->fd;
+        pfds[0].events = POLLIN;
+        pfds[0].revents = 0;
+
+        for (i = 0; i < winsys->n_outputs; i++) {
+                output = winsys->outputs[i];
+                if (output->out_fence_fd == -1)
+                        continue;
+                fence_outputs[n_pfds - 1] = output;
+                pfds[n_pfds].fd = output->out_fence_fd;
+                pfds[n_pfds].events = POLLIN;
+                pfds[n_pfds].revents = 0;
+                n_pfds++;
+        }
+
+        n_fence_pfds = n_pfds;
+
+        /* A writeback fence signals once the capture is written */
+        for (i = 0; i < winsys->n_outputs; i++) {
+                output = winsys->outputs[i];
+                if (output->capture == NULL ||
+                    output->capture->fence_fd == -1)
+                        continue;
+                capture_outputs[n_pfds - n_fence_pfds] = output;
+                pfds[n_pfds].fd = output->capture->fence_fd;
+                pfds[n_pfds].events = POLLIN;
+                pfds[n_pfds].revents = 0;
+                n_pfds++;
+        }
+
+        n_capture_pfds = n_pfds;
+
+        if (winsys->timer_fd != -1) {
+                timer_pfd = pfds + n_pfds++;
+                timer_pfd->fd = winsys->timer_fd;
+                timer_pfd->events = POLLIN;
+                timer_pfd->revents = 0;
+        }
+
+        ret = poll(pfds, n_pfds, timeout);
+        if (ret <= 0)
+                return ret;
+
+        /* The timer only needs to wake up the main loop */
+        if (timer_pfd && timer_pfd->revents &&
+            read(winsys->timer_fd, &expirations, sizeof expirations) < 0)
+                expirations = 0;
+
+        /* The flip events carry the output as their user data */
+        if (pfds[0].revents) {
+                memset(&evctx, 0, sizeof(evctx));
+                evctx.version = DRM_EVENT_CONTEXT_VERSION;
+                evctx.page_flip_handler = page_flip_handler;
+                drmHandleEvent(winsys->fd, &evctx);
+        }
+
+        /* An out fence signals once its flip has happened. There is
+         * no timestamp so the current time stands in for the
+         * vblank. */
+        for (i = 1; i < n_fence_pfds; i++) {
+                if (!pfds[i].revents)
+                        continue;
+                output = fence_outputs[i - 1];
+                close(output->out_fence_fd);
+                output->out_fence_fd = -1;
+                flip_done(output, get_time_ns());
+        }
+
+        for (i = n_fence_pfds; i < n_capture_pfds; i++)
+                if (pfds[i].revents)
+                        capture_done(winsys,
+                                     capture_outputs[i - n_fence_pfds]);
+
+        return ret;
+}
+
+static int
+get_frames_in_flight(struct gbm_output *output)
+{
+        return (output->flip_bo != NULL) + output->n_queued_frames;
+}
+
+static int
+get_n_pending_flips(struct gbm_winsys *winsys)
+{
+        int n = 0, i;
+
+        for (i = 0; i < winsys->n_outputs; i++)
+                n += winsys->outputs[i]->flip_bo != NULL;
+
+        return n;
+}
+
+static void
+stereo_cleanup_output(struct gbm_output *output)
+{
+        struct gbm_context *context = output->context;
+        int i;
+
+        if (output->n_frames > 0)
+                printf("connector %u: %i of %i frames missed their vblank\n",
+                       output->dev->conn,
+                       output->n_missed_frames,
+                       output->n_frames);
+        if (output->n_flips > 1 &&
+            output->last_vblank > output->first_flip_time)
+                printf("connector %u: %.1f frames per second, "
+                       "%" PRIu64 " us from drawing to flip on average\n",
+                       output->dev->conn,
+                       (output->n_flips - 1) * 1e9 /
+                       (output->last_vblank - output->first_flip_time),
+                       output->total_latency / output->n_flips / 1000);
+        if (output->dev->n_imports > 0)
+                printf("connector %u: imported %i buffers in "
+                       "%" PRIu64 " us\n",
+                       output->dev->conn,
+                       output->dev->n_imports,
+                       output->dev->import_time / 1000);
+        if (output->beam &&
+            output->beam->n_drawn + output->beam->n_skipped > 0)
+                printf("connector %u: %i of %i slices reached the beam "
+                       "too late, %i skipped\n",
+                       output->dev->conn,
+                       output->beam->n_late,
+                       output->beam->n_drawn,
+                       output->beam->n_skipped);
+        if (output->dev->n_copies > 0)
+                printf("connector %u: copied %i frames, "
+                       "%" PRIu64 " us on average\n",
+                       output->dev->conn,
+                       output->dev->n_copies,
+                       (output->dev->copy_time /
+                        output->dev->n_copies /
+                        1000));
+
+        for (i = 0; i < output->n_queued_frames; i++) {
+                release_bo(output, &output->queued_frames[i].bo);
+                if (output->queued_frames[i].fence_fd != -1)
+                        close(output->queued_frames[i].fence_fd);
+        }
+        output->n_queued_frames = 0;
+
+        if (output->out_fence_fd != -1)
+                close(output->out_fence_fd);
+
+        restore_saved_crtc(output->dev);
+        destroy_hud(output);
+        destroy_direct(output);
+        destroy_capture(output);
+        destroy_beam(output);
+        release_bo(output, &output->flip_bo);
+        release_bo(output, &output->current_bo);
+        eglMakeCurrent(context->edpy,
+                       EGL_NO_SURFACE,
+                       EGL_NO_SURFACE,
+                       EGL_NO_CONTEXT);
+        /* A failed probe can leave the output without surfaces */
+        if (output->egl_surface != EGL_NO_SURFACE)
+                eglDestroySurface(context->edpy, output->egl_surface);
+        if (output->gbm_surface)
+                gbm_surface_destroy(output->gbm_surface);
+        stereo_cleanup_dev(output->dev);
+        free(output);
+}
+
+static int
+set_initial_crtc(struct gbm_dev *dev, struct gbm_bo *bo, uint32_t fb_id)
+{
+        int ret;
+
+        dev->saved_crtc = drmModeGetCrtc(dev->fd, dev->crtc);
+
+        if (dev->atomic) {
+                ret = atomic_modeset(dev,
+                                     dev->mode_blob_id,
+                                     fb_id,
+                                     gbm_bo_get_width(bo),
+                                     gbm_bo_get_height(bo),
+                                     0 /* flags */);
+                if (ret == 0)
+                        return 0;
+
+                errno = -ret;
+                fprintf(stderr,
+                        "Atomic modeset failed, falling back to legacy "
+                        "modesetting: %m\n");
+                dev->atomic = 0;
+        }
+
+        if (drmModeSetCrtc(dev->fd,
+                           dev->crtc,
+                           fb_id,
+                           0, 0, /* x/y */
+                           &dev->conn, 1,
+                           &dev->mode)) {
+                fprintf(stderr, "Failed to set drm mode: %m\n");
+                return errno;
+        }
+
+        return 0;
+}
+
+static void
+destroy_fb_callback(struct gbm_bo *bo, void *data)
+{
+        struct gbm_fb *fb = data;
+        struct drm_gem_close gem_close;
+
+        if (fb->copy) {
+                destroy_dumb_fb(fb->fd, fb->copy);
+                free(fb->copy);
+        } else {
+                drmModeRmFB(fb->fd, fb->fb_id);
+        }
+
+        if (fb->handle) {
+                memset(&gem_close, 0, sizeof gem_close);
+                gem_close.handle = fb->handle;
+                drmIoctl(fb->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+        }
+
+        free(fb);
+}
+
+/* Imports a linear buffer from the render device into the display
+ * device. Returns the framebuffer or 0 if the display device can't
+ * use the buffer. */
+static uint32_t
+import_bo(struct gbm_dev *dev, struct gbm_bo *bo, struct gbm_fb *fb)
+{
+        uint64_t start_time = get_time_ns();
+        struct drm_gem_close gem_close;
+        uint32_t fb_id;
+        int prime_fd;
+        int ret;
+
+        prime_fd = gbm_bo_get_fd(bo);
+        if (prime_fd < 0)
+                return 0;
+
+        ret = drmPrimeFDToHandle(dev->fd, prime_fd, &fb->handle);
+        close(prime_fd);
+        if (ret) {
+                fb->handle = 0;
+                return 0;
+        }
+
+        if (drmModeAddFB(dev->fd,
+                         gbm_bo_get_width(bo),
+                         gbm_bo_get_height(bo),
+                         24, /* depth */
+                         32, /* bpp */
+                         gbm_bo_get_stride(bo),
+                         fb->handle,
+                         &fb_id)) {
+                memset(&gem_close, 0, sizeof gem_close);
+                gem_close.handle = fb->handle;
+                drmIoctl(dev->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+                fb->handle = 0;
+                return 0;
+        }
+
+        dev->import_time += get_time_ns() - start_time;
+        dev->n_imports++;
+
+        return fb_id;
+}
+
+/* Copies the rendered contents of the buffer to its copy on the
+ * display device. Mapping the buffer waits for the rendering. */
+static int
+copy_bo(struct gbm_dev *dev, struct gbm_bo *bo, struct gbm_fb *fb)
+{
+        uint64_t start_time = get_time_ns();
+        uint32_t width = gbm_bo_get_width(bo);
+        uint32_t height = gbm_bo_get_height(bo);
+        void *map_data = NULL;
+        uint32_t stride;
+        uint8_t *src;
+        uint32_t y;
+
+        src = gbm_bo_map(bo,
+                         0, 0, /* x/y */
+                         width, height,
+                         GBM_BO_TRANSFER_READ,
+                         &stride,
+                         &map_data);
+        if (src == NULL) {
+                fprintf(stderr, "error mapping rendered buffer\n");
+                return -ENOENT;
+        }
+
+        for (y = 0; y < height; y++)
+                memcpy((uint8_t *) fb->copy->map + y * fb->copy->pitch,
+                       src + y * stride,
+                       width * sizeof (uint32_t));
+
+        gbm_bo_unmap(bo, map_data);
+
+        dev->copy_time += get_time_ns() - start_time;
+        dev->n_copies++;
+
+        return 0;
+}
+
+/* Creates a framebuffer on the display device for a buffer from a
+ * separate render device. The buffer is shared directly if the
+ * display device can import it, otherwise it is copied to a dumb
+ * buffer for every frame. */
+static uint32_t
+add_prime_fb(struct gbm_dev *dev, struct gbm_bo *bo, struct gbm_fb *fb)
+{
+        uint32_t fb_id;
+
+        fb_id = import_bo(dev, bo, fb);
+        if (fb_id)
+                return fb_id;
+
+        if (dev->n_copies == 0)
+                fprintf(stderr,
+                        "connector %u: can't import rendered buffers, "
+                        "copying them instead\n",
+                        dev->conn);
+
+        fb->copy = xmalloc(sizeof *fb->copy);
+
+        if (create_dumb_fb(dev->fd,
+                           gbm_bo_get_width(bo),
+                           gbm_bo_get_height(bo),
+                           24, /* depth */
+                           fb->copy)) {
+                fprintf(stderr, "error creating copy buffer: %m\n");
+                free(fb->copy);
+                fb->copy = NULL;
+                return 0;
+        }
+
+        if (map_dumb_fb(dev->fd, fb->copy)) {
+                fprintf(stderr, "error mapping copy buffer: %m\n");
+                destroy_dumb_fb(dev->fd, fb->copy);
+                free(fb->copy);
+                fb->copy = NULL;
+                return 0;
+        }
+
+        return fb->copy->fb_id;
+}
+
+/* Creates a framebuffer with the buffer's explicit modifier if the
+ * plane and EGL both support it. Returns 0 on failure so that the
+ * caller can fall back to an implicit layout. */
+static uint32_t
+add_fb_with_modifier(struct gbm_dev *dev, struct gbm_bo *bo)
+{
+        uint32_t handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
+        uint64_t modifiers[4] = { 0 };
+        uint64_t modifier = gbm_bo_get_modifier(bo);
+        uint32_t fb_id;
+        int n_planes;
+        int i;
+
+        if (!dev->addfb_modifiers || modifier == DRM_FORMAT_MOD_INVALID)
+                return 0;
+
+        for (i = 0; i < dev->n_modifiers; i++)
+                if (dev->modifiers[i] == modifier)
+                        break;
+        if (i >= dev->n_modifiers)
+                return 0;
+
+        n_planes = gbm_bo_get_plane_count(bo);
+        if (n_planes < 1 || n_planes > 4)
+                return 0;
+
+        for (i = 0; i < n_planes; i++) {
+                handles[i] = gbm_bo_get_handle_for_plane(bo, i).u32;
+                pitches[i] = gbm_bo_get_stride_for_plane(bo, i);
+                offsets[i] = gbm_bo_get_offset(bo, i);
+                modifiers[i] = modifier;
+        }
+
+        if (drmModeAddFB2WithModifiers(dev->fd,
+                                       gbm_bo_get_width(bo),
+                                       gbm_bo_get_height(bo),
+                                       GBM_FORMAT_XRGB8888,
+                                       handles,
+                                       pitches,
+                                       offsets,
+                                       modifiers,
+                                       &fb_id,
+                                       DRM_MODE_FB_MODIFIERS))
+                return 0;
+
+        if (!dev->reported_modifier) {
+                fprintf(stderr,
+                        "connector %u: scanning out with modifier "
+                        "0x%016" PRIx64 "%s\n",
+                        dev->conn,
+                        modifier,
+                        modifier == DRM_FORMAT_MOD_LINEAR ? " (linear)" : "");
+                dev->reported_modifier = 1;
+        }
+
+        return fb_id;
+}
+
+/* Gets the framebuffer for a buffer of the GBM surface, creating it
+ * the first time. If the buffer is shared by copying, this also
+ * copies its current contents. Returns 0 on failure. */
+static uint32_t
+get_fb_for_bo(struct gbm_output *output, struct gbm_bo *bo)
+{
+        struct gbm_dev *dev = output->dev;
+        struct gbm_fb *fb = gbm_bo_get_user_data(bo);
+        uint32_t fb_id;
+
+        if (fb) {
+                if (fb->copy && copy_bo(dev, bo, fb))
+                        return 0;
+                return fb->fb_id;
+        }
+
+        if (output->context->prime) {
+                fb = xmalloc(sizeof *fb);
+                memset(fb, 0, sizeof *fb);
+                fb->fd = dev->fd;
+
+                fb->fb_id = add_prime_fb(dev, bo, fb);
+                if (fb->fb_id == 0) {
+                        free(fb);
+                        return 0;
+                }
+
+                gbm_bo_set_user_data(bo, fb, destroy_fb_callback);
+
+                if (fb->copy && copy_bo(dev, bo, fb))
+                        return 0;
+
+                return fb->fb_id;
+        }
+
+        /* Without a modifier the kernel has to infer the layout,
+         * which some drivers can only do for linear buffers */
+        fb_id = add_fb_with_modifier(dev, bo);
+
+        if (fb_id == 0 &&
+            drmModeAddFB(dev->fd,
+                         gbm_bo_get_width(bo),
+                         gbm_bo_get_height(bo),
+                         24, /* depth */
+                         32, /* bpp */
+                         gbm_bo_get_stride(bo),
+                         gbm_bo_get_handle(bo).u32,
+                         &fb_id)) {
+                fprintf(stderr,
+                        "Failed to create new back buffer handle: %m\n");
+                return 0;
+        }
+
+        fb = xmalloc(sizeof *fb);
+        memset(fb, 0, sizeof *fb);
+        fb->fd = dev->fd;
+        fb->fb_id = fb_id;
+
+        gbm_bo_set_user_data(bo, fb, destroy_fb_callback);
+
+        return fb_id;
+}
+
+/* Flips the primary plane to the new framebuffer with a nonblocking
+ * commit. Without fences completion is reported through the page
+ * flip handler like a legacy flip. With fences KMS waits for the
+ * rendering itself and completion is reported by the out fence. */
+static int
+atomic_flip(struct gbm_output *output, uint32_t fb_id, int fence_fd)
+{
+        struct gbm_dev *dev = output->dev;
+        drmModeAtomicReq *req = drmModeAtomicAlloc();
+        uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK;
+        int has_hud, has_capture, async;
+        int ret;
+
+        drmModeAtomicAddProperty(req, dev->plane,
+                                 dev->plane_props[PLANE_PROP_FB_ID],
+                                 fb_id);
+
+        has_hud = add_hud_props(req, output);
+        has_capture = add_capture_props(req, output);
+
+        if (output->use_fences) {
+                if (fence_fd != -1)
+                        drmModeAtomicAddProperty(req, dev->plane,
+                                                 dev->in_fence_prop,
+                                                 fence_fd);
+                drmModeAtomicAddProperty(req, dev->crtc,
+                                         dev->out_fence_prop,
+                                         (uintptr_t) &output->out_fence_fd);
+        } else {
+                flags |= DRM_MODE_PAGE_FLIP_EVENT;
+        }
+
+        /* An async commit can only change the primary plane so a
+         * flip that also updates the HUD or captures waits for the
+         * vblank */
+        async = output->async_flips && !has_hud && !has_capture;
+        if (async)
+                flags |= DRM_MODE_PAGE_FLIP_ASYNC;
+
+        ret = drmModeAtomicCommit(dev->fd, req, flags, output);
+        if (ret)
+                ret = -errno;
+
+        drmModeAtomicFree(req);
+
+        if (async && ret == -EINVAL) {
+                fprintf(stderr,
+                        "async flip rejected, waiting for vblank instead\n");
+                output->async_flips = 0;
+                return atomic_flip(output, fb_id, fence_fd);
+        }
+
+        if (has_hud) {
+                if (ret == 0) {
+                        output->hud->in_flight = output->hud->pending;
+                        output->hud->pending = -1;
+                } else if (ret == -EINVAL) {
+                        /* Don't let the overlay stop the scene
+                         * from being shown */
+                        fprintf(stderr,
+                                "HUD plane rejected, disabling the HUD\n");
+                        destroy_hud(output);
+                        return atomic_flip(output, fb_id, fence_fd);
+                }
+        }
+
+        if (has_capture) {
+                if (ret == 0) {
+                        output->capture->requested = 0;
+                } else if (ret == -EINVAL) {
+                        fprintf(stderr,
+                                "writeback rejected, disabling captures\n");
+                        destroy_capture(output);
+                        return atomic_flip(output, fb_id, fence_fd);
+                }
+        }
+
+        return ret;
+}
+
+/* Requests a flip to the frame. This takes ownership of the frame's
+ * fence. */
+static int
+queue_flip(struct gbm_output *output, struct gbm_frame *frame)
+{
+        struct gbm_dev *dev = output->dev;
+        uint32_t fb_id;
+        int ret;
+
+        fb_id = get_fb_for_bo(output, frame->bo);
+        if (fb_id == 0) {
+                ret = -ENOENT;
+        } else if (dev->atomic) {
+                ret = atomic_flip(output, fb_id, frame->fence_fd);
+        } else {
+                ret = drmModePageFlip(dev->fd,
+                                      dev->crtc,
+                                      fb_id,
+                                      (DRM_MODE_PAGE_FLIP_EVENT |
+                                       (output->async_flips ?
+                                        DRM_MODE_PAGE_FLIP_ASYNC :
+                                        0)),
+                                      output);
+                if (ret) {
+                        ret = -errno;
+                        fprintf(stderr, "Failed to page flip: %m\n");
+                }
+        }
+
+        /* KMS keeps its own reference to the fence */
+        if (frame->fence_fd != -1) {
+                close(frame->fence_fd);
+                frame->fence_fd = -1;
+        }
+
+        if (ret) {
+                if (dev->atomic) {
+                        errno = -ret;
+                        fprintf(stderr, "Failed to page flip: %m\n");
+                }
+                return ret;
+        }
+
+        output->flip_bo = frame->bo;
+        output->flip_present_time = frame->present_time;
+        output->flip_draw_time = frame->draw_time;
+
+        return 0;
+}
+
+/* Exports a fence that signals when the rendering submitted so far
+ * has finished. This must be called before eglSwapBuffers() so that
+ * the swap flushes it. */
+static EGLSyncKHR
+create_render_fence(struct gbm_output *output)
+{
+        struct gbm_context *context = output->context;
+
+        return context->create_sync(context->edpy,
+                                    EGL_SYNC_NATIVE_FENCE_ANDROID,
+                                    NULL);
+}
+
+static int
+get_render_fence_fd(struct gbm_output *output, EGLSyncKHR sync)
+{
+        struct gbm_context *context = output->context;
+        int fd;
+
+        if (sync == EGL_NO_SYNC_KHR)
+                return -1;
+
+        fd = context->dup_native_fence_fd(context->edpy, sync);
+        context->destroy_sync(context->edpy, sync);
+
+        return fd == EGL_NO_NATIVE_FENCE_FD_ANDROID ? -1 : fd;
+}
+
+static void
+swap(struct gbm_output *output)
+{
+        struct gbm_dev *dev = output->dev;
+        struct gbm_context *context = output->context;
+        EGLSyncKHR sync = EGL_NO_SYNC_KHR;
+        struct gbm_frame frame;
+        struct gbm_bo *bo;
+        uint32_t fb_id;
+
+        /* The legacy fallback can't take fences */
+        if (!dev->atomic)
+                output->use_fences = 0;
+
+        if (output->use_fences)
+                sync = create_render_fence(output);
+
+        GL_DEBUG_PUSH_GROUP("swap");
+        eglSwapBuffers(context->edpy, output->egl_surface);
+        GL_DEBUG_POP_GROUP();
+
+        bo = gbm_surface_lock_front_buffer(output->gbm_surface);
+
+        frame.bo = bo;
+        frame.fence_fd = get_render_fence_fd(output, sync);
+        frame.present_time = output->present_time;
+        frame.draw_time = output->draw_time;
+
+        /* The first frame is shown directly with a modeset. This
+         * blocks so the fence isn't needed. */
+        if (dev->saved_crtc == NULL) {
+                if (frame.fence_fd != -1)
+                        close(frame.fence_fd);
+                fb_id = get_fb_for_bo(output, bo);
+                if (fb_id == 0 || set_initial_crtc(dev, bo, fb_id)) {
+                        gbm_surface_release_buffer(output->gbm_surface, bo);
+                        return;
+                }
+                output->current_bo = bo;
+                if (dev->atomic)
+                        attach_capture(output);
+                else
+                        destroy_capture(output);
+                return;
+        }
+
+        /* Only one flip can be pending at a time so later frames
+         * wait in the queue until the flip handler submits them */
+        if (output->flip_bo) {
+                output->queued_frames[output->n_queued_frames++] = frame;
+                return;
+        }
+
+        if (queue_flip(output, &frame))
+                gbm_surface_release_buffer(output->gbm_surface, bo);
+}
+
+static void *
+gbm_winsys_new(const struct stereo_winsys_callbacks *callbacks,
+               void *cb_data)
+{
+        struct gbm_winsys *winsys = xmalloc(sizeof *winsys);
+
+        memset(winsys, 0, sizeof *winsys);
+
+        winsys->fd = -1;
+        winsys->render_fd = -1;
+        winsys->timer_fd = -1;
+        winsys->options.render_margin = -1;
+        winsys->options.capture_interval = -1;
+        winsys->options.lease_fd = -1;
+        winsys->options.queue_depth = DEFAULT_QUEUE_DEPTH;
+        winsys->callbacks = callbacks;
+        winsys->cb_data = cb_data;
+
+        return winsys;
+}
+
+static int
+gbm_winsys_handle_option(void *data, int opt)
+{
+        struct gbm_winsys *winsys = data;
+        struct gbm_options *options = &winsys->options;
+
+        switch (opt) {
+        case 'd':
+                options->card = optarg;
+                return 1;
+        case 'c':
+                options->connectors = optarg;
+                return 1;
+        case 'l':
+                options->stereo_layout = optarg;
+                return 1;
+        case 'q':
+                options->queue_depth = atoi(optarg);
+                return 1;
+        case 'a':
+                options->disable_atomic = 1;
+                return 1;
+        case 't':
+                options->render_margin = atoi(optarg);
+                return 1;
+        case 'C':
+                options->ignore_display_cache = 1;
+                return 1;
+        case 'H':
+                options->hud = 1;
+                return 1;
+        case 'D':
+                options->direct_scanout = 1;
+                return 1;
+        case 'W':
+                options->capture_interval = atoi(optarg);
+                return 1;
+        case 'g':
+                options->render_device = optarg;
+                return 1;
+        case 'F':
+                options->target_refresh = atoi(optarg);
+                return 1;
+        case 'M':
+                options->max_pixel_rate = atoi(optarg);
+                return 1;
+        case 'P':
+                options->mode_policy_name = optarg;
+                return 1;
+        case 'B':
+                options->probe_modes = 1;
+                return 1;
+        case 'i':
+                options->immediate = 1;
+                return 1;
+        case 'R':
+                options->beam_slices = atoi(optarg);
+                return 1;
+        case 'e':
+                options->lease_fd = atoi(optarg);
+                return 1;
+        }
+
+        return 0;
+}
+
+static void
+gbm_winsys_disconnect(struct gbm_winsys *winsys)
+{
+        int i;
+
+        /* The flips have to finish before their buffers can be
+         * released. This gives up if no event arrives within a
+         * second. */
+        while ((get_n_pending_flips(winsys) > 0 ||
+                get_n_pending_captures(winsys) > 0) &&
+               dispatch_events(winsys, 1000) > 0)
+                continue;
+
+        for (i = 0; i < winsys->n_outputs; i++)
+                stereo_cleanup_output(winsys->outputs[i]);
+        winsys->n_outputs = 0;
+        winsys->current_output = NULL;
+
+        if (winsys->context) {
+                stereo_cleanup_context(winsys->context);
+                winsys->context = NULL;
+        }
+        if (winsys->capture_writer) {
+                capture_writer_free(winsys->capture_writer);
+                winsys->capture_writer = NULL;
+        }
+        if (winsys->timer_fd != -1) {
+                close(winsys->timer_fd);
+                winsys->timer_fd = -1;
+        }
+        if (winsys->render_fd != -1) {
+                close(winsys->render_fd);
+                winsys->render_fd = -1;
+        }
+        if (winsys->fd != -1) {
+                close(winsys->fd);
+                winsys->fd = -1;
+        }
+        if (winsys->lease_card) {
+                winsys->options.card = NULL;
+                free(winsys->lease_card);
+                winsys->lease_card = NULL;
+        }
+}
+
+/* Sets up an output for each of the chosen connectors. When all of
+ * the connectors are requested, the ones that can't be used are
+ * skipped. */
+static int
+prepare_outputs(struct gbm_winsys *winsys)
+{
+        const struct gbm_options *options = &winsys->options;
+        int all = options->connectors && !strcmp(options->connectors, "all");
+        uint32_t connector_ids[MAX_OUTPUTS];
+        uint32_t used_planes[MAX_OUTPUTS * MAX_PLANES_PER_OUTPUT];
+        uint32_t used_crtcs = 0;
+        int n_used_planes;
+        struct gbm_output *output;
+        struct gbm_dev *dev;
+        drmModeRes *res;
+        int n_connectors;
+        int ret = 0;
+        int i;
+
+        /* retrieve resources */
+        res = drmModeGetResources(winsys->fd);
+        if (!res) {
+                fprintf(stderr, "cannot retrieve DRM resources (%d): %m\n",
+                        errno);
+                return -ENOENT;
+        }
+
+        n_connectors = get_connector_ids(res, options, connector_ids);
+        if (n_connectors < 0) {
+                ret = n_connectors;
+                goto out;
+        }
+
+        for (i = 0; i < n_connectors; i++) {
+                /* The outputs so far may have taken planes that
+                 * this CRTC could also use */
+                n_used_planes = get_used_planes(winsys, used_planes);
+
+                dev = stereo_prepare_dev(winsys->fd,
+                                         res,
+                                         connector_ids[i],
+                                         options,
+                                         used_crtcs,
+                                         used_planes,
+                                         n_used_planes);
+                if (dev == NULL) {
+                        if (all)
+                                continue;
+                        ret = -ENOENT;
+                        goto out;
+                }
+
+                output = stereo_prepare_output(winsys->context, dev, options);
+                if (output == NULL) {
+                        stereo_cleanup_dev(dev);
+                        ret = -ENOENT;
+                        goto out;
+                }
+
+                if (options->hud)
+                        init_hud(winsys, output, res);
+                if (options->beam_slices > 0)
+                        init_beam(output, res, options->beam_slices);
+
+                used_crtcs |= 1 << get_crtc_index(res, dev->crtc);
+                winsys->outputs[winsys->n_outputs++] = output;
+        }
+
+        if (winsys->n_outputs < 1) {
+                fprintf(stderr, "no usable connectors found\n");
+                ret = -ENOENT;
+        }
+
+out:
+        drmModeFreeResources(res);
+
+        return ret;
+}
+
+static int
+parse_mode_policy(struct gbm_options *options)
+{
+        const char *name = options->mode_policy_name;
+
+        if (name == NULL || !strcmp(name, "quality"))
+                options->mode_policy = MODE_POLICY_QUALITY;
+        else if (!strcmp(name, "latency"))
+                options->mode_policy = MODE_POLICY_LATENCY;
+        else if (!strcmp(name, "gpu"))
+                options->mode_policy = MODE_POLICY_GPU;
+        else {
+                fprintf(stderr, "unknown mode policy \"%s\"\n", name);
+                return -EINVAL;
+        }
+
+        return 0;
+}
+
+static int
+gbm_winsys_connect(void *data)
+{
+        struct gbm_winsys *winsys = data;
+        int ret;
+
+        if (winsys->options.queue_depth < 1 ||
+            winsys->options.queue_depth > MAX_QUEUE_DEPTH) {
+                fprintf(stderr,
+                        "queue depth must be between 1 and %i\n",
+                        MAX_QUEUE_DEPTH);
+                return -EINVAL;
+        }
+
+        ret = parse_mode_policy(&winsys->options);
+        if (ret)
+                return ret;
+
+        /* open the DRM device */
+        ret = stereo_open(&winsys->fd, &winsys->options);
+        if (ret)
+                goto error;
+
+        if (winsys->options.lease_fd >= 0 && winsys->options.card == NULL) {
+                winsys->lease_card = drmGetDeviceNameFromFd2(winsys->fd);
+                winsys->options.card = winsys->lease_card;
+        }
+
+        if (winsys->options.render_margin >= 0 ||
+            winsys->options.beam_slices > 0) {
+                winsys->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                                  TFD_CLOEXEC | TFD_NONBLOCK);
+                if (winsys->timer_fd == -1) {
+                        ret = -errno;
+                        fprintf(stderr, "error creating timerfd: %m\n");
+                        goto error;
+                }
+        }
+
+        /* Rendering can happen on a render node or another GPU
+         * with the buffers shared to the display device */
+        if (winsys->options.render_device) {
+                winsys->render_fd = open(winsys->options.render_device,
+                                         O_RDWR | O_CLOEXEC);
+                if (winsys->render_fd < 0) {
+                        ret = -errno;
+                        fprintf(stderr, "cannot open '%s': %m\n",
+                                winsys->options.render_device);
+                        goto error;
+                }
+                winsys->context = stereo_prepare_context(winsys->render_fd,
+                                                         1 /* prime */);
+        } else {
+                winsys->context = stereo_prepare_context(winsys->fd,
+                                                         0 /* prime */);
+        }
+        if (winsys->context == NULL) {
+                ret = -ENOENT;
+                goto error;
+        }
+
+        /* prepare all connectors and CRTCs */
+        ret = prepare_outputs(winsys);
+        if (ret)
+                goto error;
+
+        /* The slices are timed against a single CRTC */
+        if (winsys->options.beam_slices > 0 && winsys->n_outputs > 1) {
+                fprintf(stderr, "beam racing can only drive one connector\n");
+                ret = -EINVAL;
+                goto error;
+        }
+
+        if (winsys->options.capture_interval >= 0)
+                init_captures(winsys);
+
+        /* The renderer creates its resources with the first output
+         * bound */
+        ret = make_output_current(winsys->outputs[0]);
+        if (ret)
+                goto error;
+        winsys->current_output = winsys->outputs[0];
+
+        ret = check_multiview(winsys->context);
+        if (ret)
+                goto error;
+
+        return 0;
+
+error:
+        gbm_winsys_disconnect(winsys);
+        return ret;
+}
+
+static void
+sigint_handler(int sig)
+{
+        quit = 1;
+}
+
+static void
+sigusr1_handler(int sig)
+{
+        capture_requested = 1;
+}
+
+/* Asks every output with a writeback connector to capture its next
+ * flip */
+static void
+request_captures(struct gbm_winsys *winsys)
+{
+        int i;
+
+        for (i = 0; i < winsys->n_outputs; i++)
+                if (winsys->outputs[i]->capture)
+                        winsys->outputs[i]->capture->requested = 1;
+}
+
+/* Binds the output and tells the renderer if its size differs from
+ * the output that was last drawn */
+static int
+select_output(struct gbm_winsys *winsys, struct gbm_output *output)
+{
+        struct gbm_context *context = winsys->context;
+        EGLint width, height;
+
+        if (winsys->current_output != output) {
+                if (make_output_current(output))
+                        return -ENOENT;
+                winsys->current_output = output;
         }
 
-        if (!eglInitialize(context->edpy, NULL, NULL)) {
-                fprintf(stderr, "error intializing EGL display\n");
-                goto error_gbm_device;
-        }
+        eglQuerySurface(context->edpy, output->egl_surface,
+                        EGL_WIDTH, &width);
+        eglQuerySurface(context->edpy, output->egl_surface,
+                        EGL_HEIGHT, &height);
 
-        if (!extension_supported(context->edpy, MULTIVIEW_WINDOW_EXTENSION)) {
-                fprintf(stderr, MULTIVIEW_WINDOW_EXTENSION " not supported\n");
-                goto error_egl_display;
+        if (width != winsys->width || height != winsys->height) {
+                winsys->width = width;
+                winsys->height = height;
+                winsys->callbacks->update_size(winsys->cb_data,
+                                               width, height);
         }
 
-        if (create_gbm_surface(context))
-                goto error_egl_display;
-
-        if (choose_egl_config(context))
-                goto error_gbm_surface;
+        return 0;
+}
 
-        if (create_egl_surface(context, options))
-                goto error_gbm_surface;
+/* Checks whether there is room in the output's queue and a free
+ * buffer to render to */
+static int
+output_has_room(struct gbm_winsys *winsys, struct gbm_output *output)
+{
+        return (get_frames_in_flight(output) < winsys->options.queue_depth &&
+                gbm_surface_has_free_buffers(output->gbm_surface));
+}
 
-        if (create_egl_context(context))
-                goto error_egl_surface;
+static void
+record_render_cost(struct gbm_output *output, uint64_t cost)
+{
+        output->render_costs[output->n_render_costs++ %
+                             RENDER_COST_HISTORY] = cost;
+}
 
-        if (!eglMakeCurrent(context->edpy,
-                            context->egl_surface,
-                            context->egl_surface,
-                            context->egl_context)) {
-                fprintf(stderr, "failed to make EGL context current\n");
-                goto error_egl_context;
-        }
+/* Predicts the render time of the next frame as the worst of the
+ * recent frames */
+static uint64_t
+get_render_cost(const struct gbm_output *output)
+{
+        uint64_t cost = 0;
+        int i, n;
 
-        if ((!eglQueryContext(context->edpy,
-                              context->egl_context,
-                              EGL_MULTIVIEW_VIEW_COUNT_EXT,
-                              &multiview_view_count) ||
-             multiview_view_count < 2)) {
-                fprintf(stderr,
-                        "EGL created a multiview surface with only %i %s\n",
-                        multiview_view_count,
-                        multiview_view_count == 1 ? "view" : "views");
-                goto error_unbind;
-        }
+        n = output->n_render_costs;
+        if (n > RENDER_COST_HISTORY)
+                n = RENDER_COST_HISTORY;
 
-        return context;
+        for (i = 0; i < n; i++)
+                if (output->render_costs[i] > cost)
+                        cost = output->render_costs[i];
 
-error_unbind:
-        eglMakeCurrent(context->edpy,
-                       EGL_NO_SURFACE, EGL_NO_SURFACE,
-                       EGL_NO_CONTEXT);
-error_egl_context:
-        eglDestroyContext(context->edpy, context->egl_context);
-error_egl_surface:
-        eglDestroySurface(context->edpy, context->egl_surface);
-error_gbm_surface:
-        gbm_surface_destroy(context->gbm_surface);
-error_egl_display:
-        eglTerminate(context->edpy);
-error_gbm_device:
-        gbm_device_destroy(context->gbm);
-error:
-        free(context);
-        return NULL;
+        return cost;
 }
 
+/* Redraws the HUD into a buffer that isn't being scanned out if its
+ * text has changed. The new buffer is shown with the next flip. */
 static void
-stereo_cleanup_context(struct gbm_context *context)
+update_hud(struct gbm_output *output, uint64_t now)
 {
-        restore_saved_crtc(context->dev);
-        free_current_bo(context);
-        eglMakeCurrent(context->edpy,
-                       EGL_NO_SURFACE,
-                       EGL_NO_SURFACE,
-                       EGL_NO_CONTEXT);
-        eglDestroyContext(context->edpy, context->egl_context);
-        eglDestroySurface(context->edpy, context->egl_surface);
-        gbm_surface_destroy(context->gbm_surface);
-        eglTerminate(context->edpy);
-        gbm_device_destroy(context->gbm);
-        free(context);
+        struct gbm_hud *hud = output->hud;
+        const struct gbm_dev *dev = output->dev;
+        char text[sizeof hud->text];
+        struct dumb_fb *buffer;
+        uint32_t *pixels;
+        double fps = 0.0;
+        int back, eye, y, i;
+
+        if (hud == NULL ||
+            hud->in_flight != -1 ||
+            (hud->last_update &&
+             now - hud->last_update < HUD_UPDATE_INTERVAL))
+                return;
+
+        if (hud->last_update)
+                fps = hud->n_flips * 1e9 / (now - hud->last_update);
+        hud->n_flips = 0;
+        hud->last_update = now;
+
+        snprintf(text, sizeof text,
+                 "CONNECTOR %u %ux%u\n"
+                 "%s\n"
+                 "%.1f FPS  CPU %.1f MS\n"
+                 "MISSED %i OF %i",
+                 dev->conn,
+                 dev->mode.hdisplay,
+                 dev->mode.vdisplay,
+                 get_stereo_mode_name(dev->mode.flags &
+                                      DRM_MODE_FLAG_3D_MASK),
+                 fps,
+                 get_render_cost(output) / 1e6,
+                 output->n_missed_frames,
+                 output->n_frames);
+
+        if (hud->front != -1 && !strcmp(text, hud->text))
+                return;
+
+        strcpy(hud->text, text);
+
+        /* An uncommitted buffer can just be drawn over */
+        if (hud->pending != -1)
+                back = hud->pending;
+        else
+                back = hud->front == 0 ? 1 : 0;
+        buffer = hud->buffers + back;
+
+        for (i = 0; i < hud->eye_width * hud->eye_height; i++)
+                hud->eye_pixels[i] = HUD_BACKGROUND_COLOR;
+        hud_draw_text(hud->eye_pixels,
+                      hud->eye_width,
+                      hud->eye_width, hud->eye_height,
+                      HUD_PADDING, HUD_PADDING,
+                      text,
+                      HUD_TEXT_COLOR);
+
+        /* Both eyes get the same image so that the HUD appears at
+         * the depth of the screen */
+        for (eye = 0; eye < 2; eye++) {
+                for (y = 0; y < hud->eye_height; y++) {
+                        pixels = (uint32_t *)
+                                ((uint8_t *) buffer->map +
+                                 (eye * hud->right_y + y * hud->row_step) *
+                                 buffer->pitch) +
+                                eye * hud->right_x;
+                        memcpy(pixels,
+                               hud->eye_pixels + y * hud->eye_width,
+                               hud->eye_width * sizeof (uint32_t));
+                }
+        }
+
+        hud->pending = back;
 }
 
+/* Predicts the vblank that the next frame will be shown at and, for
+ * render-late scheduling, when to start drawing it */
 static void
-page_flip_handler(int fd,
-                  unsigned int frame,
-                  unsigned int sec,
-                  unsigned int usec,
-                  void *data)
+schedule_frame(struct gbm_winsys *winsys,
+               struct gbm_output *output,
+               uint64_t now)
 {
-        struct gbm_dev *dev = data;
+        int render_late = winsys->options.render_margin >= 0;
+        uint64_t refresh = output->refresh_ns;
+        uint64_t present, deadline = 0;
+
+        output->present_time = 0;
+        output->start_time = 0;
+
+        /* Async flips aren't tied to a vblank */
+        if (output->last_vblank == 0 || refresh == 0 || output->async_flips)
+                return;
 
-        dev->pending_swap = 0;
+        /* The frame can't be shown before the frames already queued */
+        present = (output->last_vblank +
+                   refresh * (get_frames_in_flight(output) + 1));
+
+        if (render_late)
+                deadline = (get_render_cost(output) +
+                            winsys->options.render_margin * UINT64_C(1000));
+
+        /* Skip any vblanks that can no longer be reached */
+        if (present < now + deadline)
+                present += ((now + deadline - present + refresh - 1) /
+                            refresh * refresh);
+
+        output->present_time = present;
+        if (render_late)
+                output->start_time = present - deadline;
 }
 
 static void
-wait_swap(struct gbm_dev *dev)
+set_timer(struct gbm_winsys *winsys, uint64_t time)
 {
-        drmEventContext evctx;
+        struct itimerspec its;
 
-        while (dev->pending_swap) {
-                memset(&evctx, 0, sizeof(evctx));
-                evctx.version = DRM_EVENT_CONTEXT_VERSION;
-                evctx.page_flip_handler = page_flip_handler;
-                drmHandleEvent(dev->fd, &evctx);
-        }
+        memset(&its, 0, sizeof its);
+        its.it_value.tv_sec = time / UINT64_C(1000000000);
+        its.it_value.tv_nsec = time % UINT64_C(1000000000);
+
+        timerfd_settime(winsys->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
 }
 
+/* Frames drawn at each mode when probing. The first few aren't
+ * timed because they include uploading textures and resizing. */
+#define PROBE_WARMUP_FRAMES 5
+#define PROBE_FRAMES 30
+
+/* Replaces the output's surfaces with ones for the mode */
 static int
-set_initial_crtc(struct gbm_dev *dev, uint32_t fb_id)
+set_output_mode(struct gbm_winsys *winsys,
+                struct gbm_output *output,
+                const drmModeModeInfo *mode)
 {
-        dev->saved_crtc = drmModeGetCrtc(dev->fd, dev->crtc);
+        struct gbm_context *context = winsys->context;
+        struct gbm_dev *dev = output->dev;
+
+        if (winsys->current_output == output) {
+                eglMakeCurrent(context->edpy,
+                               EGL_NO_SURFACE,
+                               EGL_NO_SURFACE,
+                               context->egl_context);
+                winsys->current_output = NULL;
+        }
 
-        if (drmModeSetCrtc(dev->fd,
-                           dev->crtc,
-                           fb_id,
-                           0, 0, /* x/y */
-                           &dev->conn, 1,
-                           &dev->mode)) {
-                fprintf(stderr, "Failed to set drm mode: %m\n");
-                return errno;
+        eglDestroySurface(context->edpy, output->egl_surface);
+        output->egl_surface = EGL_NO_SURFACE;
+        gbm_surface_destroy(output->gbm_surface);
+        output->gbm_surface = NULL;
+
+        dev->mode = *mode;
+        dev->width = mode->hdisplay;
+        dev->height = mode->vdisplay;
+        output->refresh_ns = get_mode_refresh_ns(mode);
+
+        if (create_gbm_surface(output))
+                return -ENOENT;
+
+        if (create_egl_surface(output, &winsys->options)) {
+                gbm_surface_destroy(output->gbm_surface);
+                output->gbm_surface = NULL;
+                return -ENOENT;
         }
 
         return 0;
 }
 
-static void
-swap(struct gbm_winsys *winsys)
+/* Draws some frames at the size of the mode without showing them.
+ * Returns the average time per frame in nanoseconds or UINT64_MAX if
+ * the surfaces couldn't be created. */
+static uint64_t
+measure_mode(struct gbm_winsys *winsys,
+             struct gbm_output *output,
+             const drmModeModeInfo *mode)
 {
-        struct gbm_dev *dev = winsys->dev;
         struct gbm_context *context = winsys->context;
+        uint64_t start_time = 0;
         struct gbm_bo *bo;
-        uint32_t handle, stride;
-        uint32_t width, height;
-        uint32_t fb_id;
-
-        eglSwapBuffers(context->edpy, context->egl_surface);
+        int i;
 
-        bo = gbm_surface_lock_front_buffer(context->gbm_surface);
-        width = gbm_bo_get_width(bo);
-        height = gbm_bo_get_height(bo);
-        stride = gbm_bo_get_stride(bo);
-        handle = gbm_bo_get_handle(bo).u32;
+        if (set_output_mode(winsys, output, mode) ||
+            select_output(winsys, output))
+                return UINT64_MAX;
 
-        if (drmModeAddFB(dev->fd,
-                         width, height,
-                         24, /* depth */
-                         32, /* bpp */
-                         stride,
-                         handle,
-                         &fb_id)) {
-                fprintf(stderr,
-                        "Failed to create new back buffer handle: %m\n");
-        } else {
-                if (dev->saved_crtc == NULL &&
-                    set_initial_crtc(dev, fb_id))
-                        return;
+        /* Otherwise the renderer might only draw placeholders while
+         * its shaders or images are still loading */
+        if (winsys->callbacks->finish_loading)
+                winsys->callbacks->finish_loading(winsys->cb_data);
 
-                if (drmModePageFlip(dev->fd,
-                                    dev->crtc,
-                                    fb_id,
-                                    DRM_MODE_PAGE_FLIP_EVENT,
-                                    dev)) {
-                        fprintf(stderr, "Failed to page flip: %m\n");
-                        return;
+        for (i = 0; i < PROBE_WARMUP_FRAMES + PROBE_FRAMES; i++) {
+                if (i == PROBE_WARMUP_FRAMES) {
+                        glFinish();
+                        start_time = get_time_ns();
                 }
 
-                dev->pending_swap = 1;
+                winsys->callbacks->draw(winsys->cb_data, 0 /* present_time */);
+                eglSwapBuffers(context->edpy, output->egl_surface);
 
-                wait_swap(dev);
-
-                free_current_bo(context);
-                context->current_bo = bo;
-                context->current_fb_id = fb_id;
+                bo = gbm_surface_lock_front_buffer(output->gbm_surface);
+                if (bo)
+                        gbm_surface_release_buffer(output->gbm_surface, bo);
         }
+
+        glFinish();
+
+        return (get_time_ns() - start_time) / PROBE_FRAMES;
 }
 
-static void *
-gbm_winsys_new(const struct stereo_winsys_callbacks *callbacks,
-               void *cb_data)
+/* Updates the state that depends on the size of the mode after the
+ * probe has changed it */
+static void
+apply_probed_mode(struct gbm_winsys *winsys,
+                  struct gbm_output *output,
+                  drmModeRes *res)
 {
-        struct gbm_winsys *winsys = xmalloc(sizeof *winsys);
-
-        memset(winsys, 0, sizeof *winsys);
+        struct gbm_capture *capture = output->capture;
+        struct gbm_dev *dev = output->dev;
 
-        winsys->fd = -1;
-        winsys->options.connector = -1;
-        winsys->callbacks = callbacks;
-        winsys->cb_data = cb_data;
+        if (dev->mode_blob_id) {
+                drmModeDestroyPropertyBlob(dev->fd, dev->mode_blob_id);
+                dev->mode_blob_id = 0;
 
-        return winsys;
-}
+                if (drmModeCreatePropertyBlob(dev->fd,
+                                              &dev->mode,
+                                              sizeof dev->mode,
+                                              &dev->mode_blob_id)) {
+                        fprintf(stderr,
+                                "error creating mode blob, falling back to "
+                                "legacy modesetting: %m\n");
+                        dev->atomic = 0;
+                }
+        }
 
-static int
-gbm_winsys_handle_option(void *data, int opt)
-{
-        struct gbm_winsys *winsys = data;
-        struct gbm_options *options = &winsys->options;
+        if (output->hud) {
+                destroy_hud(output);
+                init_hud(winsys, output, res);
+        }
 
-        switch (opt) {
-        case 'd':
-                options->card = optarg;
-                return 1;
-        case 'c':
-                options->connector = atoi(optarg);
-                return 1;
-        case 'l':
-                options->stereo_layout = optarg;
-                return 1;
+        if (output->beam) {
+                destroy_beam(output);
+                init_beam(output, res, winsys->options.beam_slices);
         }
 
-        return 0;
+        if (capture) {
+                destroy_dumb_fb(dev->fd, &capture->buffer);
+                memset(&capture->buffer, 0, sizeof capture->buffer);
+                if (create_capture_buffer(output))
+                        destroy_capture(output);
+        }
 }
 
-static void
-gbm_winsys_disconnect(struct gbm_winsys *winsys)
+/* Measures the renderer at each candidate mode, best first, and
+ * switches to the first one that it can draw at the full frame rate.
+ * If there is none, the mode with the most time to spare relative to
+ * its refresh interval is used. */
+static int
+probe_output_modes(struct gbm_winsys *winsys,
+                   struct gbm_output *output,
+                   drmModeRes *res)
 {
-        if (winsys->context) {
-                stereo_cleanup_context(winsys->context);
-                winsys->context = NULL;
-        }
-        if (winsys->dev) {
-                stereo_cleanup_dev(winsys->dev);
-                winsys->dev = NULL;
+        struct gbm_dev *dev = output->dev;
+        drmModeModeInfo old_mode = dev->mode;
+        const drmModeModeInfo *mode, *chosen = NULL, *fallback = NULL;
+        uint64_t cost, refresh_ns;
+        uint64_t fallback_cost = 0, fallback_refresh_ns = 0;
+        int i;
+
+        for (i = 0; i < dev->n_candidate_modes && chosen == NULL; i++) {
+                mode = dev->candidate_modes + i;
+                refresh_ns = get_mode_refresh_ns(mode);
+
+                cost = measure_mode(winsys, output, mode);
+                if (cost == UINT64_MAX)
+                        return -ENOENT;
+
+                printf("connector %u: %s (%s) at %u Hz takes %" PRIu64
+                       " us per frame\n",
+                       dev->conn,
+                       mode->name,
+                       get_stereo_mode_name(mode->flags &
+                                            DRM_MODE_FLAG_3D_MASK),
+                       mode->vrefresh,
+                       cost / 1000);
+
+                if (cost <= refresh_ns) {
+                        chosen = mode;
+                } else if (fallback == NULL ||
+                           cost * fallback_refresh_ns <
+                           fallback_cost * refresh_ns) {
+                        fallback = mode;
+                        fallback_cost = cost;
+                        fallback_refresh_ns = refresh_ns;
+                }
         }
-        if (winsys->fd != -1) {
-                close(winsys->fd);
-                winsys->fd = -1;
+
+        if (chosen == NULL) {
+                fprintf(stderr,
+                        "connector %u: no mode can be drawn at the full "
+                        "frame rate\n",
+                        dev->conn);
+                chosen = fallback ? fallback : &old_mode;
         }
+
+        if (set_output_mode(winsys, output, chosen))
+                return -ENOENT;
+
+        fprintf(stderr, "probed mode for connector %u is %ux%u (%s)\n",
+                dev->conn,
+                dev->width, dev->height,
+                get_stereo_mode_name(dev->mode.flags &
+                                     DRM_MODE_FLAG_3D_MASK));
+
+        if (memcmp(&old_mode, &dev->mode, sizeof old_mode))
+                apply_probed_mode(winsys, output, res);
+
+        return 0;
 }
 
 static int
-gbm_winsys_connect(void *data)
+probe_modes(struct gbm_winsys *winsys)
 {
-        struct gbm_winsys *winsys = data;
-        int ret;
-
-        /* open the DRM device */
-        ret = stereo_open(&winsys->fd, &winsys->options);
-        if (ret)
-                goto error;
+        drmModeRes *res;
+        int ret = 0;
+        int i;
 
-        /* prepare all connectors and CRTCs */
-        winsys->dev = stereo_prepare_dev(winsys->fd, &winsys->options);
-        if (winsys->dev == NULL) {
-                ret = -ENOENT;
-                goto error;
+        res = drmModeGetResources(winsys->fd);
+        if (!res) {
+                fprintf(stderr, "cannot retrieve DRM resources (%d): %m\n",
+                        errno);
+                return -ENOENT;
         }
 
-        winsys->context = stereo_prepare_context(winsys->dev, &winsys->options);
-        if (winsys->context == NULL) {
-                ret = -ENOENT;
-                goto error;
-        }
+        for (i = 0; i < winsys->n_outputs && ret == 0; i++)
+                ret = probe_output_modes(winsys, winsys->outputs[i], res);
 
-        return 0;
+        drmModeFreeResources(res);
 
-error:
-        gbm_winsys_disconnect(winsys);
         return ret;
 }
 
+/* Handles events until the time is reached. Returns -EINTR if the
+ * program is quitting. */
+static int
+wait_until(struct gbm_winsys *winsys, uint64_t time)
+{
+        while (!quit && get_time_ns() < time) {
+                set_timer(winsys, time);
+                dispatch_events(winsys, -1);
+        }
+
+        return quit ? -EINTR : 0;
+}
+
+/* Draws the rows of the views from view_row downwards and flips to
+ * them straight away. view_row must be at or above the tear line of
+ * the flip. */
 static void
-sigint_handler(int sig)
+draw_beam_slice(struct gbm_winsys *winsys,
+                struct gbm_output *output,
+                uint32_t view_row,
+                uint64_t present_time)
 {
-        quit = 1;
+        uint64_t start = get_time_ns();
+
+        if (select_output(winsys, output))
+                return;
+
+        /* GL counts the rows from the bottom */
+        gl_state_set_enabled(GL_SCISSOR_TEST, 1);
+        glScissor(0, 0, winsys->width, winsys->height - view_row);
+
+        output->draw_time = start;
+        winsys->callbacks->draw(winsys->cb_data, present_time);
+
+        gl_state_set_enabled(GL_SCISSOR_TEST, 0);
+
+        /* The flip would wait for the rendering anyway. Waiting here
+         * makes the render cost include the GPU time so that the
+         * slices can be started early enough. */
+        glFinish();
+
+        swap(output);
+        record_render_cost(output, get_time_ns() - start);
 }
 
+/* Draws each refresh of the output as slices that are flipped to
+ * just before the beam reaches them. This returns when quitting or
+ * if the vblank timestamps can't be read. The HUD isn't updated
+ * because its flips would have to wait for the vblank. */
 static void
-update_size(struct gbm_winsys *winsys)
+race_beam(struct gbm_winsys *winsys, struct gbm_output *output)
 {
-        struct gbm_context *context = winsys->context;
-        EGLint width, height;
+        struct gbm_beam *beam = output->beam;
+        uint64_t refresh = output->refresh_ns;
+        uint64_t margin, last_scanout, scanout, row_time, start_time;
+        uint64_t now, lead;
+        uint32_t row, draw_row;
+        int ret, i;
 
-        eglQuerySurface(context->edpy, context->egl_surface,
-                        EGL_WIDTH, &width);
-        eglQuerySurface(context->edpy, context->egl_surface,
-                        EGL_HEIGHT, &height);
-        winsys->callbacks->update_size(winsys->cb_data, width, height);
+        margin = (winsys->options.render_margin >= 0 ?
+                  winsys->options.render_margin :
+                  DEFAULT_BEAM_MARGIN) * UINT64_C(1000);
+
+        /* The first frame is shown whole with a modeset */
+        draw_beam_slice(winsys, output, 0, 0);
+
+        while (!quit) {
+                if (capture_requested) {
+                        capture_requested = 0;
+                        request_captures(winsys);
+                }
+
+                ret = get_last_scanout_time(output, &last_scanout);
+                if (ret) {
+                        errno = -ret;
+                        fprintf(stderr, "error reading the vblank: %m\n");
+                        break;
+                }
+
+                /* Race the next scanout that hasn't been raced yet.
+                 * If drawing has fallen behind this can be the one
+                 * already in progress. */
+                scanout = last_scanout;
+                while (scanout < beam->scanout_time + refresh / 2)
+                        scanout += refresh;
+                beam->scanout_time = scanout;
+
+                for (i = 0; i < beam->n_slices && !quit; i++) {
+                        /* Only one flip can be pending at a time */
+                        while (output->flip_bo && !quit)
+                                dispatch_events(winsys, -1);
+
+                        row = beam->rows[i];
+                        row_time = (scanout +
+                                    row * refresh / beam->frame_lines);
+                        lead = get_render_cost(output) + margin;
+                        now = get_time_ns();
+
+                        /* Slices that can't be finished before the
+                         * beam gets there are left to the next
+                         * slice. The first is always drawn so that a
+                         * slow renderer still makes progress. */
+                        if (i > 0 && now + lead > row_time) {
+                                beam->n_skipped++;
+                                continue;
+                        }
+
+                        start_time = row_time > lead ? row_time - lead : 0;
+                        if (wait_until(winsys, start_time))
+                                break;
+
+                        /* The flip can land anywhere between where
+                         * the beam is now and the slice. Everything
+                         * below the tear line comes from the new
+                         * buffer so it is all redrawn. */
+                        draw_row = get_beam_row(beam,
+                                                refresh,
+                                                get_time_ns());
+                        if (draw_row > row)
+                                draw_row = row;
+
+                        draw_beam_slice(winsys,
+                                        output,
+                                        get_beam_view_row(&output->dev->mode,
+                                                          draw_row),
+                                        row_time);
+
+                        beam->n_drawn++;
+                        if (get_time_ns() > row_time)
+                                beam->n_late++;
+                }
+        }
 }
 
 static void
 gbm_winsys_main_loop(void *data)
 {
         struct gbm_winsys *winsys = data;
+        struct gbm_output *output;
         struct sigaction action = {
                 .sa_handler = sigint_handler,
         };
-        struct sigaction old_action;
+        struct sigaction capture_action = {
+                .sa_handler = sigusr1_handler,
+        };
+        struct sigaction old_action, old_capture_action;
+        uint64_t now, wake_time;
+        int direct = 0;
+        int n_drawn;
+        int i;
+
+        if (winsys->options.probe_modes && probe_modes(winsys)) {
+                fprintf(stderr, "error probing the modes\n");
+                return;
+        }
 
         sigemptyset(&action.sa_mask);
         sigaction(SIGINT, &action, &old_action);
+        sigemptyset(&capture_action.sa_mask);
+        sigaction(SIGUSR1, &capture_action, &old_capture_action);
+
+        if (winsys->options.direct_scanout) {
+                if (start_direct_scanout(winsys) == 0)
+                        direct = 1;
+                else
+                        fprintf(stderr, "falling back to rendering\n");
+        }
 
-        update_size(winsys);
+        /* Beam racing does its own timing. If it stops without
+         * quitting the normal loop takes over. */
+        if (!direct && winsys->outputs[0]->beam) {
+                race_beam(winsys, winsys->outputs[0]);
+                destroy_beam(winsys->outputs[0]);
+        }
 
         while (!quit) {
-                winsys->callbacks->draw(winsys->cb_data);
-                swap(winsys);
+                /* The planes keep showing the images without any
+                 * help so there is only the quit signal to wait
+                 * for */
+                if (direct) {
+                        dispatch_events(winsys, -1);
+                        continue;
+                }
+
+                if (capture_requested) {
+                        capture_requested = 0;
+                        request_captures(winsys);
+                }
+
+                /* Each output has its own flip timing so only the
+                 * ones with room in their queue are drawn. The
+                 * others keep getting flipped from the event
+                 * handler in the meantime. */
+                n_drawn = 0;
+                wake_time = 0;
+
+                for (i = 0; i < winsys->n_outputs && !quit; i++) {
+                        output = winsys->outputs[i];
+
+                        if (!output_has_room(winsys, output))
+                                continue;
+
+                        now = get_time_ns();
+                        schedule_frame(winsys, output, now);
+
+                        /* When rendering late, wait until just
+                         * before the vblank so that the frame shows
+                         * the freshest state */
+                        if (output->start_time > now) {
+                                if (wake_time == 0 ||
+                                    output->start_time < wake_time)
+                                        wake_time = output->start_time;
+                                continue;
+                        }
+
+                        if (select_output(winsys, output))
+                                continue;
+
+                        output->draw_time = now;
+                        winsys->callbacks->draw(winsys->cb_data,
+                                                output->present_time);
+                        swap(output);
+                        record_render_cost(output, get_time_ns() - now);
+                        update_hud(output, get_time_ns());
+                        n_drawn++;
+                }
+
+                if (quit)
+                        break;
+
+                if (n_drawn == 0 && wake_time)
+                        set_timer(winsys, wake_time);
+
+                /* Wait for a flip or the timer if no output could be
+                 * drawn, otherwise just handle the flips that have
+                 * already completed */
+                dispatch_events(winsys, n_drawn > 0 ? 0 : -1);
         }
 
         sigaction(SIGINT, &old_action, NULL);
+        sigaction(SIGUSR1, &old_capture_action, NULL);
 }
 
 static void
@@ -895,12 +4902,52 @@ gbm_winsys_free(void *data)
 const struct stereo_winsys
 gbm_winsys = {
         .name = "gbm",
-        .options = "d:c:l:",
+        .options = "d:c:l:q:at:CHDW:g:F:M:P:BiR:e:",
         .options_desc =
         "  -d <DEV>        Set the dri device to open\n"
-        "  -c <CONNECTOR>  Use the given connector\n"
+        "  -c <CONNECTORS> Use a comma-separated list of connector "
+        "ids, or \"all\"\n"
         "  -l <MODE>       Use a particular stereo mode "
-        "(none/fp/la/sbsf/tb/sbsh)\n",
+        "(none/fp/la/sbsf/tb/sbsh)\n"
+        "  -q <DEPTH>      Number of frames that can be queued for "
+        "display (1-3,\n"
+        "                  default 2)\n"
+        "  -a              Use legacy modesetting even if the driver "
+        "supports atomic\n"
+        "  -t <USEC>       Start rendering as late as possible, aiming "
+        "to finish USEC\n"
+        "                  microseconds before the vblank\n"
+        "  -C              Probe the displays instead of using the cached "
+        "configuration\n"
+        "  -H              Show statistics on an overlay plane\n"
+        "  -D              Show static images directly on planes "
+        "instead of rendering\n"
+        "  -W <N>          Capture every Nth frame through a writeback "
+        "connector, or\n"
+        "                  only on SIGUSR1 if N is 0\n"
+        "  -g <DEV>        Render on a different device and share the "
+        "buffers with\n"
+        "                  the display device\n"
+        "  -F <HZ>         Prefer modes with this refresh rate\n"
+        "  -M <MPIX>       Skip modes that need more than MPIX megapixels "
+        "per second\n"
+        "                  to be drawn at full frame rate\n"
+        "  -P <POLICY>     Favour the most pixels (quality), the highest "
+        "refresh rate\n"
+        "                  (latency) or the fewest pixels (gpu)\n"
+        "  -B              Measure the renderer at each mode and pick the "
+        "best one\n"
+        "                  that it can draw at full frame rate\n"
+        "  -i              Flip as soon as each frame is drawn without "
+        "waiting for\n"
+        "                  the vblank. This can tear.\n"
+        "  -R <N>          Race the beam, redrawing the rows ahead of the "
+        "scanout in N\n"
+        "                  slices per eye for each refresh. -t sets how "
+        "far ahead.\n"
+        "  -e <FD>         Drive the connectors leased to this DRM fd "
+        "instead of\n"
+        "                  opening the device\n",
         .new = gbm_winsys_new,
         .handle_option = gbm_winsys_handle_option,
         .connect = gbm_winsys_connect,
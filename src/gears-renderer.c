@@ -45,7 +45,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/time.h>
+#include <stdint.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #include <GLES2/gl2.h>
@@ -63,6 +64,13 @@
 struct gears_renderer {
         PFNGLDRAWBUFFERSINDEXEDEXTPROC draw_buffers_indexed;
         int width, height;
+
+        /* The program is built in the background and only waited
+         * for when it is first needed */
+        struct pending_program *pending_program;
+        GLuint program;
+
+        int per_fragment_lighting;
 };
 
 /**
@@ -291,7 +299,7 @@ create_gear(GLfloat inner_radius, GLfloat outer_radius,
 
         /* Store the vertices in a vertex buffer object (VBO) */
         glGenBuffers(1, &gear->vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, gear->vbo);
+        gl_state_bind_buffer(GL_ARRAY_BUFFER, gear->vbo);
         glBufferData(GL_ARRAY_BUFFER, gear->nvertices * sizeof(GearVertex),
                      gear->vertices, GL_STATIC_DRAW);
 
@@ -504,27 +512,24 @@ draw_gear(struct gear *gear, GLfloat * transform,
         glUniform4fv(MaterialColor_location, 1, color);
 
         /* Set the vertex buffer object to use */
-        glBindBuffer(GL_ARRAY_BUFFER, gear->vbo);
+        gl_state_bind_buffer(GL_ARRAY_BUFFER, gear->vbo);
 
         /* Set up the position of the attributes in the vertex buffer object */
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE,
-                              6 * sizeof(GLfloat), NULL);
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE,
-                              6 * sizeof(GLfloat), (GLfloat *) 0 + 3);
+        gl_state_vertex_attrib_pointer(0, 3, GL_FLOAT, GL_FALSE,
+                                       6 * sizeof(GLfloat), NULL);
+        gl_state_vertex_attrib_pointer(1, 3, GL_FLOAT, GL_FALSE,
+                                       6 * sizeof(GLfloat),
+                                       (GLfloat *) 0 + 3);
 
-        /* Enable the attributes */
-        glEnableVertexAttribArray(0);
-        glEnableVertexAttribArray(1);
+        /* Enable the attributes. They are left enabled for the next
+         * gear. */
+        gl_state_enable_attribs((1 << 0) | (1 << 1));
 
         /* Draw the triangle strips that comprise the gear */
         int n;
         for (n = 0; n < gear->nstrips; n++)
                 glDrawArrays(GL_TRIANGLE_STRIP, gear->strips[n].first,
                              gear->strips[n].count);
-
-        /* Disable the attributes */
-        glDisableVertexAttribArray(1);
-        glDisableVertexAttribArray(0);
 }
 
 /**
@@ -540,7 +545,7 @@ gears_draw(const GLfloat *view_matrix)
 
         memcpy(transform, view_matrix, sizeof(transform));
 
-        glClearColor(0.0, 0.0, 0.0, 1.0);
+        gl_state_clear_color(0.0, 0.0, 0.0, 1.0);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
         /* Translate and rotate the view */
@@ -570,6 +575,7 @@ redraw(struct gears_renderer *renderer)
         GLfloat view_matrix[16];
 
         /* First left eye.  */
+        GL_DEBUG_PUSH_GROUP("left eye");
         set_eye(renderer, 0);
 
         frustum(ProjectionMatrix, left, right, -asp, asp, 1.0, 1024.0);
@@ -577,8 +583,10 @@ redraw(struct gears_renderer *renderer)
         identity(view_matrix);
         translate(view_matrix, +0.5 * eyesep, 0.0, 0.0);
         gears_draw(view_matrix);
+        GL_DEBUG_POP_GROUP();
 
         /* Then right eye.  */
+        GL_DEBUG_PUSH_GROUP("right eye");
         set_eye(renderer, 1);
 
         frustum(ProjectionMatrix, -right, -left, -asp, asp, 1.0, 1024.0);
@@ -586,6 +594,7 @@ redraw(struct gears_renderer *renderer)
         identity(view_matrix);
         translate(view_matrix, -0.5 * eyesep, 0.0, 0.0);
         gears_draw(view_matrix);
+        GL_DEBUG_POP_GROUP();
 }
 
 /**
@@ -606,34 +615,42 @@ gears_reshape(int width, int height)
         right = 5.0 * ((w + 0.5 * eyesep) / fix_point);
 
         /* Set the viewport */
-        glViewport(0, 0, (GLint) width, (GLint) height);
+        gl_state_viewport(0, 0, (GLint) width, (GLint) height);
 }
 
+/* Returns the milliseconds since the first frame. The animation uses
+ * the time the frame will be shown at if the winsys can predict it,
+ * otherwise the current time. */
 static int
-get_elapsed_time(void)
+get_elapsed_time(uint64_t present_time)
 {
-        static int start_time = 0;
-        int now;
-        struct timeval tv;
+        static uint64_t start_time = 0;
+        uint64_t now;
+        struct timespec ts;
 
-        gettimeofday(&tv, NULL);
-
-        now = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+        if (present_time) {
+                now = present_time;
+        } else {
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                now = ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+        }
 
         if (start_time == 0) {
                 start_time = now;
                 return 0;
+        } else if (now < start_time) {
+                return 0;
         } else {
-                return now - start_time;
+                return (now - start_time) / 1000000;
         }
 }
 
 static void
-gears_idle(void)
+gears_idle(uint64_t present_time)
 {
         static int frames = 0;
         static double tRot0 = -1.0, tRate0 = -1.0;
-        double dt, t = get_elapsed_time() / 1000.0;
+        double dt, t = get_elapsed_time(present_time) / 1000.0;
 
         if (tRot0 < 0.0)
                 tRot0 = t;
@@ -661,22 +678,36 @@ gears_idle(void)
         }
 }
 
+/* The shaders are built with feature flags prepended as #defines.
+ * PER_FRAGMENT_LIGHTING moves the lighting calculation to the
+ * fragment shader and FRAG_PRECISION sets the default float precision
+ * of the fragment shader. There is no multiview flag because the eye
+ * is picked with glDrawBuffersIndexedEXT before each pass, so both
+ * eyes run the same shader and nothing in it depends on the view. */
 static const char vertex_shader[] =
         "attribute vec3 position;\n"
         "attribute vec3 normal;\n"
         "\n"
         "uniform mat4 ModelViewProjectionMatrix;\n"
         "uniform mat4 NormalMatrix;\n"
+        "\n"
+        "#ifdef PER_FRAGMENT_LIGHTING\n"
+        "varying vec3 Normal;\n"
+        "#else\n"
         "uniform vec4 LightSourcePosition;\n"
         "uniform vec4 MaterialColor;\n"
         "\n"
         "varying vec4 Color;\n"
+        "#endif\n"
         "\n"
         "void main(void)\n"
         "{\n"
         "    // Transform the normal to eye coordinates\n"
         "    vec3 N = normalize(vec3(NormalMatrix * vec4(normal, 1.0)));\n"
         "\n"
+        "#ifdef PER_FRAGMENT_LIGHTING\n"
+        "    Normal = N;\n"
+        "#else\n"
         "    // The LightSourcePosition is actually its direction\n"
         "    // for directional light\n"
         "    vec3 L = normalize(LightSourcePosition.xyz);\n"
@@ -686,59 +717,97 @@ static const char vertex_shader[] =
         "    // use to draw this vertex with\n"
         "    float diffuse = max(dot(N, L), 0.0);\n"
         "    Color = vec4(diffuse * MaterialColor.rgb, 1.0);\n"
+        "#endif\n"
         "\n"
         "    // Transform the position to clip coordinates\n"
         "    gl_Position = ModelViewProjectionMatrix * vec4(position, 1.0);\n"
         "}";
 
 static const char fragment_shader[] =
-        "precision mediump float;\n"
+        "#ifndef FRAG_PRECISION\n"
+        "#define FRAG_PRECISION mediump\n"
+        "#endif\n"
+        "precision FRAG_PRECISION float;\n"
+        "\n"
+        "#ifdef PER_FRAGMENT_LIGHTING\n"
+        "uniform vec4 LightSourcePosition;\n"
+        "uniform vec4 MaterialColor;\n"
+        "\n"
+        "varying vec3 Normal;\n"
+        "#else\n"
         "varying vec4 Color;\n"
+        "#endif\n"
         "\n"
         "void main(void)\n"
         "{\n"
+        "#ifdef PER_FRAGMENT_LIGHTING\n"
+        "    vec3 N = normalize(Normal);\n"
+        "    vec3 L = normalize(LightSourcePosition.xyz);\n"
+        "    float diffuse = max(dot(N, L), 0.0);\n"
+        "    gl_FragColor = vec4(diffuse * MaterialColor.rgb, 1.0);\n"
+        "#else\n"
         "    gl_FragColor = Color;\n"
+        "#endif\n"
         "}";
 
+/**
+ * Picks the cheapest fragment shader precision that is good enough
+ * for the chosen lighting model on this device.
+ *
+ * @param per_fragment_lighting whether the fragment shader does the
+ *        lighting
+ * @return the #define for the precision
+ */
+static const char *
+get_precision_define(int per_fragment_lighting)
+{
+        GLint range[2], precision;
+
+        /* The interpolated color alone is fine at low precision */
+        if (!per_fragment_lighting)
+                return "FRAG_PRECISION lowp";
+
+        /* The lighting needs more than the 10 bits that GLES2
+         * guarantees for mediump. Some GPUs only give mediump that
+         * minimum so highp is used instead if it is available. */
+        glGetShaderPrecisionFormat(GL_FRAGMENT_SHADER,
+                                   GL_MEDIUM_FLOAT,
+                                   range,
+                                   &precision);
+        if (precision > 10)
+                return "FRAG_PRECISION mediump";
+
+        glGetShaderPrecisionFormat(GL_FRAGMENT_SHADER,
+                                   GL_HIGH_FLOAT,
+                                   range,
+                                   &precision);
+        if (precision > 0)
+                return "FRAG_PRECISION highp";
+
+        return "FRAG_PRECISION mediump";
+}
+
 static void
 gears_init(void)
 {
-        GLuint v, f, program;
-        const char *p;
-        char msg[512];
-
-        glEnable(GL_CULL_FACE);
-        glEnable(GL_DEPTH_TEST);
-
-        /* Compile the vertex shader */
-        p = vertex_shader;
-        v = glCreateShader(GL_VERTEX_SHADER);
-        glShaderSource(v, 1, &p, NULL);
-        glCompileShader(v);
-        glGetShaderInfoLog(v, sizeof msg, NULL, msg);
-        printf("vertex shader info: %s\n", msg);
-
-        /* Compile the fragment shader */
-        p = fragment_shader;
-        f = glCreateShader(GL_FRAGMENT_SHADER);
-        glShaderSource(f, 1, &p, NULL);
-        glCompileShader(f);
-        glGetShaderInfoLog(f, sizeof msg, NULL, msg);
-        printf("fragment shader info: %s\n", msg);
-
-        /* Create and link the shader program */
-        program = glCreateProgram();
-        glAttachShader(program, v);
-        glAttachShader(program, f);
-        glBindAttribLocation(program, 0, "position");
-        glBindAttribLocation(program, 1, "normal");
-
-        glLinkProgram(program);
-        glGetProgramInfoLog(program, sizeof msg, NULL, msg);
-        printf("info: %s\n", msg);
+        gl_state_set_enabled(GL_CULL_FACE, 1);
+        gl_state_set_enabled(GL_DEPTH_TEST, 1);
 
+        /* make the gears */
+        gear1 = create_gear(1.0, 4.0, 1.0, 20, 0.7);
+        gear2 = create_gear(0.5, 2.0, 2.0, 10, 0.7);
+        gear3 = create_gear(1.3, 2.0, 0.5, 10, 0.7);
+
+        GL_DEBUG_LABEL(GL_BUFFER_KHR, gear1->vbo, "gear 1");
+        GL_DEBUG_LABEL(GL_BUFFER_KHR, gear2->vbo, "gear 2");
+        GL_DEBUG_LABEL(GL_BUFFER_KHR, gear3->vbo, "gear 3");
+}
+
+static void
+gears_init_program(GLuint program)
+{
         /* Enable the shaders */
-        glUseProgram(program);
+        gl_state_use_program(program);
 
         /* Get the locations of the uniforms so we can access them */
         ModelViewProjectionMatrix_location =
@@ -751,17 +820,54 @@ gears_init(void)
         /* Set the LightSourcePosition uniform which is constant
          * throught the program */
         glUniform4fv(LightSourcePosition_location, 1, LightSourcePosition);
+}
 
-        /* make the gears */
-        gear1 = create_gear(1.0, 4.0, 1.0, 20, 0.7);
-        gear2 = create_gear(0.5, 2.0, 2.0, 10, 0.7);
-        gear3 = create_gear(1.3, 2.0, 0.5, 10, 0.7);
+/**
+ * Waits for the pending program and sets it up for drawing.
+ *
+ * @return 1 if the program can be used for drawing
+ */
+static int
+gears_finish_program(struct gears_renderer *renderer)
+{
+        renderer->program = finish_program(renderer->pending_program);
+        renderer->pending_program = NULL;
+
+        if (renderer->program == 0)
+                return 0;
+
+        GL_DEBUG_LABEL(GL_PROGRAM_KHR, renderer->program, "gears");
+
+        gears_init_program(renderer->program);
+
+        return 1;
+}
+
+/**
+ * Checks whether the program has finished building.
+ *
+ * @return 1 if the program can be used for drawing
+ */
+static int
+gears_program_ready(struct gears_renderer *renderer)
+{
+        if (renderer->pending_program == NULL)
+                return renderer->program != 0;
+
+        if (!pending_program_is_ready(renderer->pending_program))
+                return 0;
+
+        return gears_finish_program(renderer);
 }
 
 static void *
 gears_renderer_new(void)
 {
-        return xmalloc(sizeof (struct gears_renderer));
+        struct gears_renderer *renderer = xmalloc(sizeof *renderer);
+
+        memset(renderer, 0, sizeof *renderer);
+
+        return renderer;
 }
 
 static int
@@ -769,6 +875,8 @@ gears_renderer_connect(void *data)
 {
         struct gears_renderer *renderer = data;
         const char *exts = (const char *)glGetString(GL_EXTENSIONS);
+        const char *defines[3];
+        int n_defines = 0;
 
         if (!extension_in_list("GL_EXT_multiview_draw_buffers", exts)) {
                 fprintf(stderr,
@@ -779,6 +887,21 @@ gears_renderer_connect(void *data)
         renderer->draw_buffers_indexed =
                 (void *)eglGetProcAddress("glDrawBuffersIndexedEXT");
 
+        defines[n_defines++] =
+                get_precision_define(renderer->per_fragment_lighting);
+        if (renderer->per_fragment_lighting)
+                defines[n_defines++] = "PER_FRAGMENT_LIGHTING";
+        defines[n_defines] = NULL;
+
+        /* Start building the program first so that the compile
+         * overlaps with creating the gears */
+        renderer->pending_program = submit_program(defines,
+                                                   vertex_shader,
+                                                   fragment_shader,
+                                                   "position",
+                                                   "normal",
+                                                   NULL);
+
         gears_init();
 
         return 0;
@@ -786,11 +909,24 @@ gears_renderer_connect(void *data)
 
 static void
 gears_renderer_draw_frame(void *data,
-                          int frame_num)
+                          int frame_num,
+                          uint64_t present_time)
 {
         struct gears_renderer *renderer = data;
+        int eye;
+
+        /* Until the program is ready the frames are just cleared so
+         * that presenting and modesetting can carry on meanwhile */
+        if (!gears_program_ready(renderer)) {
+                for (eye = 0; eye < 2; eye++) {
+                        set_eye(renderer, eye);
+                        gl_state_clear_color(0.0, 0.0, 0.0, 1.0);
+                        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                }
+                return;
+        }
 
-        gears_idle();
+        gears_idle(present_time);
         redraw(renderer);
 }
 
@@ -801,19 +937,53 @@ gears_renderer_resize(void *data,
         gears_reshape(width, height);
 }
 
+static int
+gears_renderer_handle_option(void *data, int opt)
+{
+        struct gears_renderer *renderer = data;
+
+        switch (opt) {
+        case 'f':
+                renderer->per_fragment_lighting = 1;
+                return 1;
+        }
+
+        return 0;
+}
+
+static void
+gears_renderer_finish_loading(void *data)
+{
+        struct gears_renderer *renderer = data;
+
+        if (renderer->pending_program)
+                gears_finish_program(renderer);
+}
+
 static void
 gears_renderer_free(void *data)
 {
         struct gears_renderer *renderer = data;
 
+        if (renderer->pending_program)
+                renderer->program =
+                        finish_program(renderer->pending_program);
+        if (renderer->program)
+                glDeleteProgram(renderer->program);
+
         free(renderer);
 }
 
 const struct stereo_renderer gears_renderer = {
         .name = "gears",
+        .options = "f",
+        .options_desc =
+        "  -f              Light the gears per fragment\n",
         .new = gears_renderer_new,
+        .handle_option = gears_renderer_handle_option,
         .connect = gears_renderer_connect,
         .draw_frame = gears_renderer_draw_frame,
         .resize = gears_renderer_resize,
         .free = gears_renderer_free,
+        .finish_loading = gears_renderer_finish_loading,
 };
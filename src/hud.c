@@ -0,0 +1,136 @@
+/*
+ * Stereoscopic cube example
+ *
+ * Written 2013 by Neil Roberts <neil@linux.intel.com>
+ * Dedicated to the Public Domain.
+ */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <string.h>
+
+#include "hud.h"
+
+/* Each glyph is 5x7 pixels. Each row is a byte with the leftmost
+ * pixel in bit 4. The glyphs are drawn at twice the size. */
+#define GLYPH_WIDTH 5
+#define GLYPH_HEIGHT 7
+#define GLYPH_SCALE 2
+
+static const char glyph_chars[] =
+        " %-./0123456789:ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+static const uint8_t glyphs[][GLYPH_HEIGHT] = {
+        /* space */ { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+        /* % */ { 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03 },
+        /* - */ { 0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00 },
+        /* . */ { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c },
+        /* / */ { 0x01, 0x02, 0x02, 0x04, 0x08, 0x08, 0x10 },
+        /* 0 */ { 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e },
+        /* 1 */ { 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e },
+        /* 2 */ { 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f },
+        /* 3 */ { 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e },
+        /* 4 */ { 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02 },
+        /* 5 */ { 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e },
+        /* 6 */ { 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e },
+        /* 7 */ { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 },
+        /* 8 */ { 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e },
+        /* 9 */ { 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c },
+        /* : */ { 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00 },
+        /* A */ { 0x0e, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 },
+        /* B */ { 0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e },
+        /* C */ { 0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e },
+        /* D */ { 0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c },
+        /* E */ { 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f },
+        /* F */ { 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10 },
+        /* G */ { 0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f },
+        /* H */ { 0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 },
+        /* I */ { 0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e },
+        /* J */ { 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c },
+        /* K */ { 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 },
+        /* L */ { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f },
+        /* M */ { 0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11 },
+        /* N */ { 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 },
+        /* O */ { 0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e },
+        /* P */ { 0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10 },
+        /* Q */ { 0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d },
+        /* R */ { 0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11 },
+        /* S */ { 0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e },
+        /* T */ { 0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 },
+        /* U */ { 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e },
+        /* V */ { 0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04 },
+        /* W */ { 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a },
+        /* X */ { 0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11 },
+        /* Y */ { 0x11, 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04 },
+        /* Z */ { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f },
+};
+
+static const uint8_t *
+get_glyph(char ch)
+{
+        const char *p;
+
+        /* strchr() would match the terminator */
+        if (ch == '\0')
+                return glyphs[0];
+
+        p = strchr(glyph_chars, toupper((unsigned char) ch));
+
+        return glyphs[p ? p - glyph_chars : 0];
+}
+
+static void
+draw_glyph(uint32_t *pixels,
+           int stride,
+           int x, int y,
+           const uint8_t *glyph,
+           uint32_t color)
+{
+        uint32_t *row;
+        int gx, gy, sx, sy;
+
+        for (gy = 0; gy < GLYPH_HEIGHT; gy++) {
+                for (sy = 0; sy < GLYPH_SCALE; sy++) {
+                        row = pixels + (y + gy * GLYPH_SCALE + sy) * stride + x;
+
+                        for (gx = 0; gx < GLYPH_WIDTH; gx++) {
+                                if (!(glyph[gy] & (0x10 >> gx)))
+                                        continue;
+                                for (sx = 0; sx < GLYPH_SCALE; sx++)
+                                        row[gx * GLYPH_SCALE + sx] = color;
+                        }
+                }
+        }
+}
+
+void
+hud_draw_text(uint32_t *pixels,
+              int stride,
+              int width, int height,
+              int x, int y,
+              const char *text,
+              uint32_t color)
+{
+        int cx = x;
+
+        for (; *text; text++) {
+                if (*text == '\n') {
+                        cx = x;
+                        y += HUD_CHAR_HEIGHT;
+                        continue;
+                }
+
+                /* The glyph is centred in its cell */
+                if (cx >= 0 && cx + HUD_CHAR_WIDTH <= width &&
+                    y >= 0 && y + HUD_CHAR_HEIGHT <= height)
+                        draw_glyph(pixels,
+                                   stride,
+                                   cx + 1,
+                                   y + 1,
+                                   get_glyph(*text),
+                                   color);
+
+                cx += HUD_CHAR_WIDTH;
+        }
+}
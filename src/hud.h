@@ -0,0 +1,30 @@
+/*
+ * Stereoscopic cube example
+ *
+ * Written 2013 by Neil Roberts <neil@linux.intel.com>
+ * Dedicated to the Public Domain.
+ */
+
+#ifndef HUD_H
+#define HUD_H
+
+#include <stdint.h>
+
+/* The size of each character cell drawn by hud_draw_text() */
+#define HUD_CHAR_WIDTH 12
+#define HUD_CHAR_HEIGHT 16
+
+/* Draws text into a width×height image of 32-bit pixels with a
+ * small built-in bitmap font. stride is in pixels. '\n' starts a new
+ * line. Characters that don't fit entirely are skipped. Only digits,
+ * letters and a few punctuation characters have glyphs. Lower case
+ * letters are drawn as upper case and anything else as a space. */
+void
+hud_draw_text(uint32_t *pixels,
+              int stride,
+              int width, int height,
+              int x, int y,
+              const char *text,
+              uint32_t color);
+
+#endif /* HUD_H */
@@ -10,22 +10,93 @@
 #include <GLES2/gl2.h>
 #include <GLES2/gl2ext.h>
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 
 #include "stereo-renderer.h"
+#include "frame-socket.h"
 #include "util.h"
 
+/* Size of the low-resolution proxy images that are shown while the
+ * full images are still being decoded */
+#define PROXY_SIZE 128
+
 struct image_renderer {
         GLuint program;
         GLuint textures[2];
 
         const char *image_names[2];
+
+        /* The full resolution images are decoded in a separate
+         * thread. Once it has finished and set full_ready, the
+         * pixbufs are uploaded on the next frame to replace the
+         * proxy textures. */
+        GThread *load_thread;
+        GdkPixbuf *full_pixbufs[2];
+        GError *load_errors[2];
+        gint full_ready;
+        /* The full images as decoded, before they were scaled to a
+         * power of two for the textures. These are kept until the
+         * renderer is freed in case the winsys asks for them to
+         * scan out directly. */
+        GdkPixbuf *original_pixbufs[2];
+
+        /* The times are reported when the draw of the frame that
+         * first shows the images is submitted. The swap and flip
+         * that put it on screen come after that. */
+        gint64 start_time;
+        int shown_first_frame;
+        /* Set when the full images were uploaded after the last
+         * frame so that the next one is the first to show them */
+        int report_full_quality;
+
+        /* Live frames received over a socket instead of images */
+        const char *socket_path;
+        struct live_source *live;
+};
+
+/* A received frame for one eye */
+struct live_slot {
+        struct frame_socket_header header;
+        int fd;
+};
+
+struct live_source {
+        int sock;
+
+        /* The newest frame for each eye whose other eye hasn't
+         * arrived yet */
+        struct live_slot pending[2];
+        /* The newest frame that both eyes have arrived for. Older
+         * frames are dropped as soon as a newer one is complete so
+         * a slow consumer never falls behind the producer. */
+        struct live_slot pair[2];
+        EGLImageKHR images[2];
+
+        int has_shown_sequence;
+        uint32_t shown_sequence;
+
+        PFNEGLCREATEIMAGEKHRPROC create_image;
+        PFNEGLDESTROYIMAGEKHRPROC destroy_image;
+        PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture;
 };
 
+#ifdef ENABLE_GL_DEBUG
+static const char *const texture_labels[] = {
+        "left image", "right image"
+};
+#endif
+
 static const char image_vertex_source[] =
         "attribute mediump vec2 pos;\n"
         "varying mediump vec2 tex_coord;\n"
@@ -66,19 +137,33 @@ next_p2 (int a)
         return rval;
 }
 
-static GLuint
-load_texture(const char *image_name, GError **error)
+/* Loads an image and scales it to a power of two. If original isn't
+ * NULL it gets a reference to the image before it was scaled. */
+static GdkPixbuf *
+load_pixbuf(const char *image_name,
+            int max_size,
+            GdkPixbuf **original,
+            GError **error)
 {
         GdkPixbuf *pixbuf;
         int width, height, p2_width, p2_height;
-        GLuint tex;
-        GLenum format;
 
-        pixbuf = gdk_pixbuf_new_from_file(image_name, error);
+        /* For the proxy images a scaled load is used. For JPEGs this
+         * lets libjpeg decode at a reduced size so it is much
+         * quicker than decoding the whole image. */
+        if (max_size > 0)
+                pixbuf = gdk_pixbuf_new_from_file_at_size(image_name,
+                                                          max_size,
+                                                          max_size,
+                                                          error);
+        else
+                pixbuf = gdk_pixbuf_new_from_file(image_name, error);
+
         if (pixbuf == NULL)
-                return 0;
+                return NULL;
 
-        format = gdk_pixbuf_get_has_alpha(pixbuf) ? GL_RGBA : GL_RGB;
+        if (original)
+                *original = g_object_ref(pixbuf);
 
         width = gdk_pixbuf_get_width(pixbuf);
         height = gdk_pixbuf_get_height(pixbuf);
@@ -93,16 +178,26 @@ load_texture(const char *image_name, GError **error)
                                                 GDK_INTERP_BILINEAR);
                 g_object_unref(pixbuf);
                 pixbuf = scaled_pixbuf;
-                width = p2_width;
-                height = p2_height;
         }
 
-        glGenTextures(1, &tex);
-        glBindTexture(GL_TEXTURE_2D, tex);
+        return pixbuf;
+}
+
+static void
+upload_texture(int unit, GLuint tex, GdkPixbuf *pixbuf)
+{
+        GLenum format;
+
+        format = gdk_pixbuf_get_has_alpha(pixbuf) ? GL_RGBA : GL_RGB;
+
+        GL_DEBUG_PUSH_GROUP("upload texture");
+
+        gl_state_bind_texture(unit, tex);
         glTexImage2D(GL_TEXTURE_2D,
                      0, /* level */
                      format, /* internal format */
-                     width, height,
+                     gdk_pixbuf_get_width(pixbuf),
+                     gdk_pixbuf_get_height(pixbuf),
                      0, /* border */
                      format,
                      GL_UNSIGNED_BYTE,
@@ -121,31 +216,486 @@ load_texture(const char *image_name, GError **error)
                         GL_CLAMP_TO_EDGE);
         glGenerateMipmap(GL_TEXTURE_2D);
 
-        g_object_unref(pixbuf);
-
-        return tex;
+        GL_DEBUG_POP_GROUP();
 }
 
-static int
-image_renderer_connect(void *data)
+static gpointer
+load_thread_func(gpointer data)
 {
         struct image_renderer *renderer = data;
+        int i;
+
+        for (i = 0; i < 2; i++)
+                renderer->full_pixbufs[i] =
+                        load_pixbuf(renderer->image_names[i],
+                                    0, /* max_size */
+                                    &renderer->original_pixbufs[i],
+                                    &renderer->load_errors[i]);
+
+        g_atomic_int_set(&renderer->full_ready, TRUE);
+
+        return NULL;
+}
+
+static void
+join_load_thread(struct image_renderer *renderer)
+{
+        int i;
+
+        if (renderer->load_thread) {
+                g_thread_join(renderer->load_thread);
+                renderer->load_thread = NULL;
+        }
+
+        g_atomic_int_set(&renderer->full_ready, FALSE);
+
+        for (i = 0; i < 2; i++) {
+                if (renderer->full_pixbufs[i]) {
+                        g_object_unref(renderer->full_pixbufs[i]);
+                        renderer->full_pixbufs[i] = NULL;
+                }
+                if (renderer->load_errors[i]) {
+                        g_error_free(renderer->load_errors[i]);
+                        renderer->load_errors[i] = NULL;
+                }
+        }
+}
+
+static void
+upload_full_textures(struct image_renderer *renderer)
+{
+        int n_failed = 0;
+        int i;
+
+        for (i = 0; i < 2; i++) {
+                if (renderer->full_pixbufs[i]) {
+                        upload_texture(i,
+                                       renderer->textures[i],
+                                       renderer->full_pixbufs[i]);
+                } else {
+                        fprintf(stderr,
+                                "%s: %s\n",
+                                renderer->image_names[i],
+                                renderer->load_errors[i]->message);
+                        n_failed++;
+                }
+        }
+
+        /* The proxy stays on screen for an eye that failed */
+        if (n_failed > 0)
+                fprintf(stderr,
+                        "full quality images failed to load, "
+                        "keeping the proxy images\n");
+        else
+                renderer->report_full_quality = 1;
+
+        join_load_thread(renderer);
+}
+
+static void
+clear_live_slot(struct live_slot *slot)
+{
+        if (slot->fd != -1) {
+                close(slot->fd);
+                slot->fd = -1;
+        }
+}
+
+static void
+free_live_source(struct live_source *live)
+{
+        int i;
+
+        for (i = 0; i < 2; i++) {
+                clear_live_slot(live->pending + i);
+                clear_live_slot(live->pair + i);
+                if (live->images[i] != EGL_NO_IMAGE_KHR)
+                        live->destroy_image(eglGetCurrentDisplay(),
+                                            live->images[i]);
+        }
+
+        if (live->sock != -1)
+                close(live->sock);
+
+        free(live);
+}
+
+static struct live_source *
+connect_live_source(const char *socket_path)
+{
+        struct live_source *live = xmalloc(sizeof *live);
         const char *exts = (const char *) glGetString(GL_EXTENSIONS);
-        PFNGLDRAWBUFFERSINDEXEDEXTPROC draw_buffers_indexed;
-        static const GLenum locations[] =
-                { GL_MULTIVIEW_EXT, GL_MULTIVIEW_EXT };
-        static const GLint indices[] = { 0, 1 };
-        GLuint tex_location;
+        const char *egl_exts = eglQueryString(eglGetCurrentDisplay(),
+                                              EGL_EXTENSIONS);
+        struct sockaddr_un addr;
         int i;
 
-        if (!extension_in_list("GL_EXT_multiview_draw_buffers", exts)) {
+        memset(live, 0, sizeof *live);
+
+        for (i = 0; i < 2; i++) {
+                live->pending[i].fd = -1;
+                live->pair[i].fd = -1;
+                live->images[i] = EGL_NO_IMAGE_KHR;
+        }
+
+        /* dma-bufs can only be used if they can be imported as an
+         * EGLImage. Otherwise only memfds are accepted. */
+        if (extension_in_list("EGL_EXT_image_dma_buf_import", egl_exts) &&
+            extension_in_list("GL_OES_EGL_image", exts)) {
+                live->create_image =
+                        (void *) eglGetProcAddress("eglCreateImageKHR");
+                live->destroy_image =
+                        (void *) eglGetProcAddress("eglDestroyImageKHR");
+                live->image_target_texture =
+                        (void *) eglGetProcAddress("glEGLImageTarget"
+                                                   "Texture2DOES");
+        }
+
+        if (strlen(socket_path) >= sizeof addr.sun_path) {
+                fprintf(stderr, "%s: socket path too long\n", socket_path);
+                goto error;
+        }
+
+        memset(&addr, 0, sizeof addr);
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, socket_path);
+
+        live->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (live->sock == -1) {
+                fprintf(stderr, "socket: %m\n");
+                goto error;
+        }
+
+        if (connect(live->sock, (struct sockaddr *) &addr, sizeof addr)) {
+                fprintf(stderr, "%s: %m\n", socket_path);
+                goto error;
+        }
+
+        return live;
+
+error:
+        free_live_source(live);
+        return NULL;
+}
+
+/* Checks that a memfd frame lies within its buffer so that uploading
+ * it can't fault. Returns the size to map, or 0 if the frame is
+ * invalid. */
+static size_t
+get_memfd_frame_size(const struct frame_socket_header *header, int fd)
+{
+        GLint max_size;
+        uint64_t size;
+        struct stat st;
+
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+
+        if (header->width == 0 || header->height == 0 ||
+            header->width > (uint32_t) max_size ||
+            header->height > (uint32_t) max_size) {
+                fprintf(stderr, "invalid size in live frame\n");
+                return 0;
+        }
+
+        if (header->stride < (uint64_t) header->width * 4) {
+                fprintf(stderr, "invalid stride in live frame\n");
+                return 0;
+        }
+
+        /* This can't overflow because all of the fields are 32-bit */
+        size = header->offset + (uint64_t) header->stride * header->height;
+
+        if (fstat(fd, &st) == -1 ||
+            st.st_size < 0 ||
+            (uint64_t) st.st_size < size ||
+            size > SIZE_MAX) {
+                fprintf(stderr, "live frame is bigger than its buffer\n");
+                return 0;
+        }
+
+        return size;
+}
+
+static int
+upload_memfd_frame(const struct frame_socket_header *header, int fd)
+{
+        size_t size;
+        const uint8_t *data;
+        int y;
+
+        size = get_memfd_frame_size(header, fd);
+        if (size == 0)
+                return -EINVAL;
+
+        data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+                fprintf(stderr, "failed to map live frame: %m\n");
+                return -errno;
+        }
+
+        glTexImage2D(GL_TEXTURE_2D,
+                     0, /* level */
+                     GL_RGBA, /* internal format */
+                     header->width, header->height,
+                     0, /* border */
+                     GL_RGBA,
+                     GL_UNSIGNED_BYTE,
+                     header->stride == header->width * 4 ?
+                     data + header->offset :
+                     NULL);
+
+        /* GLES2 has no GL_UNPACK_ROW_LENGTH so padded rows have to
+         * be uploaded one at a time */
+        if (header->stride != header->width * 4) {
+                for (y = 0; y < header->height; y++) {
+                        glTexSubImage2D(GL_TEXTURE_2D,
+                                        0, /* level */
+                                        0, y,
+                                        header->width, 1,
+                                        GL_RGBA,
+                                        GL_UNSIGNED_BYTE,
+                                        data + header->offset +
+                                        y * header->stride);
+                }
+        }
+
+        munmap((void *) data, size);
+
+        return 0;
+}
+
+static int
+import_dma_buf_frame(struct live_source *live,
+                     int eye,
+                     const struct frame_socket_header *header,
+                     int fd)
+{
+        EGLDisplay edpy = eglGetCurrentDisplay();
+        const EGLint attribs[] = {
+                EGL_WIDTH, header->width,
+                EGL_HEIGHT, header->height,
+                EGL_LINUX_DRM_FOURCC_EXT, header->format,
+                EGL_DMA_BUF_PLANE0_FD_EXT, fd,
+                EGL_DMA_BUF_PLANE0_OFFSET_EXT, header->offset,
+                EGL_DMA_BUF_PLANE0_PITCH_EXT, header->stride,
+                EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT,
+                header->modifier & 0xffffffff,
+                EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT,
+                header->modifier >> 32,
+                EGL_NONE
+        };
+        EGLImageKHR image;
+
+        if (live->create_image == NULL) {
+                fprintf(stderr, "dma-buf frames are not supported\n");
+                return -ENOTSUP;
+        }
+
+        image = live->create_image(edpy,
+                                   EGL_NO_CONTEXT,
+                                   EGL_LINUX_DMA_BUF_EXT,
+                                   NULL,
+                                   attribs);
+        if (image == EGL_NO_IMAGE_KHR) {
+                fprintf(stderr, "failed to import dma-buf frame\n");
+                return -EINVAL;
+        }
+
+        live->image_target_texture(GL_TEXTURE_2D, image);
+
+        if (live->images[eye] != EGL_NO_IMAGE_KHR)
+                live->destroy_image(edpy, live->images[eye]);
+        live->images[eye] = image;
+
+        return 0;
+}
+
+static void
+show_live_slot(struct image_renderer *renderer, int eye)
+{
+        struct live_source *live = renderer->live;
+        struct live_slot *slot = live->pair + eye;
+
+        GL_DEBUG_PUSH_GROUP("upload live frame");
+
+        gl_state_bind_texture(eye, renderer->textures[eye]);
+
+        switch (slot->header.buffer_type) {
+        case FRAME_SOCKET_BUFFER_MEMFD:
+                /* The texture no longer refers to a previously
+                 * imported dma-buf once it has new storage */
+                upload_memfd_frame(&slot->header, slot->fd);
+                if (live->images[eye] != EGL_NO_IMAGE_KHR) {
+                        live->destroy_image(eglGetCurrentDisplay(),
+                                            live->images[eye]);
+                        live->images[eye] = EGL_NO_IMAGE_KHR;
+                }
+                break;
+        case FRAME_SOCKET_BUFFER_DMA_BUF:
+                import_dma_buf_frame(live, eye, &slot->header, slot->fd);
+                break;
+        default:
                 fprintf(stderr,
-                        "missing GL_EXT_multiview_draw_buffers extension\n");
+                        "unknown live buffer type %i\n",
+                        slot->header.buffer_type);
+                break;
+        }
+
+        clear_live_slot(slot);
+
+        GL_DEBUG_POP_GROUP();
+}
+
+/* Compares sequence numbers allowing for them to wrap around */
+static int
+sequence_is_newer(uint32_t a, uint32_t b)
+{
+        return (int32_t) (a - b) > 0;
+}
+
+/* Returns whether a frame with the sequence number would be older
+ * than what is already complete or shown */
+static int
+is_stale_sequence(struct live_source *live, uint32_t sequence)
+{
+        if (live->pair[0].fd != -1 &&
+            !sequence_is_newer(sequence, live->pair[0].header.sequence))
+                return 1;
+
+        return (live->has_shown_sequence &&
+                !sequence_is_newer(sequence, live->shown_sequence));
+}
+
+/* Takes ownership of a received frame. When it completes a pair with
+ * the other eye the pair replaces any older complete pair. */
+static void
+add_live_frame(struct live_source *live,
+               const struct frame_socket_header *header,
+               int fd)
+{
+        int eye = header->eye;
+        struct live_slot *other = live->pending + !eye;
+        int i;
+
+        if (is_stale_sequence(live, header->sequence)) {
+                close(fd);
+                return;
+        }
+
+        if (other->fd != -1 && other->header.sequence == header->sequence) {
+                for (i = 0; i < 2; i++)
+                        clear_live_slot(live->pair + i);
+
+                live->pair[!eye] = *other;
+                other->fd = -1;
+                live->pair[eye].header = *header;
+                live->pair[eye].fd = fd;
+
+                /* A pending frame for this eye can only be older */
+                clear_live_slot(live->pending + eye);
+                return;
+        }
+
+        clear_live_slot(live->pending + eye);
+        live->pending[eye].header = *header;
+        live->pending[eye].fd = fd;
+}
+
+static void
+update_live_source(struct image_renderer *renderer)
+{
+        struct live_source *live = renderer->live;
+        struct frame_socket_header header;
+        int fd, ret;
+
+        if (live->sock == -1)
+                return;
+
+        /* Drain everything that is queued on the socket, keeping only
+         * the newest complete pair */
+        while ((ret = frame_socket_receive(live->sock, &header, &fd)) > 0) {
+                if (header.eye > 1) {
+                        close(fd);
+                        continue;
+                }
+
+                add_live_frame(live, &header, fd);
+        }
+
+        if (ret < 0) {
+                if (ret == -EPIPE)
+                        fprintf(stderr, "live frame source disconnected\n");
+                else
+                        fprintf(stderr,
+                                "error receiving live frame: %s\n",
+                                strerror(-ret));
+                close(live->sock);
+                live->sock = -1;
+        }
+
+        if (live->pair[0].fd == -1)
+                return;
+
+        show_live_slot(renderer, 0);
+        show_live_slot(renderer, 1);
+
+        live->shown_sequence = live->pair[0].header.sequence;
+        live->has_shown_sequence = 1;
+}
+
+static int
+load_live_textures(struct image_renderer *renderer)
+{
+        static const uint8_t black[] = { 0, 0, 0, 0xff };
+        int i;
+
+        renderer->live = connect_live_source(renderer->socket_path);
+        if (renderer->live == NULL)
                 return -ENOENT;
+
+        /* Frames can be any size so mipmapping is not used */
+        for (i = 0; i < 2; i++) {
+                glGenTextures(1, renderer->textures + i);
+                gl_state_bind_texture(i, renderer->textures[i]);
+                GL_DEBUG_LABEL(GL_TEXTURE, renderer->textures[i],
+                               texture_labels[i]);
+                glTexImage2D(GL_TEXTURE_2D,
+                             0, /* level */
+                             GL_RGBA, /* internal format */
+                             1, 1,
+                             0, /* border */
+                             GL_RGBA,
+                             GL_UNSIGNED_BYTE,
+                             black);
+                glTexParameteri(GL_TEXTURE_2D,
+                                GL_TEXTURE_MIN_FILTER,
+                                GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D,
+                                GL_TEXTURE_MAG_FILTER,
+                                GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D,
+                                GL_TEXTURE_WRAP_S,
+                                GL_CLAMP_TO_EDGE);
+                glTexParameteri(GL_TEXTURE_2D,
+                                GL_TEXTURE_WRAP_T,
+                                GL_CLAMP_TO_EDGE);
         }
 
+        return 0;
+}
+
+static int
+load_image_textures(struct image_renderer *renderer)
+{
+        int i;
+
+        renderer->start_time = g_get_monotonic_time();
+
+        /* Load a small proxy of each image first so that something
+         * can be shown on the first frame */
         for (i = 0; i < 2; i++) {
                 GError *error = NULL;
+                GdkPixbuf *pixbuf;
 
                 if (renderer->image_names[i] == NULL) {
                         fprintf(stderr,
@@ -153,9 +703,11 @@ image_renderer_connect(void *data)
                                 i + '1');
                         return -ENOENT;
                 }
-                renderer->textures[i] = load_texture(renderer->image_names[i],
-                                                     &error);
-                if (renderer->textures[i] == 0) {
+                pixbuf = load_pixbuf(renderer->image_names[i],
+                                     PROXY_SIZE,
+                                     NULL, /* original */
+                                     &error);
+                if (pixbuf == NULL) {
                         fprintf(stderr,
                                 "%s: %s\n",
                                 renderer->image_names[i],
@@ -163,6 +715,57 @@ image_renderer_connect(void *data)
                         g_error_free(error);
                         return -ENOENT;
                 }
+
+                glGenTextures(1, renderer->textures + i);
+                upload_texture(i, renderer->textures[i], pixbuf);
+                GL_DEBUG_LABEL(GL_TEXTURE, renderer->textures[i],
+                               texture_labels[i]);
+                g_object_unref(pixbuf);
+        }
+
+        renderer->load_thread = g_thread_new("image-loader",
+                                             load_thread_func,
+                                             renderer);
+
+        return 0;
+}
+
+static int
+image_renderer_connect(void *data)
+{
+        struct image_renderer *renderer = data;
+        const char *exts = (const char *) glGetString(GL_EXTENSIONS);
+        PFNGLDRAWBUFFERSINDEXEDEXTPROC draw_buffers_indexed;
+        static const GLenum locations[] =
+                { GL_MULTIVIEW_EXT, GL_MULTIVIEW_EXT };
+        static const GLint indices[] = { 0, 1 };
+        struct pending_program *pending_program;
+        GLuint tex_location, program;
+        int i, ret;
+
+        if (!extension_in_list("GL_EXT_multiview_draw_buffers", exts)) {
+                fprintf(stderr,
+                        "missing GL_EXT_multiview_draw_buffers extension\n");
+                return -ENOENT;
+        }
+
+        /* Start building the program before decoding the proxy
+         * images so that the two overlap */
+        pending_program = submit_program(NULL, /* defines */
+                                         image_vertex_source,
+                                         image_fragment_source,
+                                         "pos",
+                                         NULL);
+
+        if (renderer->socket_path)
+                ret = load_live_textures(renderer);
+        else
+                ret = load_image_textures(renderer);
+        if (ret) {
+                program = finish_program(pending_program);
+                if (program)
+                        glDeleteProgram(program);
+                return ret;
         }
 
         draw_buffers_indexed =
@@ -170,27 +773,27 @@ image_renderer_connect(void *data)
 
         draw_buffers_indexed(2, locations, indices);
 
-        renderer->program = create_program(image_vertex_source,
-                                           image_fragment_source,
-                                           "pos",
-                                           NULL);
+        renderer->program = finish_program(pending_program);
+        if (renderer->program == 0)
+                return -ENOENT;
+
+        GL_DEBUG_LABEL(GL_PROGRAM_KHR, renderer->program, "image");
 
-        glUseProgram(renderer->program);
+        gl_state_use_program(renderer->program);
 
         tex_location = glGetUniformLocation(renderer->program, "tex");
         glUniform1iv(tex_location, 2, indices);
 
-        for (i = 0; i < 2; i++) {
-                glActiveTexture(GL_TEXTURE0 + i);
-                glBindTexture(GL_TEXTURE_2D, renderer->textures[i]);
-        }
+        for (i = 0; i < 2; i++)
+                gl_state_bind_texture(i, renderer->textures[i]);
 
         return 0;
 }
 
 static void
-image_renderer_draw_frame(void *data, int frame_num)
+image_renderer_draw_frame(void *data, int frame_num, uint64_t present_time)
 {
+        struct image_renderer *renderer = data;
         static const float vertices[] = {
                 0.0f, 0.0f,
                 1.0f, 0.0f,
@@ -198,22 +801,97 @@ image_renderer_draw_frame(void *data, int frame_num)
                 1.0f, 1.0f
         };
 
-        glVertexAttribPointer(0, /* index */
-                              2, /* size */
-                              GL_FLOAT,
-                              GL_FALSE, /* not normalized */
-                              sizeof(float) * 2,
-                              vertices);
-        glEnableVertexAttribArray(0);
+        if (renderer->live)
+                update_live_source(renderer);
+
+        /* Both eyes are drawn at once to separate draw buffers */
+        GL_DEBUG_PUSH_GROUP("both eyes");
+
+        gl_state_bind_buffer(GL_ARRAY_BUFFER, 0);
+        gl_state_vertex_attrib_pointer(0, /* index */
+                                       2, /* size */
+                                       GL_FLOAT,
+                                       GL_FALSE, /* not normalized */
+                                       sizeof(float) * 2,
+                                       vertices);
+        gl_state_enable_attribs(1 << 0);
         glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-        glDisableVertexAttribArray(0);
+
+        GL_DEBUG_POP_GROUP();
+
+        if (!renderer->shown_first_frame && renderer->live == NULL) {
+                printf("first frame submitted after %.1f ms\n",
+                       (g_get_monotonic_time() - renderer->start_time) /
+                       1000.0);
+                renderer->shown_first_frame = 1;
+        }
+
+        if (renderer->report_full_quality) {
+                printf("first full quality frame submitted after %.1f ms\n",
+                       (g_get_monotonic_time() - renderer->start_time) /
+                       1000.0);
+                renderer->report_full_quality = 0;
+        }
+
+        /* Replace the proxies once the full images are decoded. This
+         * takes effect from the next frame. */
+        if (g_atomic_int_get(&renderer->full_ready))
+                upload_full_textures(renderer);
+}
+
+static int
+image_renderer_get_static_images(void *data, struct stereo_image *images)
+{
+        struct image_renderer *renderer = data;
+        GdkPixbuf *pixbuf;
+        int i;
+
+        if (renderer->live)
+                return -ENOENT;
+
+        /* The images are only worth showing directly at full
+         * quality so this waits for them to be decoded. The thread
+         * sets full_ready so they are still uploaded on the next
+         * frame. The originals aren't freed by the upload so this
+         * also works after frames have been drawn. */
+        if (renderer->load_thread) {
+                g_thread_join(renderer->load_thread);
+                renderer->load_thread = NULL;
+        }
+
+        for (i = 0; i < 2; i++) {
+                pixbuf = renderer->original_pixbufs[i];
+                if (pixbuf == NULL)
+                        return -ENOENT;
+
+                images[i].width = gdk_pixbuf_get_width(pixbuf);
+                images[i].height = gdk_pixbuf_get_height(pixbuf);
+                images[i].rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+                images[i].n_channels = gdk_pixbuf_get_n_channels(pixbuf);
+                images[i].pixels = gdk_pixbuf_get_pixels(pixbuf);
+        }
+
+        return 0;
+}
+
+static void
+image_renderer_finish_loading(void *data)
+{
+        struct image_renderer *renderer = data;
+
+        /* The thread sets full_ready so the full images replace the
+         * proxies on the next frame */
+        if (renderer->load_thread) {
+                g_thread_join(renderer->load_thread);
+                renderer->load_thread = NULL;
+        }
 }
 
 static void
 image_renderer_resize(void *data,
                       int width, int height)
 {
-        glViewport(0, 0, width, height);
+        gl_state_viewport(0, 0, width, height);
 }
 
 static int
@@ -228,6 +906,9 @@ image_renderer_handle_option(void *data, int opt)
         case '2':
                 renderer->image_names[1] = optarg;
                 return 1;
+        case 's':
+                renderer->socket_path = optarg;
+                return 1;
         }
 
         return 0;
@@ -239,6 +920,15 @@ image_renderer_free(void *data)
         struct image_renderer *renderer = data;
         int i;
 
+        join_load_thread(renderer);
+
+        for (i = 0; i < 2; i++)
+                if (renderer->original_pixbufs[i])
+                        g_object_unref(renderer->original_pixbufs[i]);
+
+        if (renderer->live)
+                free_live_source(renderer->live);
+
         for (i = 0; i < 2; i++)
                 if (renderer->textures[i])
                         glDeleteTextures(1, renderer->textures + i);
@@ -251,14 +941,18 @@ image_renderer_free(void *data)
 
 const struct stereo_renderer image_renderer = {
         .name = "image",
-        .options = "1:2:",
+        .options = "1:2:s:",
         .options_desc =
         "  -1 <LEFT_IMG>   Set the left image file\n"
-        "  -2 <RIGHT_IMG>  Set the right image file\n",
+        "  -2 <RIGHT_IMG>  Set the right image file\n"
+        "  -s <SOCKET>     Show live frames from a socket instead of "
+        "images\n",
         .new = image_renderer_new,
         .handle_option = image_renderer_handle_option,
         .connect = image_renderer_connect,
         .draw_frame = image_renderer_draw_frame,
         .resize = image_renderer_resize,
         .free = image_renderer_free,
+        .get_static_images = image_renderer_get_static_images,
+        .finish_loading = image_renderer_finish_loading,
 };
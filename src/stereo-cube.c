@@ -25,6 +25,10 @@ struct stereo_cube {
         void *renderer_data;
 
         int frame_num;
+
+        /* Set with -S to print how many GL state changes were
+         * filtered by the state tracker */
+        int print_state_stats;
 };
 
 static void
@@ -37,7 +41,9 @@ usage(void)
                "  -h              Show this help message\n"
                "  -L              List available renderers\n"
                "  -r <RENDERER>   Select a renderer\n"
-               "  -w <WINSYS>     Pick a winsys\n");
+               "  -w <WINSYS>     Pick a winsys\n"
+               "  -S              Print GL state tracker statistics "
+               "on exit\n");
 
         for (i = 0; stereo_winsyss[i]; i++) {
                 if (stereo_winsyss[i]->options_desc) {
@@ -110,16 +116,61 @@ update_size(void *data,
 }
 
 static void
-draw(void *data)
+draw(void *data,
+     uint64_t present_time)
+{
+        struct stereo_cube *cube = data;
+
+        cube->renderer->draw_frame(cube->renderer_data,
+                                   cube->frame_num++,
+                                   present_time);
+
+        gl_state_end_frame();
+}
+
+static int
+get_static_images(void *data,
+                  struct stereo_image *images)
+{
+        struct stereo_cube *cube = data;
+
+        if (cube->renderer->get_static_images == NULL)
+                return -ENOENT;
+
+        return cube->renderer->get_static_images(cube->renderer_data,
+                                                 images);
+}
+
+static void
+finish_loading(void *data)
 {
         struct stereo_cube *cube = data;
 
-        cube->renderer->draw_frame(cube->renderer_data, cube->frame_num++);
+        if (cube->renderer->finish_loading)
+                cube->renderer->finish_loading(cube->renderer_data);
+}
+
+static void
+print_state_stats(void)
+{
+        struct gl_state_stats stats;
+
+        gl_state_get_stats(&stats);
+
+        if (stats.frames == 0 || stats.calls == 0)
+                return;
+
+        printf("GL state calls per frame: %.1f, filtered: %.1f (%.0f%%)\n",
+               stats.calls / (double) stats.frames,
+               stats.filtered / (double) stats.frames,
+               stats.filtered * 100.0 / stats.calls);
 }
 
 static struct stereo_winsys_callbacks winsys_callbacks = {
         .update_size = update_size,
         .draw = draw,
+        .get_static_images = get_static_images,
+        .finish_loading = finish_loading,
 };
 
 static void
@@ -140,7 +191,7 @@ create_renderer(struct stereo_cube *cube)
 static int
 process_options(struct stereo_cube *cube, int argc, char **argv)
 {
-        static const char default_args[] = "-hLr:w:";
+        static const char default_args[] = "-hLr:w:S";
         char args[256];
         int i, opt;
 
@@ -161,6 +212,9 @@ process_options(struct stereo_cube *cube, int argc, char **argv)
                 case 'L':
                         list_renderers();
                         break;
+                case 'S':
+                        cube->print_state_stats = 1;
+                        break;
                 case 'w':
                         if (cube->winsys_data) {
                                 fprintf(stderr,
@@ -244,6 +298,9 @@ main(int argc, char **argv)
 
         cube.winsys->main_loop(cube.winsys_data);
 
+        if (cube.print_state_stats)
+                print_state_stats();
+
 out:
         /* cleanup everything */
         if (cube.renderer_data)
@@ -0,0 +1,292 @@
+/*
+ * Stereoscopic cube example
+ *
+ * Written 2013 by Neil Roberts <neil@linux.intel.com>
+ * Dedicated to the Public Domain.
+ */
+
+/* Test producer for the live source of the image renderer. It
+ * listens on a socket and sends a stream of synthetic stereo frames
+ * in memfds to whoever connects. */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "frame-socket.h"
+
+struct feed_options {
+        const char *socket_path;
+        int width, height;
+        int fps;
+};
+
+static int quit = 0;
+
+static void
+usage(void)
+{
+        printf("usage: stereo-feed [OPTION]...\n"
+               "\n"
+               "  -h              Show this help message\n"
+               "  -s <SOCKET>     Listen on the given socket (default "
+               FRAME_SOCKET_DEFAULT_PATH ")\n"
+               "  -W <WIDTH>      Width of the frames\n"
+               "  -H <HEIGHT>     Height of the frames\n"
+               "  -f <FPS>        Number of frames to send per second\n");
+        exit(0);
+}
+
+static int
+process_options(struct feed_options *options, int argc, char **argv)
+{
+        int opt;
+
+        while ((opt = getopt(argc, argv, "-hs:W:H:f:")) != -1) {
+                switch (opt) {
+                case 'h':
+                        usage();
+                        break;
+                case 's':
+                        options->socket_path = optarg;
+                        break;
+                case 'W':
+                        options->width = atoi(optarg);
+                        break;
+                case 'H':
+                        options->height = atoi(optarg);
+                        break;
+                case 'f':
+                        options->fps = atoi(optarg);
+                        break;
+                case '\1':
+                        fprintf(stderr, "unexpected argument \"%s\"\n", optarg);
+                        return -ENOENT;
+                default:
+                        return -ENOENT;
+                }
+        }
+
+        if (options->width <= 0 || options->height <= 0 || options->fps <= 0) {
+                fprintf(stderr, "invalid frame size or rate\n");
+                return -EINVAL;
+        }
+
+        return 0;
+}
+
+static void
+draw_pattern(uint8_t *pixels,
+             const struct feed_options *options,
+             int eye,
+             int frame_num)
+{
+        int bar_width = options->width / 16 + 1;
+        /* The bar is offset horizontally between the two eyes so that
+         * it appears to float in front of the checkerboard */
+        int disparity = eye ? -bar_width / 2 : bar_width / 2;
+        int bar_x = (frame_num * 4 + disparity) % options->width;
+        uint8_t *p;
+        int x, y;
+
+        if (bar_x < 0)
+                bar_x += options->width;
+
+        for (y = 0; y < options->height; y++) {
+                p = pixels + y * options->width * 4;
+
+                for (x = 0; x < options->width; x++) {
+                        int dx = (x - bar_x + options->width) % options->width;
+
+                        if (dx < bar_width) {
+                                p[0] = eye ? 0x00 : 0xff;
+                                p[1] = 0x40;
+                                p[2] = eye ? 0xff : 0x00;
+                        } else if (((x / 32) ^ (y / 32)) & 1) {
+                                p[0] = p[1] = p[2] = 0xc0;
+                        } else {
+                                p[0] = p[1] = p[2] = 0x40;
+                        }
+                        p[3] = 0xff;
+                        p += 4;
+                }
+        }
+}
+
+static int
+send_eye(int sock,
+         const struct feed_options *options,
+         int eye,
+         int frame_num)
+{
+        struct frame_socket_header header;
+        size_t size = (size_t) options->width * options->height * 4;
+        uint8_t *pixels;
+        int fd, ret;
+
+        fd = memfd_create("stereo-feed", MFD_CLOEXEC);
+        if (fd == -1) {
+                fprintf(stderr, "memfd_create: %m\n");
+                return -errno;
+        }
+
+        if (ftruncate(fd, size) == -1) {
+                ret = -errno;
+                fprintf(stderr, "ftruncate: %m\n");
+                goto out;
+        }
+
+        pixels = mmap(NULL, size, PROT_WRITE, MAP_SHARED, fd, 0);
+        if (pixels == MAP_FAILED) {
+                ret = -errno;
+                fprintf(stderr, "mmap: %m\n");
+                goto out;
+        }
+
+        draw_pattern(pixels, options, eye, frame_num);
+
+        munmap(pixels, size);
+
+        memset(&header, 0, sizeof header);
+        header.sequence = frame_num;
+        header.eye = eye;
+        header.buffer_type = FRAME_SOCKET_BUFFER_MEMFD;
+        header.width = options->width;
+        header.height = options->height;
+        header.stride = options->width * 4;
+
+        ret = frame_socket_send(sock, &header, fd);
+
+out:
+        close(fd);
+        return ret;
+}
+
+static void
+send_frames(int sock, const struct feed_options *options)
+{
+        struct timespec next_frame;
+        long frame_ns = 1000000000L / options->fps;
+        int frame_num = 0;
+        int eye;
+
+        clock_gettime(CLOCK_MONOTONIC, &next_frame);
+
+        while (!quit) {
+                for (eye = 0; eye < 2; eye++) {
+                        if (send_eye(sock, options, eye, frame_num)) {
+                                printf("client disconnected\n");
+                                return;
+                        }
+                }
+
+                frame_num++;
+
+                next_frame.tv_nsec += frame_ns;
+                while (next_frame.tv_nsec >= 1000000000L) {
+                        next_frame.tv_nsec -= 1000000000L;
+                        next_frame.tv_sec++;
+                }
+
+                clock_nanosleep(CLOCK_MONOTONIC,
+                                TIMER_ABSTIME,
+                                &next_frame,
+                                NULL);
+        }
+}
+
+static int
+create_listen_socket(const char *socket_path)
+{
+        struct sockaddr_un addr;
+        int sock;
+
+        if (strlen(socket_path) >= sizeof addr.sun_path) {
+                fprintf(stderr, "%s: socket path too long\n", socket_path);
+                return -1;
+        }
+
+        memset(&addr, 0, sizeof addr);
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, socket_path);
+
+        sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (sock == -1) {
+                fprintf(stderr, "socket: %m\n");
+                return -1;
+        }
+
+        unlink(socket_path);
+
+        if (bind(sock, (struct sockaddr *) &addr, sizeof addr) == -1 ||
+            listen(sock, 1) == -1) {
+                fprintf(stderr, "%s: %m\n", socket_path);
+                close(sock);
+                return -1;
+        }
+
+        return sock;
+}
+
+static void
+sigint_handler(int sig)
+{
+        quit = 1;
+}
+
+int
+main(int argc, char **argv)
+{
+        struct feed_options options = {
+                .socket_path = FRAME_SOCKET_DEFAULT_PATH,
+                .width = 640,
+                .height = 480,
+                .fps = 30,
+        };
+        struct sigaction action = {
+                .sa_handler = sigint_handler,
+        };
+        int sock, client;
+
+        if (process_options(&options, argc, argv))
+                return EXIT_FAILURE;
+
+        sock = create_listen_socket(options.socket_path);
+        if (sock == -1)
+                return EXIT_FAILURE;
+
+        /* Don't restart accept() so that Ctrl+C can interrupt it */
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, NULL);
+
+        printf("waiting for a connection on %s\n", options.socket_path);
+
+        while (!quit) {
+                client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+                if (client == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        fprintf(stderr, "accept: %m\n");
+                        break;
+                }
+
+                printf("client connected\n");
+                send_frames(client, &options);
+                close(client);
+        }
+
+        close(sock);
+        unlink(options.socket_path);
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,342 @@
+/*
+ * Stereoscopic cube example
+ *
+ * Written 2013 by Neil Roberts <neil@linux.intel.com>
+ * Dedicated to the Public Domain.
+ */
+
+/* Test lessor for the GBM winsys. It leases a connector, a CRTC and
+ * the planes that can be used with it from a DRM device and runs a
+ * program with the lessee fd. The program can then modeset on the
+ * leased connector while the rest of the device stays with whoever
+ * else has it, for example a vkms device next to a running
+ * compositor. */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+struct lease_options {
+        const char *card;
+        /* The connector to lease, or 0 for the first connected one */
+        uint32_t connector;
+};
+
+static void
+usage(void)
+{
+        printf("usage: stereo-lease [OPTION]... PROGRAM [ARGUMENT]...\n"
+               "\n"
+               "Runs PROGRAM with \"-e FD\" added to its arguments where "
+               "FD is a DRM\n"
+               "lease of a single connector.\n"
+               "\n"
+               "  -h              Show this help message\n"
+               "  -d <DEV>        Lease from the given device (default "
+               "/dev/dri/card0)\n"
+               "  -c <CONNECTOR>  Lease the connector with this id instead "
+               "of the first\n"
+               "                  connected one\n");
+        exit(0);
+}
+
+static int
+process_options(struct lease_options *options, int argc, char **argv)
+{
+        int opt;
+
+        /* Stop at the program so that its options are left alone */
+        while ((opt = getopt(argc, argv, "+hd:c:")) != -1) {
+                switch (opt) {
+                case 'h':
+                        usage();
+                        break;
+                case 'd':
+                        options->card = optarg;
+                        break;
+                case 'c':
+                        options->connector = strtoul(optarg, NULL, 10);
+                        break;
+                default:
+                        return -ENOENT;
+                }
+        }
+
+        if (optind >= argc) {
+                fprintf(stderr, "no program to run\n");
+                return -EINVAL;
+        }
+
+        return 0;
+}
+
+static drmModeConnector *
+find_connector(int fd, drmModeRes *res, uint32_t connector_id)
+{
+        drmModeConnector *conn;
+        int i;
+
+        for (i = 0; i < res->count_connectors; i++) {
+                conn = drmModeGetConnector(fd, res->connectors[i]);
+                if (conn == NULL)
+                        continue;
+
+                if (connector_id ?
+                    conn->connector_id == connector_id :
+                    conn->connection == DRM_MODE_CONNECTED)
+                        return conn;
+
+                drmModeFreeConnector(conn);
+        }
+
+        if (connector_id)
+                fprintf(stderr, "connector %u not found\n", connector_id);
+        else
+                fprintf(stderr, "no connected connectors found\n");
+
+        return NULL;
+}
+
+/* Gets the index of a CRTC that can drive the connector, preferring
+ * the one that already does. Returns -1 if there isn't one. */
+static int
+find_crtc(int fd, drmModeRes *res, drmModeConnector *conn)
+{
+        drmModeEncoder *enc;
+        uint32_t possible_crtcs = 0;
+        uint32_t current_crtc = 0;
+        int i;
+
+        for (i = 0; i < conn->count_encoders; i++) {
+                enc = drmModeGetEncoder(fd, conn->encoders[i]);
+                if (enc == NULL)
+                        continue;
+
+                if (enc->encoder_id == conn->encoder_id)
+                        current_crtc = enc->crtc_id;
+                possible_crtcs |= enc->possible_crtcs;
+
+                drmModeFreeEncoder(enc);
+        }
+
+        for (i = 0; i < res->count_crtcs; i++) {
+                if (current_crtc && res->crtcs[i] == current_crtc)
+                        return i;
+        }
+
+        for (i = 0; i < res->count_crtcs; i++) {
+                if (possible_crtcs & (1 << i))
+                        return i;
+        }
+
+        return -1;
+}
+
+/* Adds the planes that can be used with the CRTC and aren't showing
+ * anything on another CRTC. This includes the overlays so that the
+ * HUD and direct scanout can be tried through the lease. */
+static void
+add_planes(int fd,
+           uint32_t crtc_id,
+           int crtc_index,
+           uint32_t *objects,
+           int *n_objects)
+{
+        drmModePlaneRes *plane_res;
+        drmModePlane *plane;
+        uint32_t i;
+
+        plane_res = drmModeGetPlaneResources(fd);
+        if (plane_res == NULL)
+                return;
+
+        for (i = 0; i < plane_res->count_planes; i++) {
+                plane = drmModeGetPlane(fd, plane_res->planes[i]);
+                if (plane == NULL)
+                        continue;
+
+                if ((plane->possible_crtcs & (1 << crtc_index)) &&
+                    (plane->crtc_id == 0 || plane->crtc_id == crtc_id))
+                        objects[(*n_objects)++] = plane->plane_id;
+
+                drmModeFreePlane(plane);
+        }
+
+        drmModeFreePlaneResources(plane_res);
+}
+
+/* Leases the connector with a CRTC and its planes. Returns the
+ * lessee fd, which is inherited by the program, or a negative errno
+ * value. */
+static int
+create_lease(int fd,
+             const struct lease_options *options,
+             uint32_t *lessee_id)
+{
+        drmModeConnector *conn = NULL;
+        drmModePlaneRes *plane_res;
+        drmModeRes *res;
+        uint32_t *objects = NULL;
+        int n_objects = 0;
+        int crtc_index;
+        int ret;
+
+        res = drmModeGetResources(fd);
+        if (res == NULL) {
+                fprintf(stderr, "cannot retrieve DRM resources: %m\n");
+                return -ENOENT;
+        }
+
+        conn = find_connector(fd, res, options->connector);
+        if (conn == NULL) {
+                ret = -ENOENT;
+                goto out;
+        }
+
+        crtc_index = find_crtc(fd, res, conn);
+        if (crtc_index == -1) {
+                fprintf(stderr,
+                        "no CRTC for connector %u\n",
+                        conn->connector_id);
+                ret = -ENOENT;
+                goto out;
+        }
+
+        plane_res = drmModeGetPlaneResources(fd);
+        objects = malloc((2 + (plane_res ? plane_res->count_planes : 0)) *
+                         sizeof *objects);
+        if (plane_res)
+                drmModeFreePlaneResources(plane_res);
+        if (objects == NULL) {
+                ret = -ENOMEM;
+                goto out;
+        }
+
+        objects[n_objects++] = conn->connector_id;
+        objects[n_objects++] = res->crtcs[crtc_index];
+        add_planes(fd,
+                   res->crtcs[crtc_index],
+                   crtc_index,
+                   objects,
+                   &n_objects);
+
+        /* Without O_CLOEXEC so that the program gets the fd */
+        ret = drmModeCreateLease(fd, objects, n_objects, 0, lessee_id);
+        if (ret < 0) {
+                errno = -ret;
+                fprintf(stderr, "cannot create lease: %m\n");
+                goto out;
+        }
+
+        printf("leased connector %u, CRTC %u and %i planes as lessee %u\n",
+               conn->connector_id,
+               res->crtcs[crtc_index],
+               n_objects - 2,
+               *lessee_id);
+
+out:
+        free(objects);
+        if (conn)
+                drmModeFreeConnector(conn);
+        drmModeFreeResources(res);
+
+        return ret;
+}
+
+static int
+run_program(int lease_fd, int argc, char **argv)
+{
+        char fd_arg[16];
+        char **args;
+        int status;
+        pid_t pid;
+        int i;
+
+        snprintf(fd_arg, sizeof fd_arg, "%i", lease_fd);
+
+        args = malloc((argc + 3) * sizeof *args);
+        if (args == NULL)
+                return EXIT_FAILURE;
+
+        for (i = 0; i < argc; i++)
+                args[i] = argv[i];
+        args[argc] = (char *) "-e";
+        args[argc + 1] = fd_arg;
+        args[argc + 2] = NULL;
+
+        pid = fork();
+        if (pid == -1) {
+                fprintf(stderr, "fork: %m\n");
+                free(args);
+                return EXIT_FAILURE;
+        }
+
+        if (pid == 0) {
+                execvp(args[0], args);
+                fprintf(stderr, "cannot run '%s': %m\n", args[0]);
+                _exit(127);
+        }
+
+        free(args);
+
+        /* The lease ends once the program has closed its copy */
+        close(lease_fd);
+
+        if (waitpid(pid, &status, 0) == -1) {
+                fprintf(stderr, "waitpid: %m\n");
+                return EXIT_FAILURE;
+        }
+
+        return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+int
+main(int argc, char **argv)
+{
+        struct lease_options options = {
+                .card = "/dev/dri/card0",
+                .connector = 0,
+        };
+        uint32_t lessee_id;
+        int fd, lease_fd;
+        int status;
+
+        if (process_options(&options, argc, argv))
+                return EXIT_FAILURE;
+
+        fd = open(options.card, O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+                fprintf(stderr, "cannot open '%s': %m\n", options.card);
+                return EXIT_FAILURE;
+        }
+
+        /* The primary planes are only listed with universal planes */
+        if (drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1)) {
+                fprintf(stderr, "error setting universal planes cap: %m\n");
+                close(fd);
+                return EXIT_FAILURE;
+        }
+
+        lease_fd = create_lease(fd, &options, &lessee_id);
+        if (lease_fd < 0) {
+                close(fd);
+                return EXIT_FAILURE;
+        }
+
+        status = run_program(lease_fd, argc - optind, argv + optind);
+
+        /* This fails harmlessly if the lease already went away with
+         * the program */
+        drmModeRevokeLease(fd, lessee_id);
+        close(fd);
+
+        return status;
+}
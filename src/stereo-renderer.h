@@ -8,6 +8,17 @@
 #ifndef STEREO_RENDERER_H
 #define STEREO_RENDERER_H
 
+#include <stdint.h>
+
+/* An image in memory with 8-bit RGB or RGBA pixels */
+struct stereo_image
+{
+        int width, height;
+        int rowstride;
+        int n_channels;
+        const uint8_t *pixels;
+};
+
 struct stereo_renderer
 {
         const char *name;
@@ -16,11 +27,25 @@ struct stereo_renderer
         void *(* new)(void);
         int (* handle_option)(void *renderer, int opt);
         int (* connect)(void *renderer);
+        /* present_time is the CLOCK_MONOTONIC time in nanoseconds
+         * at which the frame is expected to be shown, or 0 if it
+         * isn't known */
         void (* draw_frame)(void *renderer,
-                            int frame_num);
+                            int frame_num,
+                            uint64_t present_time);
         void (* resize)(void *renderer,
                         int width, int height);
         void (* free)(void *renderer);
+        /* Optional. Gets an image for each eye if the renderer
+         * always draws the same frame, so that a winsys can show
+         * them without drawing. The images stay valid until the
+         * next call to draw_frame. Returns 0 on success. */
+        int (* get_static_images)(void *renderer,
+                                  struct stereo_image *images);
+        /* Optional. Blocks until anything that is loaded in the
+         * background, such as programs that are still building, is
+         * ready so that the following frames are drawn in full. */
+        void (* finish_loading)(void *renderer);
 };
 
 extern const struct stereo_renderer const *
@@ -8,12 +8,25 @@
 #ifndef STEREO_WINSYS_H
 #define STEREO_WINSYS_H
 
+#include <stdint.h>
+
+struct stereo_image;
+
 struct stereo_winsys_callbacks
 {
         void (* update_size)(void *data,
                              int width,
                              int height);
-        void (* draw)(void *data);
+        void (* draw)(void *data,
+                      uint64_t present_time);
+        /* Gets a static image for each eye from the renderer.
+         * Returns 0 on success or an error if the renderer's frames
+         * can change. */
+        int (* get_static_images)(void *data,
+                                  struct stereo_image *images);
+        /* Waits until the renderer draws its real frames instead of
+         * placeholders, for example before timing it */
+        void (* finish_loading)(void *data);
 };
 
 struct stereo_winsys
@@ -11,9 +11,115 @@
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+#include <EGL/egl.h>
 
 #include "util.h"
 
+#define MAX_ATTRIBS 16
+#define MAX_TEXTURE_UNITS 8
+
+#define PROGRAM_CACHE_DIR "programs"
+#define PROGRAM_CACHE_MAGIC 0x50435343
+
+struct program_cache_header {
+        uint32_t magic;
+        uint32_t format;
+        uint32_t length;
+};
+
+struct program_cache {
+        int initialized;
+        int enabled;
+
+        char *dir;
+
+        PFNGLGETPROGRAMBINARYOESPROC get_program_binary;
+        PFNGLPROGRAMBINARYOESPROC program_binary;
+};
+
+static struct program_cache program_cache;
+
+/* Shadow copy of the GL state that is set through the gl_state_*
+ * functions. Each piece of state has a bit in the valid mask which is
+ * only set once the value is known so that nothing needs to be
+ * queried from GL. */
+enum gl_state_bit {
+        GL_STATE_PROGRAM = (1 << 0),
+        GL_STATE_ARRAY_BUFFER = (1 << 1),
+        GL_STATE_ELEMENT_ARRAY_BUFFER = (1 << 2),
+        GL_STATE_ENABLED_ATTRIBS = (1 << 3),
+        GL_STATE_DEPTH_FUNC = (1 << 4),
+        GL_STATE_DEPTH_MASK = (1 << 5),
+        GL_STATE_COLOR_MASK = (1 << 6),
+        GL_STATE_CLEAR_COLOR = (1 << 7),
+        GL_STATE_CLEAR_DEPTH = (1 << 8),
+        GL_STATE_VIEWPORT = (1 << 9),
+        GL_STATE_ACTIVE_TEXTURE = (1 << 10)
+};
+
+enum gl_state_cap {
+        GL_STATE_CAP_DEPTH_TEST,
+        GL_STATE_CAP_CULL_FACE,
+        GL_STATE_CAP_BLEND,
+        GL_STATE_CAP_SCISSOR_TEST,
+        GL_STATE_CAP_STENCIL_TEST,
+        GL_STATE_N_CAPS
+};
+
+struct gl_state_attrib {
+        int valid;
+        GLuint buffer;
+        GLint size;
+        GLenum type;
+        GLboolean normalized;
+        GLsizei stride;
+        const void *pointer;
+};
+
+struct gl_state {
+        unsigned int valid;
+
+        GLuint program;
+        GLuint array_buffer;
+        GLuint element_array_buffer;
+
+        /* The number of attributes that are tracked. This is
+         * GL_MAX_VERTEX_ATTRIBS up to MAX_ATTRIBS, or 0 until it has
+         * been queried. */
+        int n_attribs;
+        unsigned int enabled_attribs;
+        struct gl_state_attrib attribs[MAX_ATTRIBS];
+
+        unsigned int caps_valid;
+        unsigned int caps_enabled;
+
+        GLenum depth_func;
+        GLboolean depth_mask;
+        GLboolean color_mask[4];
+        GLfloat clear_color[4];
+        GLfloat clear_depth;
+        GLint viewport[4];
+
+        int active_texture;
+        unsigned int textures_valid;
+        GLuint textures[MAX_TEXTURE_UNITS];
+
+        struct gl_state_stats stats;
+        struct gl_state_stats frame_stats;
+};
+
+static struct gl_state gl_state;
+
+static int parallel_compile_initialized;
+static int parallel_compile_supported;
+
 void *
 xmalloc(size_t size)
 {
@@ -51,75 +157,580 @@ extension_in_list(const char *ext, const char *exts)
         }
 }
 
+static int
+make_directory(const char *path)
+{
+        if (mkdir(path, 0755) == -1 && errno != EEXIST)
+                return -errno;
+
+        return 0;
+}
+
+char *
+get_cache_path(const char *name)
+{
+        const char *base = getenv("XDG_CACHE_HOME");
+        const char *home;
+        char *path;
+
+        if (base == NULL || *base == '\0') {
+                home = getenv("HOME");
+                if (home == NULL)
+                        return NULL;
+
+                path = xmalloc(strlen(home) + strlen(name) + 64);
+                sprintf(path, "%s/.cache", home);
+        } else {
+                path = xmalloc(strlen(base) + strlen(name) + 64);
+                strcpy(path, base);
+        }
+
+        if (make_directory(path))
+                goto error;
+
+        strcat(path, "/stereo-cube");
+
+        if (make_directory(path))
+                goto error;
+
+        strcat(path, "/");
+        strcat(path, name);
+
+        return path;
+
+error:
+        free(path);
+        return NULL;
+}
+
+static uint64_t
+hash_string(uint64_t hash, const char *str)
+{
+        /* 64-bit FNV-1a. The terminating zero is included so that
+         * the boundaries between the strings are part of the hash. */
+        do {
+                hash ^= (uint8_t) *str;
+                hash *= UINT64_C(0x100000001b3);
+        } while (*(str++));
+
+        return hash;
+}
+
+static char *
+get_driver_string(void)
+{
+        const char *strings[] = {
+                (const char *) glGetString(GL_VENDOR),
+                (const char *) glGetString(GL_RENDERER),
+                (const char *) glGetString(GL_VERSION),
+        };
+        size_t length = 1;
+        char *result;
+        int i;
+
+        for (i = 0; i < sizeof strings / sizeof strings[0]; i++) {
+                if (strings[i] == NULL)
+                        strings[i] = "";
+                length += strlen(strings[i]) + 1;
+        }
+
+        result = xmalloc(length);
+        *result = '\0';
+
+        for (i = 0; i < sizeof strings / sizeof strings[0]; i++) {
+                strcat(result, strings[i]);
+                strcat(result, "\n");
+        }
+
+        return result;
+}
+
+static char *
+read_file(const char *filename, size_t *length_out)
+{
+        FILE *file = fopen(filename, "rb");
+        size_t length = 0, got;
+        char *data = NULL;
+
+        if (file == NULL)
+                return NULL;
+
+        do {
+                data = realloc(data, length + 1024 + 1);
+                if (data == NULL)
+                        abort();
+                got = fread(data + length, 1, 1024, file);
+                length += got;
+        } while (got == 1024);
+
+        fclose(file);
+
+        data[length] = '\0';
+
+        if (length_out)
+                *length_out = length;
+
+        return data;
+}
+
+int
+write_file(const char *filename, const void *data, size_t length)
+{
+        char *tmp_filename = xmalloc(strlen(filename) + 5);
+        FILE *file;
+        int ret = 0;
+
+        /* The file is written under a temporary name and then
+         * renamed so that a partial file is never seen */
+        strcpy(tmp_filename, filename);
+        strcat(tmp_filename, ".tmp");
+
+        file = fopen(tmp_filename, "wb");
+        if (file == NULL) {
+                ret = -errno;
+                goto out;
+        }
+
+        if (fwrite(data, 1, length, file) != length)
+                ret = -EIO;
+
+        if (fclose(file) && ret == 0)
+                ret = -EIO;
+
+        if (ret == 0 && rename(tmp_filename, filename))
+                ret = -errno;
+
+        if (ret)
+                unlink(tmp_filename);
+
+out:
+        free(tmp_filename);
+        return ret;
+}
+
+static void
+clear_program_cache(const char *dir)
+{
+        struct dirent *entry;
+        char *filename;
+        DIR *dp;
+
+        dp = opendir(dir);
+        if (dp == NULL)
+                return;
+
+        while ((entry = readdir(dp))) {
+                if (entry->d_name[0] == '.')
+                        continue;
+
+                filename = xmalloc(strlen(dir) + strlen(entry->d_name) + 2);
+                sprintf(filename, "%s/%s", dir, entry->d_name);
+                unlink(filename);
+                free(filename);
+        }
+
+        closedir(dp);
+}
+
+static void
+check_program_cache_driver(struct program_cache *cache)
+{
+        char *driver_string = get_driver_string();
+        char *filename = xmalloc(strlen(cache->dir) + 8);
+        char *old_driver_string;
+
+        sprintf(filename, "%s/driver", cache->dir);
+
+        /* If the driver has changed since the cache was written then
+         * none of the binaries will be usable so they are deleted */
+        old_driver_string = read_file(filename, NULL);
+
+        if (old_driver_string == NULL ||
+            strcmp(old_driver_string, driver_string)) {
+                clear_program_cache(cache->dir);
+                write_file(filename, driver_string, strlen(driver_string));
+        }
+
+        free(old_driver_string);
+        free(driver_string);
+        free(filename);
+}
+
+static void
+init_program_cache(struct program_cache *cache)
+{
+        const char *exts = (const char *) glGetString(GL_EXTENSIONS);
+        GLint n_formats = 0;
+
+        cache->initialized = 1;
+
+        if (!extension_in_list("GL_OES_get_program_binary", exts))
+                return;
+
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &n_formats);
+        if (n_formats < 1)
+                return;
+
+        cache->dir = get_cache_path(PROGRAM_CACHE_DIR);
+        if (cache->dir == NULL || make_directory(cache->dir))
+                return;
+
+        cache->get_program_binary =
+                (void *) eglGetProcAddress("glGetProgramBinaryOES");
+        cache->program_binary =
+                (void *) eglGetProcAddress("glProgramBinaryOES");
+
+        check_program_cache_driver(cache);
+
+        cache->enabled = 1;
+}
+
+static uint64_t
+get_program_key(const char *header,
+                const char *vertex_source,
+                const char *fragment_source,
+                const char **attribs,
+                int n_attribs)
+{
+        uint64_t hash = UINT64_C(0xcbf29ce484222325);
+        int i;
+
+        hash = hash_string(hash, (const char *) glGetString(GL_VENDOR));
+        hash = hash_string(hash, (const char *) glGetString(GL_RENDERER));
+        hash = hash_string(hash, (const char *) glGetString(GL_VERSION));
+        hash = hash_string(hash, header);
+        hash = hash_string(hash, vertex_source);
+        hash = hash_string(hash, fragment_source);
+
+        for (i = 0; i < n_attribs; i++)
+                hash = hash_string(hash, attribs[i]);
+
+        return hash;
+}
+
+static char *
+get_program_filename(const struct program_cache *cache, uint64_t key)
+{
+        char *filename = xmalloc(strlen(cache->dir) + 32);
+
+        sprintf(filename, "%s/%016llx", cache->dir, (unsigned long long) key);
+
+        return filename;
+}
+
+static int
+load_program_binary(const struct program_cache *cache,
+                    GLuint program,
+                    uint64_t key)
+{
+        char *filename = get_program_filename(cache, key);
+        const struct program_cache_header *header;
+        size_t length;
+        char *data;
+        GLint status = 0;
+
+        data = read_file(filename, &length);
+        if (data == NULL)
+                goto out;
+
+        header = (const struct program_cache_header *) data;
+
+        if (length >= sizeof *header &&
+            header->magic == PROGRAM_CACHE_MAGIC &&
+            header->length == length - sizeof *header) {
+                cache->program_binary(program,
+                                      header->format,
+                                      header + 1,
+                                      header->length);
+                glGetProgramiv(program, GL_LINK_STATUS, &status);
+        }
+
+        /* The driver is allowed to reject binaries at any time so a
+         * failure is not an error. The entry is just replaced. */
+        if (!status)
+                unlink(filename);
+
+        free(data);
+
+out:
+        free(filename);
+        return status;
+}
+
+static void
+save_program_binary(const struct program_cache *cache,
+                    GLuint program,
+                    uint64_t key)
+{
+        struct program_cache_header *header;
+        GLint length = 0;
+        GLsizei got_length;
+        GLenum format;
+        char *filename;
+
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+        if (length <= 0)
+                return;
+
+        header = xmalloc(sizeof *header + length);
+
+        cache->get_program_binary(program,
+                                  length,
+                                  &got_length,
+                                  &format,
+                                  header + 1);
+
+        header->magic = PROGRAM_CACHE_MAGIC;
+        header->format = format;
+        header->length = got_length;
+
+        filename = get_program_filename(cache, key);
+        write_file(filename, header, sizeof *header + got_length);
+        free(filename);
+
+        free(header);
+}
+
+static void
+warm_up_program(GLuint program)
+{
+        GLint old_program;
+        GLboolean color_mask[4], depth_mask;
+
+        /* Some drivers only finish preparing a program loaded from a
+         * binary the first time it is used to draw. A degenerate
+         * triangle is drawn with writes disabled so that this
+         * happens now instead of during the first frame. */
+        glGetIntegerv(GL_CURRENT_PROGRAM, &old_program);
+        glGetBooleanv(GL_COLOR_WRITEMASK, color_mask);
+        glGetBooleanv(GL_DEPTH_WRITEMASK, &depth_mask);
+
+        gl_state_enable_attribs(0);
+
+        glUseProgram(program);
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        glDepthMask(GL_FALSE);
+
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+
+        glColorMask(color_mask[0], color_mask[1],
+                    color_mask[2], color_mask[3]);
+        glDepthMask(depth_mask);
+        glUseProgram(old_program);
+}
+
+struct pending_program {
+        GLuint program;
+        GLuint shaders[2];
+
+        /* Set if the program was loaded from the cache. Otherwise it
+         * is saved there once it has linked. */
+        int from_cache;
+        uint64_t key;
+};
+
+static void
+init_parallel_compile(void)
+{
+        const char *exts = (const char *) glGetString(GL_EXTENSIONS);
+        PFNGLMAXSHADERCOMPILERTHREADSKHRPROC max_shader_compiler_threads;
+
+        parallel_compile_initialized = 1;
+
+        if (!extension_in_list("GL_KHR_parallel_shader_compile", exts))
+                return;
+
+        /* Let the driver use as many threads as it wants */
+        max_shader_compiler_threads =
+                (void *) eglGetProcAddress("glMaxShaderCompilerThreadsKHR");
+        max_shader_compiler_threads(0xffffffff);
+
+        parallel_compile_supported = 1;
+}
+
+/* Builds a string with a #define line for each of the feature
+ * flags. This is prepended to both shaders. */
+static char *
+get_defines_header(const char *const *defines)
+{
+        size_t length = 1;
+        char *header, *p;
+        int i;
+
+        for (i = 0; defines && defines[i]; i++)
+                length += sizeof "#define \n" - 1 + strlen(defines[i]);
+
+        p = header = xmalloc(length);
+
+        for (i = 0; defines && defines[i]; i++)
+                p += sprintf(p, "#define %s\n", defines[i]);
+
+        *p = '\0';
+
+        return header;
+}
+
 static GLuint
-create_shader(GLenum type, const char *source)
+start_shader(GLenum type, const char *header, const char *source)
 {
         GLuint shader = glCreateShader(type);
-        GLint length = strlen(source);
-        GLint status;
+        const char *strings[] = { header, source };
+        GLint lengths[] = { strlen(header), strlen(source) };
 
-        glShaderSource(shader, 1, &source, &length);
+        /* The compile status is not queried here so that the
+         * compile can continue in the background */
+        glShaderSource(shader, 2, strings, lengths);
         glCompileShader(shader);
 
+        return shader;
+}
+
+static void
+print_shader_errors(GLuint shader)
+{
+        char info_log[512];
+        GLsizei info_log_length;
+        GLint status;
+
         glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
 
-        if (status == 0) {
-                char info_log[512];
-                GLsizei info_log_length;
+        if (status)
+                return;
 
-                glGetShaderInfoLog(shader,
-                                    sizeof(info_log) - 1,
-                                    &info_log_length,
-                                    info_log);
-                fprintf(stderr, "%.*s\n", info_log_length, info_log);
+        glGetShaderInfoLog(shader,
+                           sizeof(info_log) - 1,
+                           &info_log_length,
+                           info_log);
+        fprintf(stderr, "%.*s\n", info_log_length, info_log);
+}
 
-                glDeleteShader(shader);
+static struct pending_program *
+submit_program_valist(const char *const *defines,
+                      const char *vertex_source,
+                      const char *fragment_source,
+                      va_list ap)
+{
+        struct program_cache *cache = &program_cache;
+        struct pending_program *pending = xmalloc(sizeof *pending);
+        const char *attribs[MAX_ATTRIBS];
+        char *header;
+        int n_attribs;
+        int i;
 
-                return 0;
+        for (n_attribs = 0; n_attribs < MAX_ATTRIBS; n_attribs++) {
+                attribs[n_attribs] = va_arg(ap, const char *);
+                if (attribs[n_attribs] == NULL)
+                        break;
         }
 
-        return shader;
+        if (!cache->initialized)
+                init_program_cache(cache);
+        if (!parallel_compile_initialized)
+                init_parallel_compile();
+
+        memset(pending, 0, sizeof *pending);
+
+        header = get_defines_header(defines);
+
+        pending->program = glCreateProgram();
+
+        if (cache->enabled) {
+                pending->key = get_program_key(header,
+                                               vertex_source,
+                                               fragment_source,
+                                               attribs,
+                                               n_attribs);
+
+                if (load_program_binary(cache,
+                                        pending->program,
+                                        pending->key)) {
+                        pending->from_cache = 1;
+                        free(header);
+                        return pending;
+                }
+
+                /* Start again with a fresh program in case the
+                 * failed binary left some state behind */
+                glDeleteProgram(pending->program);
+                pending->program = glCreateProgram();
+        }
+
+        pending->shaders[0] = start_shader(GL_VERTEX_SHADER,
+                                           header,
+                                           vertex_source);
+        pending->shaders[1] = start_shader(GL_FRAGMENT_SHADER,
+                                           header,
+                                           fragment_source);
+
+        free(header);
+
+        for (i = 0; i < 2; i++)
+                glAttachShader(pending->program, pending->shaders[i]);
+
+        for (i = 0; i < n_attribs; i++)
+                glBindAttribLocation(pending->program, i, attribs[i]);
+
+        glLinkProgram(pending->program);
+
+        return pending;
 }
 
-GLuint
-create_program(const char *vertex_source,
+struct pending_program *
+submit_program(const char *const *defines,
+               const char *vertex_source,
                const char *fragment_source,
                ...)
 {
-        GLuint shader, program;
-        GLint status;
-        const char *attrib;
+        struct pending_program *pending;
         va_list ap;
-        int i = 0;
 
-        program = glCreateProgram();
+        GL_DEBUG_PUSH_GROUP("submit program");
+        va_start(ap, fragment_source);
+        pending = submit_program_valist(defines,
+                                        vertex_source,
+                                        fragment_source,
+                                        ap);
+        va_end(ap);
+        GL_DEBUG_POP_GROUP();
 
-        shader = create_shader(GL_VERTEX_SHADER, vertex_source);
-        if (shader) {
-                glAttachShader(program, shader);
-                glDeleteShader(shader);
-        }
+        return pending;
+}
 
-        shader = create_shader(GL_FRAGMENT_SHADER, fragment_source);
-        if (shader) {
-                glAttachShader(program, shader);
-                glDeleteShader(shader);
-        }
+int
+pending_program_is_ready(struct pending_program *pending)
+{
+        GLint completed;
 
-        va_start(ap, fragment_source);
+        /* Without the extension there is no way to check without
+         * blocking so the program is reported as ready and the
+         * caller will wait in finish_program() */
+        if (!parallel_compile_supported || pending->from_cache)
+                return 1;
 
-        for (i = 0; (attrib = va_arg(ap, const char *)); i++)
-                glBindAttribLocation(program, i, attrib);
+        glGetProgramiv(pending->program, GL_COMPLETION_STATUS_KHR, &completed);
 
-        va_end(ap);
+        return completed;
+}
+
+GLuint
+finish_program(struct pending_program *pending)
+{
+        GLuint program = pending->program;
+        GLint status;
+        int i;
+
+        GL_DEBUG_PUSH_GROUP("finish program");
 
-        glLinkProgram(program);
         glGetProgramiv(program, GL_LINK_STATUS, &status);
 
         if (status == 0) {
                 char info_log[512];
                 GLsizei info_log_length;
 
+                for (i = 0; i < 2; i++)
+                        if (pending->shaders[i])
+                                print_shader_errors(pending->shaders[i]);
+
                 glGetProgramInfoLog(program,
                                     sizeof(info_log) - 1,
                                     &info_log_length,
@@ -127,9 +738,448 @@ create_program(const char *vertex_source,
                 fprintf(stderr, "%.*s\n", info_log_length, info_log);
 
                 glDeleteProgram(program);
+                program = 0;
+        } else if (pending->from_cache) {
+                warm_up_program(program);
+        } else if (program_cache.enabled) {
+                save_program_binary(&program_cache, program, pending->key);
+        }
+
+        for (i = 0; i < 2; i++)
+                if (pending->shaders[i])
+                        glDeleteShader(pending->shaders[i]);
+
+        free(pending);
+
+        GL_DEBUG_POP_GROUP();
+
+        return program;
+}
+
+GLuint
+create_program(const char *const *defines,
+               const char *vertex_source,
+               const char *fragment_source,
+               ...)
+{
+        struct pending_program *pending;
+        va_list ap;
+
+        GL_DEBUG_PUSH_GROUP("submit program");
+        va_start(ap, fragment_source);
+        pending = submit_program_valist(defines,
+                                        vertex_source,
+                                        fragment_source,
+                                        ap);
+        va_end(ap);
+        GL_DEBUG_POP_GROUP();
 
+        return finish_program(pending);
+}
+
+/* Records one call to the state tracker and returns whether it needs
+ * to reach GL */
+static int
+gl_state_check(int redundant)
+{
+        gl_state.frame_stats.calls++;
+
+        if (redundant) {
+                gl_state.frame_stats.filtered++;
                 return 0;
         }
 
-        return program;
+        return 1;
+}
+
+void
+gl_state_invalidate(void)
+{
+        gl_state.valid = 0;
+        gl_state.caps_valid = 0;
+        gl_state.textures_valid = 0;
+        memset(gl_state.attribs, 0, sizeof gl_state.attribs);
+}
+
+void
+gl_state_use_program(GLuint program)
+{
+        if (!gl_state_check((gl_state.valid & GL_STATE_PROGRAM) &&
+                            gl_state.program == program))
+                return;
+
+        glUseProgram(program);
+        gl_state.program = program;
+        gl_state.valid |= GL_STATE_PROGRAM;
+}
+
+void
+gl_state_bind_buffer(GLenum target, GLuint buffer)
+{
+        GLuint *binding;
+        enum gl_state_bit bit;
+
+        switch (target) {
+        case GL_ARRAY_BUFFER:
+                binding = &gl_state.array_buffer;
+                bit = GL_STATE_ARRAY_BUFFER;
+                break;
+        case GL_ELEMENT_ARRAY_BUFFER:
+                binding = &gl_state.element_array_buffer;
+                bit = GL_STATE_ELEMENT_ARRAY_BUFFER;
+                break;
+        default:
+                glBindBuffer(target, buffer);
+                return;
+        }
+
+        if (!gl_state_check((gl_state.valid & bit) && *binding == buffer))
+                return;
+
+        glBindBuffer(target, buffer);
+        *binding = buffer;
+        gl_state.valid |= bit;
+}
+
+/* GLES2 only guarantees 8 attributes so the indices above the
+ * driver's limit must never be touched */
+static int
+get_n_attribs(void)
+{
+        GLint max_attribs;
+
+        if (gl_state.n_attribs == 0) {
+                glGetIntegerv(GL_MAX_VERTEX_ATTRIBS, &max_attribs);
+                if (max_attribs < 1)
+                        max_attribs = 1;
+                else if (max_attribs > MAX_ATTRIBS)
+                        max_attribs = MAX_ATTRIBS;
+                gl_state.n_attribs = max_attribs;
+        }
+
+        return gl_state.n_attribs;
+}
+
+void
+gl_state_vertex_attrib_pointer(GLuint index,
+                               GLint size,
+                               GLenum type,
+                               GLboolean normalized,
+                               GLsizei stride,
+                               const void *pointer)
+{
+        struct gl_state_attrib *attrib;
+
+        if (index >= (GLuint) get_n_attribs() ||
+            !(gl_state.valid & GL_STATE_ARRAY_BUFFER)) {
+                glVertexAttribPointer(index, size, type, normalized,
+                                      stride, pointer);
+                if (index < (GLuint) get_n_attribs())
+                        gl_state.attribs[index].valid = 0;
+                return;
+        }
+
+        attrib = gl_state.attribs + index;
+
+        /* The attribute also latches the current array buffer */
+        if (!gl_state_check(attrib->valid &&
+                            attrib->buffer == gl_state.array_buffer &&
+                            attrib->size == size &&
+                            attrib->type == type &&
+                            attrib->normalized == normalized &&
+                            attrib->stride == stride &&
+                            attrib->pointer == pointer))
+                return;
+
+        glVertexAttribPointer(index, size, type, normalized, stride, pointer);
+
+        attrib->valid = 1;
+        attrib->buffer = gl_state.array_buffer;
+        attrib->size = size;
+        attrib->type = type;
+        attrib->normalized = normalized;
+        attrib->stride = stride;
+        attrib->pointer = pointer;
+}
+
+void
+gl_state_enable_attribs(unsigned int mask)
+{
+        unsigned int changed;
+        int n_attribs = get_n_attribs();
+        int i;
+
+        if (!(gl_state.valid & GL_STATE_ENABLED_ATTRIBS))
+                changed = (1u << n_attribs) - 1;
+        else
+                changed = gl_state.enabled_attribs ^ mask;
+
+        gl_state_check(changed == 0);
+
+        for (i = 0; changed && i < n_attribs; i++, changed >>= 1) {
+                if (!(changed & 1))
+                        continue;
+                if (mask & (1u << i))
+                        glEnableVertexAttribArray(i);
+                else
+                        glDisableVertexAttribArray(i);
+        }
+
+        gl_state.enabled_attribs = mask;
+        gl_state.valid |= GL_STATE_ENABLED_ATTRIBS;
+}
+
+static int
+get_cap_index(GLenum cap)
+{
+        switch (cap) {
+        case GL_DEPTH_TEST:
+                return GL_STATE_CAP_DEPTH_TEST;
+        case GL_CULL_FACE:
+                return GL_STATE_CAP_CULL_FACE;
+        case GL_BLEND:
+                return GL_STATE_CAP_BLEND;
+        case GL_SCISSOR_TEST:
+                return GL_STATE_CAP_SCISSOR_TEST;
+        case GL_STENCIL_TEST:
+                return GL_STATE_CAP_STENCIL_TEST;
+        }
+
+        return -1;
+}
+
+void
+gl_state_set_enabled(GLenum cap, int enabled)
+{
+        int index = get_cap_index(cap);
+        unsigned int bit;
+
+        if (index != -1) {
+                bit = 1u << index;
+
+                if (!gl_state_check((gl_state.caps_valid & bit) &&
+                                    !!(gl_state.caps_enabled & bit) ==
+                                    !!enabled))
+                        return;
+
+                gl_state.caps_valid |= bit;
+                if (enabled)
+                        gl_state.caps_enabled |= bit;
+                else
+                        gl_state.caps_enabled &= ~bit;
+        }
+
+        if (enabled)
+                glEnable(cap);
+        else
+                glDisable(cap);
+}
+
+void
+gl_state_depth_func(GLenum func)
+{
+        if (!gl_state_check((gl_state.valid & GL_STATE_DEPTH_FUNC) &&
+                            gl_state.depth_func == func))
+                return;
+
+        glDepthFunc(func);
+        gl_state.depth_func = func;
+        gl_state.valid |= GL_STATE_DEPTH_FUNC;
+}
+
+void
+gl_state_depth_mask(GLboolean mask)
+{
+        if (!gl_state_check((gl_state.valid & GL_STATE_DEPTH_MASK) &&
+                            gl_state.depth_mask == mask))
+                return;
+
+        glDepthMask(mask);
+        gl_state.depth_mask = mask;
+        gl_state.valid |= GL_STATE_DEPTH_MASK;
+}
+
+void
+gl_state_color_mask(GLboolean red,
+                    GLboolean green,
+                    GLboolean blue,
+                    GLboolean alpha)
+{
+        if (!gl_state_check((gl_state.valid & GL_STATE_COLOR_MASK) &&
+                            gl_state.color_mask[0] == red &&
+                            gl_state.color_mask[1] == green &&
+                            gl_state.color_mask[2] == blue &&
+                            gl_state.color_mask[3] == alpha))
+                return;
+
+        glColorMask(red, green, blue, alpha);
+        gl_state.color_mask[0] = red;
+        gl_state.color_mask[1] = green;
+        gl_state.color_mask[2] = blue;
+        gl_state.color_mask[3] = alpha;
+        gl_state.valid |= GL_STATE_COLOR_MASK;
+}
+
+void
+gl_state_clear_color(GLfloat red,
+                     GLfloat green,
+                     GLfloat blue,
+                     GLfloat alpha)
+{
+        if (!gl_state_check((gl_state.valid & GL_STATE_CLEAR_COLOR) &&
+                            gl_state.clear_color[0] == red &&
+                            gl_state.clear_color[1] == green &&
+                            gl_state.clear_color[2] == blue &&
+                            gl_state.clear_color[3] == alpha))
+                return;
+
+        glClearColor(red, green, blue, alpha);
+        gl_state.clear_color[0] = red;
+        gl_state.clear_color[1] = green;
+        gl_state.clear_color[2] = blue;
+        gl_state.clear_color[3] = alpha;
+        gl_state.valid |= GL_STATE_CLEAR_COLOR;
+}
+
+void
+gl_state_clear_depth(GLfloat depth)
+{
+        if (!gl_state_check((gl_state.valid & GL_STATE_CLEAR_DEPTH) &&
+                            gl_state.clear_depth == depth))
+                return;
+
+        glClearDepthf(depth);
+        gl_state.clear_depth = depth;
+        gl_state.valid |= GL_STATE_CLEAR_DEPTH;
+}
+
+void
+gl_state_viewport(GLint x, GLint y, GLsizei width, GLsizei height)
+{
+        if (!gl_state_check((gl_state.valid & GL_STATE_VIEWPORT) &&
+                            gl_state.viewport[0] == x &&
+                            gl_state.viewport[1] == y &&
+                            gl_state.viewport[2] == width &&
+                            gl_state.viewport[3] == height))
+                return;
+
+        glViewport(x, y, width, height);
+        gl_state.viewport[0] = x;
+        gl_state.viewport[1] = y;
+        gl_state.viewport[2] = width;
+        gl_state.viewport[3] = height;
+        gl_state.valid |= GL_STATE_VIEWPORT;
 }
+
+static void
+set_active_texture(int unit)
+{
+        if (!gl_state_check((gl_state.valid & GL_STATE_ACTIVE_TEXTURE) &&
+                            gl_state.active_texture == unit))
+                return;
+
+        glActiveTexture(GL_TEXTURE0 + unit);
+        gl_state.active_texture = unit;
+        gl_state.valid |= GL_STATE_ACTIVE_TEXTURE;
+}
+
+void
+gl_state_bind_texture(int unit, GLuint texture)
+{
+        unsigned int bit;
+
+        set_active_texture(unit);
+
+        if (unit >= MAX_TEXTURE_UNITS) {
+                glBindTexture(GL_TEXTURE_2D, texture);
+                return;
+        }
+
+        bit = 1u << unit;
+
+        if (!gl_state_check((gl_state.textures_valid & bit) &&
+                            gl_state.textures[unit] == texture))
+                return;
+
+        glBindTexture(GL_TEXTURE_2D, texture);
+        gl_state.textures[unit] = texture;
+        gl_state.textures_valid |= bit;
+}
+
+void
+gl_state_end_frame(void)
+{
+        gl_state.stats.calls += gl_state.frame_stats.calls;
+        gl_state.stats.filtered += gl_state.frame_stats.filtered;
+        gl_state.stats.frames++;
+
+        memset(&gl_state.frame_stats, 0, sizeof gl_state.frame_stats);
+}
+
+void
+gl_state_get_stats(struct gl_state_stats *stats)
+{
+        *stats = gl_state.stats;
+}
+
+#ifdef ENABLE_GL_DEBUG
+
+struct gl_debug {
+        int initialized;
+
+        PFNGLPUSHDEBUGGROUPKHRPROC push_debug_group;
+        PFNGLPOPDEBUGGROUPKHRPROC pop_debug_group;
+        PFNGLOBJECTLABELKHRPROC object_label;
+};
+
+static struct gl_debug gl_debug;
+
+static void
+init_gl_debug(void)
+{
+        const char *exts = (const char *) glGetString(GL_EXTENSIONS);
+
+        gl_debug.initialized = 1;
+
+        if (!extension_in_list("GL_KHR_debug", exts))
+                return;
+
+        gl_debug.push_debug_group =
+                (void *) eglGetProcAddress("glPushDebugGroupKHR");
+        gl_debug.pop_debug_group =
+                (void *) eglGetProcAddress("glPopDebugGroupKHR");
+        gl_debug.object_label =
+                (void *) eglGetProcAddress("glObjectLabelKHR");
+}
+
+void
+gl_debug_push_group(const char *name)
+{
+        if (!gl_debug.initialized)
+                init_gl_debug();
+
+        if (gl_debug.push_debug_group)
+                gl_debug.push_debug_group(GL_DEBUG_SOURCE_APPLICATION_KHR,
+                                          0, /* id */
+                                          -1, /* length */
+                                          name);
+}
+
+void
+gl_debug_pop_group(void)
+{
+        if (gl_debug.pop_debug_group)
+                gl_debug.pop_debug_group();
+}
+
+void
+gl_debug_label(GLenum identifier, GLuint name, const char *label)
+{
+        if (!gl_debug.initialized)
+                init_gl_debug();
+
+        if (gl_debug.object_label)
+                gl_debug.object_label(identifier, name, -1, label);
+}
+
+#endif /* ENABLE_GL_DEBUG */
@@ -16,9 +16,153 @@ xmalloc(size_t size);
 
 int
 extension_in_list(const char *ext, const char *exts);
+
+/* Returns a newly allocated path to a file in the stereo-cube cache
+ * directory, creating the directory if needed. Returns NULL if there
+ * is no cache directory. */
+char *
+get_cache_path(const char *name);
+
+/* Replaces a file so that a partially written file is never seen.
+ * Returns 0 or a negative errno value. */
+int
+write_file(const char *filename, const void *data, size_t length);
+
+/* Creates a program from the given sources. defines is a
+ * NULL-terminated list of feature flags, or NULL for none. Each entry
+ * is the text of a #define line such as "FOO" or "FOO 2" and is
+ * prepended to both shaders, so one source can be compiled into
+ * several variants. The attribute names are bound to consecutive
+ * locations starting from 0 and the list must be terminated with
+ * NULL. The linked program is cached on disk when
+ * GL_OES_get_program_binary is available. */
 GLuint
-create_program(const char *vertex_source,
+create_program(const char *const *defines,
+               const char *vertex_source,
                const char *fragment_source,
                ...);
 
+/* Starts building a program without waiting for the compile to
+ * finish. The arguments are the same as for create_program(). With
+ * GL_KHR_parallel_shader_compile the driver can build it in the
+ * background while the caller does other work. */
+struct pending_program *
+submit_program(const char *const *defines,
+               const char *vertex_source,
+               const char *fragment_source,
+               ...);
+
+/* Returns whether finish_program() can be called without blocking */
+int
+pending_program_is_ready(struct pending_program *pending);
+
+/* Waits for the program, reports any errors and frees the pending
+ * program. Returns 0 if the program failed to build. */
+GLuint
+finish_program(struct pending_program *pending);
+
+/* A small cache of GL state. Setting state through these functions
+ * skips the GL call when the value is already current. Anything that
+ * changes the same state directly must call gl_state_invalidate()
+ * afterwards. */
+struct gl_state_stats {
+        /* Number of calls made to the state tracker */
+        unsigned long calls;
+        /* Number of those that were redundant and never reached GL */
+        unsigned long filtered;
+        unsigned long frames;
+};
+
+void
+gl_state_invalidate(void);
+
+void
+gl_state_use_program(GLuint program);
+
+/* Only GL_ARRAY_BUFFER and GL_ELEMENT_ARRAY_BUFFER are cached */
+void
+gl_state_bind_buffer(GLenum target, GLuint buffer);
+
+void
+gl_state_vertex_attrib_pointer(GLuint index,
+                               GLint size,
+                               GLenum type,
+                               GLboolean normalized,
+                               GLsizei stride,
+                               const void *pointer);
+
+/* Enables the vertex attribute arrays in the mask and disables all
+ * of the others */
+void
+gl_state_enable_attribs(unsigned int mask);
+
+void
+gl_state_set_enabled(GLenum cap, int enabled);
+
+void
+gl_state_depth_func(GLenum func);
+
+void
+gl_state_depth_mask(GLboolean mask);
+
+void
+gl_state_color_mask(GLboolean red,
+                    GLboolean green,
+                    GLboolean blue,
+                    GLboolean alpha);
+
+void
+gl_state_clear_color(GLfloat red,
+                     GLfloat green,
+                     GLfloat blue,
+                     GLfloat alpha);
+
+void
+gl_state_clear_depth(GLfloat depth);
+
+void
+gl_state_viewport(GLint x, GLint y, GLsizei width, GLsizei height);
+
+/* Binds a GL_TEXTURE_2D texture to the given texture unit and makes
+ * that unit active so that the texture can be modified */
+void
+gl_state_bind_texture(int unit, GLuint texture);
+
+/* Adds the counters for the current frame to the totals */
+void
+gl_state_end_frame(void);
+
+void
+gl_state_get_stats(struct gl_state_stats *stats);
+
+/* Debug groups and object labels for GL_KHR_debug. These show up in
+ * captures from GPU debugging tools. They compile to nothing unless
+ * configured with --enable-gl-debug and do nothing at runtime when
+ * the extension is missing. */
+#ifdef ENABLE_GL_DEBUG
+
+void
+gl_debug_push_group(const char *name);
+
+void
+gl_debug_pop_group(void);
+
+/* identifier is one of the GL_KHR_debug object types, such as
+ * GL_TEXTURE or GL_BUFFER_KHR */
+void
+gl_debug_label(GLenum identifier, GLuint name, const char *label);
+
+#define GL_DEBUG_PUSH_GROUP(name) gl_debug_push_group(name)
+#define GL_DEBUG_POP_GROUP() gl_debug_pop_group()
+#define GL_DEBUG_LABEL(identifier, name, label) \
+        gl_debug_label((identifier), (name), (label))
+
+#else /* ENABLE_GL_DEBUG */
+
+#define GL_DEBUG_PUSH_GROUP(name) do { } while (0)
+#define GL_DEBUG_POP_GROUP() do { } while (0)
+#define GL_DEBUG_LABEL(identifier, name, label) do { } while (0)
+
+#endif /* ENABLE_GL_DEBUG */
+
 #endif /* UTIL_H */
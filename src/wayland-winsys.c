@@ -16,7 +16,12 @@
 #include <wayland-cursor.h>
 #include <string.h>
 #include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
 #include <linux/input.h>
 
 #include "wayland-winsys.h"
@@ -51,6 +56,11 @@ struct wayland_winsys {
         int fullscreen;
         struct geometry window_size;
         struct geometry old_size;
+
+        /* Set to draw the next frame straight away instead of
+         * waiting for the frame callback */
+        int immediate;
+        int n_frames;
 };
 
 struct seat {
@@ -67,6 +77,16 @@ static int quit = 0;
 
 static void redraw(struct wayland_winsys *winsys);
 
+static uint64_t
+get_time_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
 static int
 extension_supported(EGLDisplay edpy, const char *ext)
 {
@@ -91,6 +111,20 @@ wayland_winsys_new(const struct stereo_winsys_callbacks *callbacks,
         return winsys;
 }
 
+static int
+wayland_winsys_handle_option(void *data, int opt)
+{
+        struct wayland_winsys *winsys = data;
+
+        switch (opt) {
+        case 'i':
+                winsys->immediate = 1;
+                return 1;
+        }
+
+        return 0;
+}
+
 static void
 remove_seat(struct seat *seat)
 {
@@ -460,6 +494,11 @@ create_surface(struct wayland_winsys *winsys)
                             winsys->ctx))
                 return -1;
 
+        /* Without a swap interval eglSwapBuffers doesn't wait for
+         * the compositor to release a buffer */
+        if (winsys->immediate && !eglSwapInterval(winsys->edpy, 0))
+                fprintf(stderr, "error setting the swap interval\n");
+
         return 0;
 }
 
@@ -519,14 +558,46 @@ static const struct wl_callback_listener frame_listener = {
 static void
 redraw(struct wayland_winsys *winsys)
 {
-        winsys->callbacks->draw(winsys->cb_data);
-
-        winsys->frame_callback = wl_surface_frame(winsys->surface);
-        wl_callback_add_listener(winsys->frame_callback,
-                                 &frame_listener,
-                                 winsys);
+        winsys->callbacks->draw(winsys->cb_data, 0 /* present_time */);
+        winsys->n_frames++;
+
+        if (!winsys->immediate) {
+                winsys->frame_callback = wl_surface_frame(winsys->surface);
+                wl_callback_add_listener(winsys->frame_callback,
+                                         &frame_listener,
+                                         winsys);
+        }
 
+        GL_DEBUG_PUSH_GROUP("swap");
         eglSwapBuffers(winsys->edpy, winsys->egl_surface);
+        GL_DEBUG_POP_GROUP();
+}
+
+/* Handles the events that have already arrived without waiting for
+ * more */
+static int
+dispatch_pending_events(struct wayland_winsys *winsys)
+{
+        struct pollfd pfd;
+
+        while (wl_display_prepare_read(winsys->display) != 0)
+                if (wl_display_dispatch_pending(winsys->display) == -1)
+                        return -1;
+
+        wl_display_flush(winsys->display);
+
+        pfd.fd = wl_display_get_fd(winsys->display);
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, 0) > 0) {
+                if (wl_display_read_events(winsys->display) == -1)
+                        return -1;
+        } else {
+                wl_display_cancel_read(winsys->display);
+        }
+
+        return wl_display_dispatch_pending(winsys->display);
 }
 
 static void
@@ -537,19 +608,33 @@ wayland_winsys_main_loop(void *data)
                 .sa_handler = sigint_handler,
         };
         struct sigaction old_action;
+        uint64_t start_time;
 
         sigemptyset(&action.sa_mask);
         sigaction(SIGINT, &action, &old_action);
 
         update_size(winsys);
 
+        start_time = get_time_ns();
+
         redraw(winsys);
 
         while (!quit) {
-                if (wl_display_dispatch(winsys->display) == -1)
+                /* In immediate mode the next frame is drawn as soon
+                 * as the last one is submitted */
+                if (winsys->immediate) {
+                        if (dispatch_pending_events(winsys) == -1)
+                                break;
+                        redraw(winsys);
+                } else if (wl_display_dispatch(winsys->display) == -1) {
                         break;
+                }
         }
 
+        if (winsys->n_frames > 1)
+                printf("%.1f frames per second\n",
+                       winsys->n_frames * 1e9 / (get_time_ns() - start_time));
+
         sigaction(SIGINT, &old_action, NULL);
 }
 
@@ -565,7 +650,13 @@ wayland_winsys_free(void *data)
 const struct stereo_winsys
 wayland_winsys = {
         .name = "wayland",
+        .options = "i",
+        .options_desc =
+        "  -i              Draw frames as fast as possible instead of "
+        "waiting for\n"
+        "                  the compositor\n",
         .new = wayland_winsys_new,
+        .handle_option = wayland_winsys_handle_option,
         .connect = wayland_winsys_connect,
         .main_loop = wayland_winsys_main_loop,
         .free = wayland_winsys_free